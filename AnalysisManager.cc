@@ -0,0 +1,586 @@
+#include "AnalysisManager.hh"
+#include "PerfReport.hh"
+#include "Checkpoint.hh"
+
+#include "TSystem.h"
+
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char* StageName[] = {"load", "profiles", "correction", "scan", "draw"};
+
+//---------------------------------------------------------------------------------------------------------------
+AnalysisManager::AnalysisManager(const std::string& configname):
+fConfigName(configname),
+fconfig(configname),
+fdata(0),
+fdata_amw(0),
+fserved(0),
+fmg(0),
+fcanvas(0)
+{
+   fconfig.calculateFormulas();
+   fmtime = GetConfigMTime();
+   fperf_report = fconfig.read<string>("perf_report","");
+
+   //a checkpoint is resumed only by a job whose keys affecting the results are the same
+   string checkpoint = fconfig.read<string>("checkpoint","");
+   if(checkpoint!="")
+   {
+      ULong64_t key = 14695981039346656037ULL;   //FNV-1a of "key=value\n" in key order
+      for(std::map<string,string>::const_iterator it=fconfig.myContents.begin(); it!=fconfig.myContents.end(); ++it)
+      {
+         if(StageOf(it->first)==kNone)
+            continue;
+         string line = it->first+"="+it->second+"\n";
+         for(unsigned k=0; k<line.size(); k++)
+            key = (key^(unsigned char)line[k])*1099511628211ULL;
+      }
+      Checkpoint::Instance().Open(checkpoint,fconfig.read<double>("checkpoint_interval",300),key);
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+AnalysisManager::~AnalysisManager()
+{
+   delete fmg;
+   delete fcanvas;
+   SetServed(0);
+   delete fdata_amw;
+   delete fdata;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int AnalysisManager::StageOf(const std::string& key)
+{
+   //first stage that depends on each key, everything after it is recomputed as well
+   static std::map<string,int> deps;
+   if(deps.empty())
+   {
+      deps["amp_min"] = kProfiles;
+      deps["amp_max"] = kProfiles;
+      deps["risetime_min"] = kProfiles;
+      deps["risetime_max"] = kProfiles;
+      deps["amp_min_fit"] = kCorrection;
+      deps["correction"] = kCorrection;
+      deps["ml_fit_min"] = kScan;
+      deps["ml_fit_max"] = kScan;
+      deps["combine_thresholds"] = kScan;
+      deps["arrow_export"] = kScan;
+      deps["arrow_chunk"] = kScan;
+      deps["time_min"] = kDraw;
+      deps["time_max"] = kDraw;
+      deps["interactive"] = kNone;
+      deps["perf_report"] = kNone;
+      deps["server"] = kNone;
+      deps["checkpoint"] = kNone;
+      deps["checkpoint_interval"] = kNone;
+   }
+   std::map<string,int>::const_iterator it = deps.find(key);
+   //anything else (Filename, thr, time_offset, ...) needs the data to be reloaded
+   if(it==deps.end())
+      return kLoad;
+   return it->second;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Run(int from)
+{
+   {
+      PerfScope perf("Run");
+      if(from<=kLoad) Load();
+      if(from<=kProfiles) UpdateProfiles();
+      if(from<=kCorrection) Correct();
+      if(from<=kScan) Scan();
+      if(from<=kDraw) Draw();
+   }
+   //complete: a later job starts from scratch, a reload recomputes without checkpoints
+   Checkpoint::Instance().Close();
+   if(fperf_report!="")
+      PerfReport::Instance().WriteJSON(fperf_report);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool AnalysisManager::CheckReload()
+{
+   Long_t mtime = GetConfigMTime();
+   if(mtime==fmtime)
+      return false;
+
+   //the file may be in the middle of being rewritten, retry at the next poll
+   ConfigFile newconfig;
+   try
+   {
+      newconfig = ConfigFile(fConfigName);
+   }
+   catch(ConfigFile::file_not_found& e)
+   {
+      return false;
+   }
+   fmtime = mtime;
+   newconfig.calculateFormulas();
+
+   int from = kNone;
+   std::map<string,string>::const_iterator it;
+   for(it=newconfig.myContents.begin(); it!=newconfig.myContents.end(); ++it)
+   {
+      std::map<string,string>::const_iterator old = fconfig.myContents.find(it->first);
+      if(old==fconfig.myContents.end() || old->second!=it->second)
+      {
+         cout<<"> Config key <"<<it->first<<"> changed"<<endl;
+         from = min(from,StageOf(it->first));
+      }
+   }
+   for(it=fconfig.myContents.begin(); it!=fconfig.myContents.end(); ++it)
+      if(!newconfig.keyExists(it->first))
+      {
+         cout<<"> Config key <"<<it->first<<"> removed"<<endl;
+         from = min(from,StageOf(it->first));
+      }
+
+   fconfig = newconfig;
+   if(from==kNone)
+      return false;
+
+   cout<<"> Configuration changed, recomputing from stage <"<<StageName[from]<<">"<<endl;
+   Run(from);
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Long_t AnalysisManager::GetConfigMTime() const
+{
+   FileStat_t stat;
+   if(gSystem->GetPathInfo(fConfigName.c_str(),stat)!=0)
+      return -1;
+   return stat.fMtime;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Load()
+{
+   SetServed(0);
+   delete fdata_amw;
+   fdata_amw = 0;
+   delete fdata;
+   fdata = new EvAnalyz(fconfig);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::UpdateProfiles()
+{
+   float amp_min = fconfig.read<float>("amp_min",fdata->GetAmpMin());
+   float amp_max = fconfig.read<float>("amp_max",fdata->GetAmpMax());
+   if(amp_min!=fdata->GetAmpMin() || amp_max!=fdata->GetAmpMax())
+      fdata->SetAmpRange(amp_min,amp_max);
+
+   float risetime_min = fconfig.read<float>("risetime_min",fdata->GetRiseTimeMin());
+   float risetime_max = fconfig.read<float>("risetime_max",fdata->GetRiseTimeMax());
+   if(risetime_min!=fdata->GetRiseTimeMin() || risetime_max!=fdata->GetRiseTimeMax())
+      fdata->SetRiseTimeRange(risetime_min,risetime_max);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Correct()
+{
+   //corrections applied in the order of <correction>, amplitude walk only by default
+   vector<string> path;
+   if(fconfig.keyExists("correction"))
+      fconfig.readIntoVect(path,"correction");
+   if(path.empty())
+      path.push_back("amw");
+
+   SetServed(0);
+   delete fdata_amw;
+   fdata_amw = 0;
+   EvAnalyz* data = fdata;
+   for(unsigned k=0; k<path.size(); k++)
+   {
+      EvAnalyz* corrected = ApplyCorrection(data,path[k]);
+      if(data!=fdata)
+         delete data;
+      data = corrected;
+   }
+   fdata_amw = data;
+   //scan and plots use every product of the corrected dataset: one pass fills them all
+   fdata_amw->Request(EvAnalyz::kAllProducts);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+EvAnalyz* AnalysisManager::ApplyCorrection(EvAnalyz* data, const std::string& name)
+{
+   if(name=="amw")
+      return new EvAnalyz(data->AmpCorrection());
+   if(name=="mitamw")
+      return new EvAnalyz(data->MitigatedAmpCorrection(fconfig.read<float>("amp_min_fit",data->GetAmpMin()),data->GetAmpMax()));
+   if(name=="poscorr")
+      return new EvAnalyz(data->PosCorrection());
+   if(name=="risetimecorr")
+      return new EvAnalyz(data->RiseTimeCorrection());
+   if(name=="jointcorr")
+      return new EvAnalyz(data->JointCorrection());
+   cerr<<"[ERROR]: unknown correction "<<name<<", use amw, mitamw, poscorr, risetimecorr or jointcorr"<<endl;
+   exit(EXIT_FAILURE);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Scan()
+{
+   if(fconfig.keyExists("ml_fit_min") && fconfig.keyExists("ml_fit_max"))
+      fdata_amw->SetUnbinnedFitRange(fconfig.read<float>("ml_fit_min"),fconfig.read<float>("ml_fit_max"));
+   else
+      fdata_amw->SetUnbinnedFitRange(0,0);
+
+   //optimal combination of the thresholds, available as the column LDEcomb
+   if(fconfig.read<bool>("combine_thresholds",false))
+      fdata_amw->CombineThresholds();
+
+   //corrected columns for the tools reading Arrow, with LDEcomb if just combined
+   string arrow = fconfig.read<string>("arrow_export","");
+   if(arrow!="")
+      fdata_amw->ExportArrow(arrow,fconfig.read<int>("arrow_chunk",1<<20));
+
+   //the multigraph owns the graphs of the previous scan
+   delete fmg;
+   fgr_rms = fdata_amw->ThrScan("rms");
+   fgr_fit = fdata_amw->ThrScan("fit");
+   fgr_smallint = fdata_amw->ThrScan("smallestinterval");
+   fgr_unbinned = fdata_amw->ThrScan("unbinned");
+
+   fgr_rms->SetMarkerStyle(20);
+   fgr_fit->SetMarkerStyle(20);
+   fgr_smallint->SetMarkerStyle(20);
+   fgr_unbinned->SetMarkerStyle(20);
+
+   fgr_rms->SetMarkerColor(1);
+   fgr_fit->SetMarkerColor(2);
+   fgr_smallint->SetMarkerColor(3);
+   fgr_unbinned->SetMarkerColor(4);
+
+   fmg = new TMultiGraph();
+   fmg->Add(fgr_rms);
+   fmg->Add(fgr_fit);
+   fmg->Add(fgr_smallint);
+   fmg->Add(fgr_unbinned);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Draw()
+{
+   float time_min = fconfig.read<float>("time_min",0.);
+   float time_max = fconfig.read<float>("time_max",2.);
+   {
+      PerfScope perf("DrawThrScan");
+      if(!fcanvas)
+         fcanvas = new TCanvas();
+      fcanvas->cd();
+      fcanvas->Clear();
+      fmg->Draw("APL");
+      fcanvas->Print("RMS.pdf");
+   }
+
+   fdata_amw->DrawHistos();
+   fdata_amw->DrawProfiles(time_min,time_max);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::SetServed(EvAnalyz* data)
+{
+   //the datasets corrected on request belong to the server
+   if(fserved && fserved!=fdata_amw && fserved!=data)
+      delete fserved;
+   fserved = data;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+static const int kRequestTimeout = 5;            // seconds a client has to send its request or read the answer
+static const size_t kMaxRequest = 64*1024;       // bytes of a request line
+
+// the request line without its newline: 1 when complete (or ended by the client closing its
+// side), 0 if the client sent nothing or went silent for kRequestTimeout, -1 if the line
+// exceeds kMaxRequest
+static int ReadRequest(int client, std::string& request)
+{
+   timeval timeout;
+   timeout.tv_sec = kRequestTimeout;
+   timeout.tv_usec = 0;
+   setsockopt(client,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+   setsockopt(client,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+   char block[4096];
+   request.clear();
+   while(true)
+   {
+      ssize_t nbytes = read(client,block,sizeof(block));
+      if(nbytes==0)
+         return request.empty() ? 0 : 1;
+      if(nbytes<0)
+         return 0;
+      const char* end = (const char*)memchr(block,'\n',nbytes);
+      request.append(block,end ? end-block : nbytes);
+      if(request.size()>kMaxRequest)
+         return -1;
+      if(end)
+         return 1;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AnalysisManager::Serve(const std::string& socketname)
+{
+   //one request per connection: a line "command argument; key = value; ...", answered by
+   //"ok" or "error: <reason>" and then the result, one item per line
+   SetServed(fdata_amw);
+   fserved->MakeResident();
+
+   sockaddr_un addr;
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strncpy(addr.sun_path,socketname.c_str(),sizeof(addr.sun_path)-1);
+   unlink(socketname.c_str());
+   int server = socket(AF_UNIX,SOCK_STREAM,0);
+   if(server<0 || socketname.size()>=sizeof(addr.sun_path) || bind(server,(sockaddr*)&addr,sizeof(addr))<0 || listen(server,16)<0)
+   {
+      cerr<<"[ERROR]: cannot listen on "<<socketname<<endl;
+      exit(EXIT_FAILURE);
+   }
+   cout<<"> Serving "<<fserved->GetDataLabel()<<" on "<<socketname<<endl;
+
+   bool running = true;
+   while(running)
+   {
+      int client = accept(server,0,0);
+      if(client<0)
+         continue;
+      //a client that never finishes its line cannot hold the server
+      std::string request;
+      int status = ReadRequest(client,request);
+      if(status==0)
+      {
+         cerr<<"[WARNING]: incomplete request dropped"<<endl;
+         close(client);
+         continue;
+      }
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      std::string response;
+      if(status<0)
+      {
+         response = "error: request longer than "+std::to_string(kMaxRequest)+" bytes\n";
+         request = request.substr(0,64)+"...";
+      }
+      else
+         response = HandleRequest(request,running);
+      double ms = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-start).count();
+      //the client may be gone already: no SIGPIPE
+      size_t done = 0;
+      while(done<response.size())
+      {
+         ssize_t nbytes = send(client,response.data()+done,response.size()-done,MSG_NOSIGNAL);
+         if(nbytes<=0)
+            break;
+         done += nbytes;
+      }
+      close(client);
+      cout<<"> Request <"<<request<<"> answered in "<<ms<<" ms"<<endl;
+   }
+   close(server);
+   unlink(socketname.c_str());
+   if(fperf_report!="")
+      PerfReport::Instance().WriteJSON(fperf_report);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+static std::string Trim(const std::string& s)
+{
+   size_t first = s.find_first_not_of(" \t\r");
+   if(first==std::string::npos)
+      return "";
+   return s.substr(first,s.find_last_not_of(" \t\r")-first+1);
+}
+
+std::string AnalysisManager::HandleRequest(const std::string& request, bool& running)
+{
+   //requests:
+   //  info
+   //  scan <rms|fit|smallestinterval|unbinned>   ThrScan, one line "thr sigma error" per threshold
+   //  profile <amp|risetime|pos|histo>          bin contents, "center [center] content error"
+   //  profile res                               time resolution vs impact point, "x y rms width68 entries"
+   //  correct <amw|mitamw|poscorr|risetimecorr|jointcorr>   the corrected dataset answers from now on,
+   //                                            made from every event (the cut only applies to this request)
+   //  reset                                     back to the dataset of the configuration
+   //  quit
+   //options: cut = <expression> (none if missing), thr = <t1,t2,...> (all if missing)
+   std::vector<std::string> fields;
+   std::istringstream in(request);
+   std::string field;
+   while(std::getline(in,field,';'))
+      fields.push_back(Trim(field));
+   if(fields.empty() || fields[0].empty())
+      return "error: empty request\n";
+   std::string command = fields[0].substr(0,fields[0].find(' '));
+   std::string arg = fields[0].find(' ')==std::string::npos ? "" : Trim(fields[0].substr(fields[0].find(' ')));
+   std::map<std::string,std::string> opts;
+   for(unsigned k=1; k<fields.size(); k++)
+   {
+      size_t eq = fields[k].find('=');
+      if(eq==std::string::npos)
+         return "error: option <"+fields[k]+"> is not key = value\n";
+      opts[Trim(fields[k].substr(0,eq))] = Trim(fields[k].substr(eq+1));
+   }
+
+   std::vector<float> thr = fserved->GetThresholds();
+   if(opts.count("thr"))
+   {
+      std::string list = opts["thr"];
+      std::replace(list.begin(),list.end(),',',' ');
+      std::replace(list.begin(),list.end(),'|',' ');
+      std::istringstream values(list);
+      float value;
+      thr.clear();
+      while(values>>value)
+         thr.push_back(value);
+   }
+
+   std::ostringstream out;
+   if(command=="quit")
+   {
+      running = false;
+      return "ok\n";
+   }
+   if(command=="reset")
+   {
+      SetServed(fdata_amw);
+      command = "info";
+   }
+   if(command=="correct")
+   {
+      const char* names[] = {"amw","mitamw","poscorr","risetimecorr","jointcorr"};
+      if(std::find(names,names+5,arg)==names+5)
+         return "error: unknown correction "+arg+", use amw, mitamw, poscorr, risetimecorr or jointcorr\n";
+   }
+
+   //the cut of the request, the histograms and profiles are filled again only if it changed;
+   //a correction is made on the whole dataset and the cut then selects in the corrected one,
+   //which keeps every event for the requests that follow
+   std::string cut = opts.count("cut") ? opts["cut"] : "";
+   std::string error;
+   if(!fserved->CheckCut(cut,error))
+      return "error: cut <"+cut+">: "+error+"\n";
+   std::string datacut = command=="correct" ? "" : cut;
+   if(datacut!=fserved->GetCut())
+      fserved->SetCut(datacut,error);
+
+   if(command=="correct")
+   {
+      EvAnalyz* corrected = ApplyCorrection(fserved,arg);
+      corrected->MakeResident();
+      SetServed(corrected);
+      if(cut!="")
+         fserved->SetCut(cut,error);
+      command = "info";
+   }
+   if(command=="info")
+   {
+      out<<"ok\n";
+      out<<"label "<<fserved->GetDataLabel()<<"\n";
+      out<<"entries "<<fserved->GetEntries()<<"\n";
+      out<<"thr";
+      for(unsigned i=0; i<fserved->GetThresholds().size(); i++)
+         out<<" "<<fserved->GetThresholds()[i];
+      out<<"\n";
+      return out.str();
+   }
+   if(command=="scan")
+   {
+      std::string option = arg.empty() ? "rms" : arg;
+      if(option!="rms" && option!="fit" && option!="smallestinterval" && option!="unbinned")
+         return "error: unknown scan "+option+", use rms, fit, smallestinterval or unbinned\n";
+      TGraphErrors* gr = fserved->ThrScan(option);
+      out<<"ok\n";
+      for(int p=0; p<gr->GetN(); p++)
+         if(std::find(thr.begin(),thr.end(),(float)gr->GetX()[p])!=thr.end())
+            out<<gr->GetX()[p]<<" "<<gr->GetY()[p]<<" "<<gr->GetEY()[p]<<"\n";
+      delete gr;
+      return out.str();
+   }
+   if(command=="profile")
+   {
+      if(arg!="amp" && arg!="risetime" && arg!="pos" && arg!="histo" && arg!="res")
+         return "error: unknown profile "+arg+", use amp, risetime, pos, res or histo\n";
+      out<<"ok\n";
+      for(unsigned i=0; i<thr.size(); i++)
+      {
+         out<<"# thr = "<<thr[i]<<"\n";
+         if(arg=="pos")
+         {
+            TProfile2D* p = fserved->GetTimePosProfile(thr[i]);
+            if(!p)
+               return "error: no threshold "+std::to_string(thr[i])+"\n";
+            for(int bx=1; bx<=p->GetXaxis()->GetNbins(); bx++)
+               for(int by=1; by<=p->GetYaxis()->GetNbins(); by++)
+               {
+                  int bin = p->GetBin(bx,by);
+                  out<<p->GetXaxis()->GetBinCenter(bx)<<" "<<p->GetYaxis()->GetBinCenter(by)<<" "<<p->GetBinContent(bin)<<" "<<p->GetBinError(bin)<<"\n";
+               }
+            continue;
+         }
+         if(arg=="res")
+         {
+            TH2F* rms = fserved->ResolutionMap(thr[i],"rms");
+            TH2F* width = fserved->ResolutionMap(thr[i],"width68");
+            TH2F* entries = fserved->ResolutionMap(thr[i],"entries");
+            if(!rms)
+               return "error: no threshold "+std::to_string(thr[i])+"\n";
+            for(int bx=1; bx<=rms->GetXaxis()->GetNbins(); bx++)
+               for(int by=1; by<=rms->GetYaxis()->GetNbins(); by++)
+                  out<<rms->GetXaxis()->GetBinCenter(bx)<<" "<<rms->GetYaxis()->GetBinCenter(by)<<" "<<rms->GetBinContent(bx,by)<<" "
+                     <<width->GetBinContent(bx,by)<<" "<<entries->GetBinContent(bx,by)<<"\n";
+            continue;
+         }
+         TH1* h = 0;
+         if(arg=="amp")
+            h = fserved->GetTimeAmpProfile(thr[i]);
+         else if(arg=="risetime")
+            h = fserved->GetTimeRiseTimeProfile(thr[i]);
+         else
+            h = fserved->GetTimeHisto(thr[i]);
+         if(!h)
+            return "error: no threshold "+std::to_string(thr[i])+"\n";
+         for(int b=1; b<=h->GetXaxis()->GetNbins(); b++)
+            out<<h->GetXaxis()->GetBinCenter(b)<<" "<<h->GetBinContent(b)<<" "<<h->GetBinError(b)<<"\n";
+      }
+      return out.str();
+   }
+   return "error: unknown request "+command+", use info, scan, profile, correct, reset or quit\n";
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Bool_t ConfigWatcher::Notify()
+{
+   fmanager->CheckReload();
+   Reset();
+   return kTRUE;
+}
@@ -0,0 +1,74 @@
+#ifndef ANALYSISMANAGER_H
+#define ANALYSISMANAGER_H
+
+#include <string>
+#include <map>
+
+#include "ConfigFile.hh"
+#include "EvAnalyz.hh"
+#include "TGraphErrors.h"
+#include "TMultiGraph.h"
+#include "TCanvas.h"
+#include "TTimer.h"
+
+using namespace std;
+
+// Drives the analysis of test.cpp as a chain of stages. Each config key is mapped to the
+// first stage it affects, so that a modified configuration only recomputes from there on.
+// Serve keeps the corrected dataset resident and answers requests on a UNIX domain socket.
+class AnalysisManager
+{
+   public:
+      enum Stage {kLoad=0, kProfiles, kCorrection, kScan, kDraw, kNone};
+
+   // Data
+   protected:
+      std::string fConfigName;
+      ConfigFile fconfig;
+      Long_t fmtime;
+      EvAnalyz* fdata;
+      EvAnalyz* fdata_amw;
+      EvAnalyz* fserved;              // dataset answering the requests of Serve, fdata_amw unless corrected further
+      float famp_min, famp_max;
+      float frisetime_min, frisetime_max;
+      TGraphErrors* fgr_rms;
+      TGraphErrors* fgr_fit;
+      TGraphErrors* fgr_smallint;
+      TGraphErrors* fgr_unbinned;
+      TMultiGraph* fmg;
+      TCanvas* fcanvas;
+      std::string fperf_report;
+
+   // Methods
+   public:
+      AnalysisManager(const std::string& configname);
+      ~AnalysisManager();
+      void Run(int from=kLoad);
+      bool CheckReload();
+      static int StageOf(const std::string& key);
+      void Serve(const std::string& socketname);
+
+   protected:
+      void Load();
+      void UpdateProfiles();
+      void Correct();
+      EvAnalyz* ApplyCorrection(EvAnalyz* data, const std::string& name);
+      void Scan();
+      void Draw();
+      Long_t GetConfigMTime() const;
+      std::string HandleRequest(const std::string& request, bool& running);
+      void SetServed(EvAnalyz* data);
+};
+
+
+// Polls the configuration file from the ROOT event loop and triggers the reload
+class ConfigWatcher : public TTimer
+{
+   protected:
+      AnalysisManager* fmanager;
+   public:
+      ConfigWatcher(AnalysisManager* manager, Long_t ms=1000) : TTimer(ms,kTRUE), fmanager(manager) {};
+      Bool_t Notify();
+};
+
+#endif  // ANALYSISMANAGER_H
@@ -0,0 +1,336 @@
+#include "ArrowFile.hh"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+static const char kMagic[8] = {'A','R','R','O','W','1',0,0};
+static const Short_t kMetadataV5 = 4;
+enum MessageHeader {kHeaderSchema=1, kHeaderRecordBatch=3};
+enum TypeId {kTypeFloatingPoint=3};
+enum Precision {kPrecisionSingle=1};
+static const int kBufferAlign = 64;
+
+
+// A field of a flatbuffer table: a scalar of size bytes, or with size 0 the offset of an
+// object written after the table
+struct FlatField
+{
+   int id;
+   int size;
+   Long64_t value;
+   FlatField(int id_, int size_, Long64_t value_=0) : id(id_), size(size_), value(value_) {};
+};
+
+// Minimal flatbuffer writer for the Arrow metadata (format/Schema.fbs, Message.fbs, File.fbs).
+// The objects are appended front to back: a table is written before the objects it points
+// to, whose offsets are linked once they are written, so that every offset points forward.
+class FlatBuilder
+{
+   public:
+      std::vector<unsigned char> buf;
+
+      FlatBuilder() {Put<UInt_t>(0);};
+
+      void Align(size_t align)
+      {
+         while(buf.size()%align)
+            buf.push_back(0);
+      }
+
+      template<class T> size_t Put(T value)
+      {
+         Align(sizeof(T));
+         size_t pos = buf.size();
+         buf.resize(pos+sizeof(T));
+         memcpy(&buf[pos],&value,sizeof(T));
+         return pos;
+      }
+
+      template<class T> void Set(size_t pos, T value)
+      {
+         memcpy(&buf[pos],&value,sizeof(T));
+      }
+
+      void Link(size_t slot, size_t object)
+      {
+         Set<UInt_t>(slot,object-slot);
+      }
+
+      size_t Table(const std::vector<FlatField>& fields, std::vector<size_t>& slots)
+      {
+         //vtable first, then the table pointing back to it; slots gets the offset fields in order
+         int nids = 0;
+         for(unsigned f=0; f<fields.size(); f++)
+            nids = max(nids,fields[f].id+1);
+         size_t vtable = Put<UShort_t>(4+2*nids);
+         Put<UShort_t>(0);
+         for(int i=0; i<nids; i++)
+            Put<UShort_t>(0);
+         size_t table = Put<Int_t>(0);
+         Set<Int_t>(table,table-vtable);
+         slots.clear();
+         for(unsigned f=0; f<fields.size(); f++)
+         {
+            const FlatField& field = fields[f];
+            size_t pos;
+            if(field.size==1)
+               pos = Put<unsigned char>(field.value);
+            else if(field.size==2)
+               pos = Put<Short_t>(field.value);
+            else if(field.size==4)
+               pos = Put<Int_t>(field.value);
+            else if(field.size==8)
+               pos = Put<Long64_t>(field.value);
+            else
+               slots.push_back(pos = Put<UInt_t>(0));
+            Set<UShort_t>(vtable+4+2*field.id,pos-table);
+         }
+         Set<UShort_t>(vtable+2,buf.size()-table);
+         return table;
+      }
+
+      size_t Vector(UInt_t n, size_t align)
+      {
+         //the length, then the n elements aligned to align
+         Align(4);
+         while((buf.size()+4)%align)
+            buf.push_back(0);
+         return Put<UInt_t>(n);
+      }
+
+      size_t String(const std::string& s)
+      {
+         size_t pos = Put<UInt_t>(s.size());
+         buf.insert(buf.end(),s.begin(),s.end());
+         buf.push_back(0);
+         return pos;
+      }
+
+      const std::vector<unsigned char>& Finish(size_t root)
+      {
+         Link(0,root);
+         Align(8);
+         return buf;
+      }
+};
+
+
+//---------------------------------------------------------------------------------------------------------------
+// nullable float32 fields, in the order of the columns
+static size_t BuildSchema(FlatBuilder& fb, const std::vector<std::string>& names)
+{
+   std::vector<size_t> slots, fieldslots;
+   std::vector<FlatField> schema;
+   schema.push_back(FlatField(1,0));                                   //fields
+   size_t table = fb.Table(schema,slots);
+   size_t fields = fb.Vector(names.size(),4);
+   fb.Link(slots[0],fields);
+   for(unsigned c=0; c<names.size(); c++)
+      fieldslots.push_back(fb.Put<UInt_t>(0));
+   for(unsigned c=0; c<names.size(); c++)
+   {
+      std::vector<FlatField> field;
+      field.push_back(FlatField(0,0));                                 //name
+      field.push_back(FlatField(1,1,1));                               //nullable
+      field.push_back(FlatField(2,1,kTypeFloatingPoint));              //type_type
+      field.push_back(FlatField(3,0));                                 //type
+      field.push_back(FlatField(5,0));                                 //children
+      fb.Link(fieldslots[c],fb.Table(field,slots));
+      std::vector<size_t> fslots = slots;
+      fb.Link(fslots[0],fb.String(names[c]));
+      std::vector<FlatField> type(1,FlatField(0,2,kPrecisionSingle));  //precision
+      fb.Link(fslots[1],fb.Table(type,slots));
+      fb.Link(fslots[2],fb.Vector(0,4));
+   }
+   return table;
+}
+
+// the message table, slot gets the offset of its header
+static size_t BuildMessage(FlatBuilder& fb, int headertype, Long64_t body, size_t& slot)
+{
+   std::vector<size_t> slots;
+   std::vector<FlatField> message;
+   message.push_back(FlatField(0,2,kMetadataV5));                      //version
+   message.push_back(FlatField(1,1,headertype));                       //header_type
+   message.push_back(FlatField(2,0));                                  //header
+   message.push_back(FlatField(3,8,body));                             //bodyLength
+   size_t table = fb.Table(message,slots);
+   slot = slots[0];
+   return table;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+ArrowWriter::ArrowWriter(const std::string& filename, const std::vector<std::string>& names, int chunksize):
+fFileName(filename),
+fNames(names),
+fChunkSize(max(chunksize,1)),
+fPending(names.size()),
+fEntries(0),
+fBytes(0)
+{
+   fFile = fopen(filename.c_str(),"wb");
+   if(!fFile)
+   {
+      cerr<<"[ERROR]: cannot create "<<filename<<endl;
+      exit(EXIT_FAILURE);
+   }
+   Write(kMagic,8);
+   FlatBuilder fb;
+   size_t slot;
+   size_t message = BuildMessage(fb,kHeaderSchema,0,slot);
+   fb.Link(slot,BuildSchema(fb,fNames));
+   WriteMessage(fb.Finish(message));
+   for(unsigned c=0; c<fNames.size(); c++)
+      fPending[c].reserve(fChunkSize);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+ArrowWriter::~ArrowWriter()
+{
+   Close();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ArrowWriter::Write(const void* data, size_t n)
+{
+   if(n>0 && fwrite(data,1,n,fFile)!=n)
+   {
+      cerr<<"[ERROR]: error while writing "<<fFileName<<endl;
+      exit(EXIT_FAILURE);
+   }
+   fBytes += n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ArrowWriter::Pad(size_t n)
+{
+   static const char zeros[kBufferAlign] = {0};
+   Write(zeros,n);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Int_t ArrowWriter::WriteMessage(const std::vector<unsigned char>& metadata)
+{
+   //continuation marker, size of the padded metadata, metadata; the padding aligns the body
+   //that follows to kBufferAlign in the file, and so its buffers once the file is mapped
+   UInt_t marker = 0xFFFFFFFF;
+   Long64_t end = (fBytes+8+metadata.size()+kBufferAlign-1)/kBufferAlign*kBufferAlign;
+   Int_t size = end-fBytes-8;
+   Write(&marker,4);
+   Write(&size,4);
+   Write(metadata.data(),metadata.size());
+   Pad(size-metadata.size());
+   return 8+size;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ArrowWriter::Fill(int n, const float* const* columns)
+{
+   int done = 0;
+   while(done<n)
+   {
+      int nrows = min(n-done,fChunkSize-(int)fPending[0].size());
+      for(unsigned c=0; c<fNames.size(); c++)
+         fPending[c].insert(fPending[c].end(),columns[c]+done,columns[c]+done+nrows);
+      done += nrows;
+      if((int)fPending[0].size()==fChunkSize)
+         FlushChunk();
+   }
+   fEntries += n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ArrowWriter::FlushChunk()
+{
+   //one record batch: no validity bitmaps, the values of each column padded to kBufferAlign
+   Long64_t n = fNames.empty() ? 0 : fPending[0].size();
+   if(n==0)
+      return;
+   Long64_t column = n*sizeof(float);
+   Long64_t padded = (column+kBufferAlign-1)/kBufferAlign*kBufferAlign;
+   Block block;
+   block.offset = fBytes;
+   block.body = padded*fNames.size();
+
+   FlatBuilder fb;
+   size_t slot;
+   std::vector<size_t> slots;
+   size_t message = BuildMessage(fb,kHeaderRecordBatch,block.body,slot);
+   std::vector<FlatField> batch;
+   batch.push_back(FlatField(0,8,n));                                  //length
+   batch.push_back(FlatField(1,0));                                    //nodes
+   batch.push_back(FlatField(2,0));                                    //buffers
+   fb.Link(slot,fb.Table(batch,slots));
+   fb.Link(slots[0],fb.Vector(fNames.size(),8));
+   for(unsigned c=0; c<fNames.size(); c++)
+   {
+      fb.Put<Long64_t>(n);                                             //FieldNode: length, null_count
+      fb.Put<Long64_t>(0);
+   }
+   fb.Link(slots[1],fb.Vector(2*fNames.size(),8));
+   for(unsigned c=0; c<fNames.size(); c++)
+   {
+      fb.Put<Long64_t>(c*padded);                                      //Buffer: offset, length
+      fb.Put<Long64_t>(0);
+      fb.Put<Long64_t>(c*padded);
+      fb.Put<Long64_t>(column);
+   }
+   block.metadata = WriteMessage(fb.Finish(message));
+
+   for(unsigned c=0; c<fNames.size(); c++)
+   {
+      Write(fPending[c].data(),column);
+      Pad(padded-column);
+      fPending[c].clear();
+   }
+   fBlocks.push_back(block);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ArrowWriter::Close()
+{
+   //end of stream, then the footer with the schema again and the position of every batch
+   if(!fFile)
+      return;
+   FlushChunk();
+   UInt_t eos[2] = {0xFFFFFFFF,0};
+   Write(eos,8);
+
+   FlatBuilder fb;
+   std::vector<size_t> slots;
+   std::vector<FlatField> footer;
+   footer.push_back(FlatField(0,2,kMetadataV5));                       //version
+   footer.push_back(FlatField(1,0));                                   //schema
+   footer.push_back(FlatField(2,0));                                   //dictionaries
+   footer.push_back(FlatField(3,0));                                   //recordBatches
+   size_t table = fb.Table(footer,slots);
+   fb.Link(slots[0],BuildSchema(fb,fNames));
+   fb.Link(slots[1],fb.Vector(0,8));
+   fb.Link(slots[2],fb.Vector(fBlocks.size(),8));
+   for(unsigned b=0; b<fBlocks.size(); b++)
+   {
+      fb.Put<Long64_t>(fBlocks[b].offset);                             //Block: offset, metaDataLength, bodyLength
+      fb.Put<Int_t>(fBlocks[b].metadata);
+      fb.Put<Int_t>(0);
+      fb.Put<Long64_t>(fBlocks[b].body);
+   }
+   const std::vector<unsigned char>& meta = fb.Finish(table);
+   Int_t size = meta.size();
+   Write(meta.data(),size);
+   Write(&size,4);
+   Write(kMagic,6);
+   fclose(fFile);
+   fFile = 0;
+   cout<<">> "<<fEntries<<" entries in "<<fBlocks.size()<<" record batches written to "<<fFileName<<" ("<<fBytes<<" bytes)"<<endl;
+}
@@ -0,0 +1,53 @@
+#ifndef ARROWFILE_H
+#define ARROWFILE_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Rtypes.h"
+
+using namespace std;
+
+// Float columns written as an Apache Arrow IPC file (the "feather v2" format): a schema, one
+// record batch per chunk of rows and a footer indexing the batches. The column buffers are
+// stored as they are in memory, 64-byte aligned and without nulls, so that a reader can map
+// the file and use them in place (pyarrow.ipc.open_file(pyarrow.memory_map(name))).
+// Only one chunk of rows is kept in memory.
+class ArrowWriter
+{
+   protected:
+      struct Block
+      {
+         Long64_t offset;                           // in the file, of the message
+         Int_t metadata;                            // bytes of the message before the body
+         Long64_t body;
+      };
+
+   // Data
+   protected:
+      FILE* fFile;
+      std::string fFileName;
+      std::vector<std::string> fNames;
+      int fChunkSize;
+      std::vector<std::vector<float> > fPending;   // rows of the current chunk
+      std::vector<Block> fBlocks;
+      Long64_t fEntries;
+      Long64_t fBytes;
+
+   // Methods
+   public:
+      ArrowWriter(const std::string& filename, const std::vector<std::string>& names, int chunksize=1<<20);
+      ~ArrowWriter();
+      void Fill(int n, const float* const* columns);
+      void Close();
+      Long64_t GetEntries() const {return fEntries;};
+
+   protected:
+      void FlushChunk();
+      Int_t WriteMessage(const std::vector<unsigned char>& metadata);
+      void Write(const void* data, size_t n);
+      void Pad(size_t n);
+};
+
+#endif  // ARROWFILE_H
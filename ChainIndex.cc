@@ -0,0 +1,199 @@
+#include "ChainIndex.hh"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <glob.h>
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TSystem.h"
+
+using namespace std;
+
+//---------------------------------------------------------------------------------------------------------------
+ChainIndex::ChainIndex(const std::string& treename, const std::string& indexfile):
+fTreeName(treename),
+fIndexFile(indexfile),
+fDirty(false)
+{
+   if(fIndexFile!="")
+      Load();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool ChainIndex::Load()
+{
+   //one file per line: size mtime entries path
+   std::ifstream in(fIndexFile.c_str());
+   if(!in)
+      return false;
+   string line;
+   while(std::getline(in,line))
+   {
+      std::istringstream ist(line);
+      IndexedFile file;
+      if(!(ist>>file.size>>file.mtime>>file.entries))
+         continue;
+      std::getline(ist>>std::ws,file.path);
+      file.offset = 0;
+      fCache[file.path] = file;
+   }
+   cout<<">> "<<fCache.size()<<" files known from index "<<fIndexFile<<endl;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool ChainIndex::Save()
+{
+   if(fIndexFile=="" || !fDirty)
+      return true;
+   //each job writes its own temporary file: the index in place is always one complete
+   //version, the one of the job that saved last
+   string tmpname = fIndexFile+".tmp"+std::to_string(gSystem->GetPid());
+   std::ofstream out(tmpname.c_str());
+   if(!out)
+   {
+      cerr<<"[WARNING]: cannot write chain index "<<fIndexFile<<endl;
+      return false;
+   }
+   for(std::map<string,IndexedFile>::const_iterator it=fCache.begin(); it!=fCache.end(); ++it)
+      out<<it->second.size<<" "<<it->second.mtime<<" "<<it->second.entries<<" "<<it->first<<"\n";
+   out.close();
+   if(!out || gSystem->Rename(tmpname.c_str(),fIndexFile.c_str())!=0)
+   {
+      cerr<<"[WARNING]: cannot write chain index "<<fIndexFile<<endl;
+      gSystem->Unlink(tmpname.c_str());
+      return false;
+   }
+   fDirty = false;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ChainIndex::AddFile(const std::string& path)
+{
+   FileStat_t stat;
+   if(gSystem->GetPathInfo(path.c_str(),stat)!=0)
+   {
+      cerr<<"[WARNING]: cannot stat "<<path<<endl;
+      return;
+   }
+
+   IndexedFile file;
+   std::map<string,IndexedFile>::const_iterator it = fCache.find(path);
+   if(it!=fCache.end() && it->second.size==stat.fSize && it->second.mtime==stat.fMtime)
+      file = it->second;
+   else
+   {
+      //new or modified file: open it once to count the entries
+      file.path = path;
+      file.size = stat.fSize;
+      file.mtime = stat.fMtime;
+      file.entries = -1;
+      TFile* infile = TFile::Open(path.c_str());
+      if(infile && !infile->IsZombie())
+      {
+         TTree* tree = 0;
+         infile->GetObject(fTreeName.c_str(),tree);
+         if(tree)
+            file.entries = tree->GetEntries();
+      }
+      delete infile;
+      if(file.entries<0)
+      {
+         cerr<<"[WARNING]: no tree "<<fTreeName<<" in "<<path<<endl;
+         return;
+      }
+      fCache[path] = file;
+      fDirty = true;
+   }
+   //empty files are remembered but left out of the chain
+   if(file.entries==0)
+      return;
+   file.offset = GetEntries();
+   fFiles.push_back(file);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int ChainIndex::AddGlob(const std::string& pattern)
+{
+   glob_t matches;
+   int nfiles = 0;
+   if(glob(pattern.c_str(),0,NULL,&matches)==0)
+   {
+      //glob returns the paths sorted, as TChain::Add does
+      for(size_t i=0; i<matches.gl_pathc; i++)
+      {
+         int before = fFiles.size();
+         AddFile(matches.gl_pathv[i]);
+         nfiles += fFiles.size()-before;
+      }
+   }
+   globfree(&matches);
+   return nfiles;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ChainIndex::AddChain(TChain* chain)
+{
+   //index of a chain built elsewhere, the entries come from the chain itself
+   chain->GetEntries();
+   TObjArray* files = chain->GetListOfFiles();
+   Long64_t* offsets = chain->GetTreeOffset();
+   for(int i=0; i<chain->GetNtrees(); i++)
+   {
+      IndexedFile file;
+      file.path = files->At(i)->GetTitle();
+      file.size = 0;
+      file.mtime = 0;
+      file.entries = offsets[i+1]-offsets[i];
+      file.offset = offsets[i];
+      fFiles.push_back(file);
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int ChainIndex::FillChain(TChain* chain, int first) const
+{
+   //files with a known number of entries are not opened by TChain until they are read
+   int nfiles = 0;
+   for(unsigned i=first; i<fFiles.size(); i++)
+      nfiles += chain->AddFile(fFiles[i].path.c_str(),fFiles[i].entries);
+   return nfiles;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Long64_t ChainIndex::GetEntries() const
+{
+   if(fFiles.empty())
+      return 0;
+   return fFiles.back().offset + fFiles.back().entries;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int ChainIndex::FindFile(Long64_t entry) const
+{
+   //last file starting at or before entry
+   int lo = 0, hi = fFiles.size()-1;
+   if(hi<0 || entry<0 || entry>=GetEntries())
+      return -1;
+   while(lo<hi)
+   {
+      int mid = (lo+hi+1)/2;
+      if(fFiles[mid].offset<=entry)
+         lo = mid;
+      else
+         hi = mid-1;
+   }
+   return lo;
+}
@@ -0,0 +1,51 @@
+#ifndef CHAININDEX_H
+#define CHAININDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "TChain.h"
+
+using namespace std;
+
+struct IndexedFile
+{
+   std::string path;
+   Long64_t size;
+   Long_t mtime;
+   Long64_t entries;
+   Long64_t offset;    // first entry of the file in the chain
+};
+
+// Per-file entry counts of a chain, persisted in a sidecar text file.
+// A file whose size and mtime match the sidecar is added to the chain with its known
+// number of entries, so that TChain opens it only when one of its entries is read.
+class ChainIndex
+{
+   // Data
+   protected:
+      std::string fTreeName;
+      std::string fIndexFile;
+      std::vector<IndexedFile> fFiles;
+      std::map<std::string,IndexedFile> fCache;   // content of the sidecar
+      bool fDirty;
+
+   // Methods
+   public:
+      ChainIndex(const std::string& treename="digi", const std::string& indexfile="");
+      int AddGlob(const std::string& pattern);
+      void AddChain(TChain* chain);
+      int FillChain(TChain* chain, int first=0) const;
+      bool Save();
+      int GetNFiles() const {return fFiles.size();};
+      const IndexedFile& GetFile(int i) const {return fFiles[i];};
+      Long64_t GetEntries() const;
+      int FindFile(Long64_t entry) const;
+
+   protected:
+      bool Load();
+      void AddFile(const std::string& path);
+};
+
+#endif  // CHAININDEX_H
@@ -0,0 +1,167 @@
+#include "Checkpoint.hh"
+#include "FastHisto.hh"
+
+#include <iostream>
+#include <fstream>
+
+#include "TSystem.h"
+
+using namespace std;
+
+static const char kMagic[8] = {'E','V','C','K','P','T','1','\n'};
+
+static void WriteString(std::ostream& out, const std::string& s)
+{
+   Long64_t n = s.size();
+   WriteRaw(out,n);
+   out.write(s.data(),n);
+}
+
+static bool ReadString(std::istream& in, std::string& s)
+{
+   Long64_t n;
+   if(!ReadRaw(in,n) || n<0)
+      return false;
+   s.resize(n);
+   return n==0 || !!in.read(&s[0],n);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Checkpoint& Checkpoint::Instance()
+{
+   static Checkpoint checkpoint;
+   return checkpoint;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Checkpoint::Open(const std::string& filename, double interval, ULong64_t key)
+{
+   fFileName = filename;
+   fInterval = interval;
+   fKey = key;
+   fPasses.clear();
+   fCurrent = -1;
+   fLastWrite = std::chrono::steady_clock::now();
+   if(fFileName!="" && Load())
+      cout<<"> Checkpoint "<<fFileName<<" found, "<<fPasses.size()<<" passes to resume"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Checkpoint::Close()
+{
+   //the run is complete: the next job starts from scratch
+   if(!IsEnabled())
+      return;
+   gSystem->Unlink(fFileName.c_str());
+   fFileName = "";
+   fPasses.clear();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool Checkpoint::Load()
+{
+   std::ifstream in(fFileName.c_str(),std::ios::binary);
+   if(!in)
+      return false;
+   char magic[sizeof(kMagic)];
+   ULong64_t key;
+   Long64_t npasses;
+   if(!in.read(magic,sizeof(magic)) || memcmp(magic,kMagic,sizeof(kMagic))!=0 || !ReadRaw(in,key) || !ReadRaw(in,npasses))
+   {
+      cerr<<"[WARNING]: "<<fFileName<<" is not a checkpoint, starting from scratch"<<endl;
+      return false;
+   }
+   if(key!=fKey)
+   {
+      cerr<<"[WARNING]: checkpoint "<<fFileName<<" was written with another configuration, starting from scratch"<<endl;
+      return false;
+   }
+   for(Long64_t k=0; k<npasses; k++)
+   {
+      Pass pass;
+      if(!ReadString(in,pass.name) || !ReadString(in,pass.label) || !ReadRaw(in,pass.entries) || !ReadRaw(in,pass.done) ||
+         !ReadRaw(in,pass.range) || !ReadRaw(in,pass.next) || !ReadRaw(in,pass.stopped) || !ReadString(in,pass.sums))
+      {
+         cerr<<"[WARNING]: checkpoint "<<fFileName<<" truncated after "<<k<<" passes"<<endl;
+         break;
+      }
+      fPasses.push_back(pass);
+   }
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool Checkpoint::Write()
+{
+   //the previous checkpoint stays valid until the new one is complete; the temporary name is
+   //per process, a second job started by mistake on the same checkpoint cannot mix into it
+   std::string tmpname = fFileName+".tmp"+std::to_string(gSystem->GetPid());
+   std::ofstream out(tmpname.c_str(),std::ios::binary|std::ios::trunc);
+   out.write(kMagic,sizeof(kMagic));
+   WriteRaw(out,fKey);
+   WriteRaw(out,(Long64_t)fPasses.size());
+   for(unsigned k=0; k<fPasses.size(); k++)
+   {
+      const Pass& pass = fPasses[k];
+      WriteString(out,pass.name);
+      WriteString(out,pass.label);
+      WriteRaw(out,pass.entries);
+      WriteRaw(out,pass.done);
+      WriteRaw(out,pass.range);
+      WriteRaw(out,pass.next);
+      WriteRaw(out,pass.stopped);
+      WriteString(out,pass.sums);
+   }
+   out.close();
+   fLastWrite = std::chrono::steady_clock::now();
+   if(!out || gSystem->Rename(tmpname.c_str(),fFileName.c_str())!=0)
+   {
+      cerr<<"[WARNING]: cannot write checkpoint "<<fFileName<<endl;
+      gSystem->Unlink(tmpname.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+const Checkpoint::Pass* Checkpoint::BeginPass(const std::string& name, const std::string& label, Long64_t entries)
+{
+   //the saved state of this pass, 0 if there is none; a pass different from the saved one
+   //means the run took another path, the saved passes from here on are dropped
+   if(!IsEnabled())
+      return 0;
+   fCurrent++;
+   if(fCurrent>=(int)fPasses.size())
+      return 0;
+   const Pass& pass = fPasses[fCurrent];
+   if(pass.name==name && pass.label==label && pass.entries==entries)
+      return &pass;
+   cerr<<"[WARNING]: checkpoint "<<fFileName<<" does not match pass <"<<name<<"> of "<<label<<", running it from scratch"<<endl;
+   fPasses.resize(fCurrent);
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool Checkpoint::IsDue() const
+{
+   return IsEnabled() && std::chrono::duration<double>(std::chrono::steady_clock::now()-fLastWrite).count()>=fInterval;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Checkpoint::Save(const Pass& pass)
+{
+   //state of the current pass; the passes before it are written again as they are
+   if(!IsEnabled() || fCurrent<0)
+      return;
+   fPasses.resize(fCurrent+1);
+   fPasses[fCurrent] = pass;
+   Write();
+}
@@ -0,0 +1,59 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "Rtypes.h"
+
+using namespace std;
+
+// Progress of the filling passes of a run, written to disk every few minutes so that a job
+// killed in the middle of a long event loop resumes where it was. For each pass, in the order
+// of the run: its name and dataset, the position reached in the sample and the serialized
+// reduction tree of its accumulators. A restarted job with the same configuration finds its
+// passes in the same order: the completed ones are restored without reading, the interrupted
+// one continues from its position, and the result is identical to that of an uninterrupted run.
+// The file is written to a temporary and renamed: a job killed while writing leaves the
+// previous checkpoint valid.
+class Checkpoint
+{
+   public:
+      struct Pass
+      {
+         std::string name, label;
+         Long64_t entries;       // entries of the sample, to recognize it
+         bool done;
+         unsigned range;         // position of the next batch, if not done
+         Long64_t next;
+         unsigned stopped;       // ranges kept by an early stop
+         std::string sums;       // OrderedReduction::Write of the accumulators
+      };
+
+   // Data
+   protected:
+      std::string fFileName;
+      double fInterval;          // seconds between two writes
+      ULong64_t fKey;            // hash of the configuration
+      std::vector<Pass> fPasses;
+      int fCurrent;              // pass being filled
+      std::chrono::steady_clock::time_point fLastWrite;
+
+   // Methods
+   public:
+      static Checkpoint& Instance();
+      void Open(const std::string& filename, double interval, ULong64_t key);
+      void Close();
+      bool IsEnabled() const {return fFileName!="";};
+      const Pass* BeginPass(const std::string& name, const std::string& label, Long64_t entries);
+      bool IsDue() const;
+      void Save(const Pass& pass);
+
+   protected:
+      Checkpoint() : fInterval(0), fKey(0), fCurrent(-1) {};
+      bool Load();
+      bool Write();
+};
+
+#endif  // CHECKPOINT_H
@@ -0,0 +1,157 @@
+#include "ColumnStore.hh"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static const int kBudgetChunks = 16;          // chunks held by the budget, unless given the rows
+static const int kMinChunkRows = 4096;
+static const int kMaxChunkRows = 1<<20;
+
+
+//---------------------------------------------------------------------------------------------------------------
+ColumnStore::ColumnStore(int ncols, Long64_t budget, const std::string& scratchdir, int chunkrows):
+fNcols(ncols),
+fChunkRows(chunkrows),
+fBudget(budget),
+fScratchDir(scratchdir),
+fScratch(-1),
+fScratchBytes(0),
+fPendingRows(0),
+fInMemory(0),
+fEntries(0),
+fCachedChunk(-1)
+{
+   if(fChunkRows<=0)
+   {
+      Long64_t rows = budget/kBudgetChunks/((Long64_t)max(fNcols,1)*sizeof(float));
+      fChunkRows = min(max(rows,(Long64_t)kMinChunkRows),(Long64_t)kMaxChunkRows);
+   }
+   fPending.resize((size_t)fNcols*fChunkRows);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+ColumnStore::~ColumnStore()
+{
+   if(fScratch>=0)
+      close(fScratch);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ColumnStore::Append(int n, const float* const* columns)
+{
+   int done = 0;
+   while(done<n)
+   {
+      int nrows = min(n-done,fChunkRows-fPendingRows);
+      for(int c=0; c<fNcols; c++)
+         memcpy(&fPending[(size_t)c*fChunkRows+fPendingRows],columns[c]+done,nrows*sizeof(float));
+      fPendingRows += nrows;
+      done += nrows;
+      if(fPendingRows==fChunkRows)
+         FlushChunk();
+   }
+   fEntries += n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ColumnStore::Close()
+{
+   //the last, incomplete chunk
+   if(fPendingRows>0)
+      FlushChunk();
+   std::vector<float>().swap(fPending);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ColumnStore::FlushChunk()
+{
+   Chunk chunk;
+   chunk.rows = fPendingRows;
+   chunk.offset = -1;
+   Long64_t bytes = (Long64_t)fNcols*chunk.rows*sizeof(float);
+   if(fInMemory+bytes<=fBudget)
+   {
+      chunk.data.resize((size_t)fNcols*chunk.rows);
+      for(int c=0; c<fNcols; c++)
+         memcpy(&chunk.data[(size_t)c*chunk.rows],&fPending[(size_t)c*fChunkRows],chunk.rows*sizeof(float));
+      fInMemory += bytes;
+   }
+   else
+   {
+      if(fScratch<0)
+      {
+         //unlinked right away: the space is released when the store is deleted or the job ends
+         std::string name = fScratchDir+"/evanalyz_scratch_XXXXXX";
+         fScratch = mkstemp(&name[0]);
+         if(fScratch<0)
+         {
+            cerr<<"[ERROR]: cannot create a scratch file in "<<fScratchDir<<endl;
+            exit(EXIT_FAILURE);
+         }
+         unlink(name.c_str());
+         cout<<">> Memory budget of "<<fBudget/(1024*1024)<<" MB exceeded, spilling to "<<fScratchDir<<endl;
+      }
+      chunk.offset = fScratchBytes;
+      for(int c=0; c<fNcols; c++)
+      {
+         size_t len = chunk.rows*sizeof(float);
+         if(pwrite(fScratch,&fPending[(size_t)c*fChunkRows],len,fScratchBytes)!=(ssize_t)len)
+         {
+            cerr<<"[ERROR]: cannot write to the scratch file in "<<fScratchDir<<endl;
+            exit(EXIT_FAILURE);
+         }
+         fScratchBytes += len;
+      }
+   }
+   fChunks.push_back(chunk);
+   fPendingRows = 0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+const float* ColumnStore::GetChunk(int ichunk, int& rows)
+{
+   //column c of the chunk starts at c*rows; a spilled chunk is valid until the next call
+   Chunk& chunk = fChunks[ichunk];
+   rows = chunk.rows;
+   if(chunk.offset<0)
+      return chunk.data.data();
+   if(ichunk==fCachedChunk)
+      return fReadBuffer.data();
+   size_t len = (size_t)fNcols*chunk.rows*sizeof(float);
+   fReadBuffer.resize((size_t)fNcols*chunk.rows);
+   if(pread(fScratch,fReadBuffer.data(),len,chunk.offset)!=(ssize_t)len)
+   {
+      cerr<<"[ERROR]: error while reading the scratch file in "<<fScratchDir<<endl;
+      exit(EXIT_FAILURE);
+   }
+   fCachedChunk = ichunk;
+   return fReadBuffer.data();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ColumnStore::Read(int icol, Long64_t first, int n, float* out)
+{
+   //all the chunks but the last have fChunkRows rows
+   while(n>0)
+   {
+      int ichunk = first/fChunkRows;
+      int rows;
+      const float* chunk = GetChunk(ichunk,rows);
+      int start = first - (Long64_t)ichunk*fChunkRows;
+      int nrows = min(n,rows-start);
+      memcpy(out,chunk+(Long64_t)icol*rows+start,nrows*sizeof(float));
+      out += nrows;
+      first += nrows;
+      n -= nrows;
+   }
+}
@@ -0,0 +1,62 @@
+#ifndef COLUMNSTORE_H
+#define COLUMNSTORE_H
+
+#include <string>
+#include <vector>
+
+#include "Rtypes.h"
+
+using namespace std;
+
+// Float columns of any length kept under a memory budget.
+// Rows are appended in chunks of fixed size; full chunks stay in memory while the budget
+// allows it and are written to an unlinked scratch file afterwards. The chunks are then read
+// back one at a time, so the memory used never exceeds the budget plus two chunks whatever
+// the number of rows. Read gives random access to any range of rows once the store is closed.
+// By default a chunk takes a fixed fraction of the budget, so that the two extra chunks stay
+// small next to it for any number of columns.
+
+class ColumnStore
+{
+   protected:
+      struct Chunk
+      {
+         int rows;
+         std::vector<float> data;   // column c at data[c*rows], empty if spilled
+         Long64_t offset;           // position in the scratch file, -1 if in memory
+      };
+
+   // Data
+   protected:
+      int fNcols;
+      int fChunkRows;
+      Long64_t fBudget;             // bytes of full chunks kept in memory
+      std::string fScratchDir;
+      int fScratch;                 // scratch file descriptor, -1 until the first spill
+      Long64_t fScratchBytes;
+      std::vector<Chunk> fChunks;
+      std::vector<float> fPending;  // rows of the chunk being filled, column c at c*fChunkRows
+      int fPendingRows;
+      Long64_t fInMemory;
+      Long64_t fEntries;
+      std::vector<float> fReadBuffer;
+      int fCachedChunk;             // spilled chunk held by fReadBuffer
+
+   // Methods
+   public:
+      ColumnStore(int ncols, Long64_t budget, const std::string& scratchdir="/tmp", int chunkrows=0);
+      ~ColumnStore();
+      void Append(int n, const float* const* columns);
+      void Close();
+      Long64_t GetEntries() const {return fEntries;};
+      int GetNColumns() const {return fNcols;};
+      int GetNChunks() const {return fChunks.size();};
+      const float* GetChunk(int ichunk, int& rows);
+      void Read(int icol, Long64_t first, int n, float* out);
+      Long64_t GetSpilledBytes() const {return fScratchBytes;};
+
+   protected:
+      void FlushChunk();
+};
+
+#endif  // COLUMNSTORE_H
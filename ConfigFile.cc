@@ -1,8 +1,12 @@
 // ConfigFile.cpp
 
 #include "ConfigFile.hh"
+#include "Formula.hh"
 #include <vector>
 #include <utility>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
 using std::string;
 using namespace std;
 
@@ -67,43 +71,143 @@ std::ostream& operator<<( std::ostream& os, const ConfigFile& cf )
 }
 void ConfigFile::calculateFormulas(){
 
-	vector< pair < string , string > > configVector;
-	string script;
-	
-        for (int i=0; i<(int)myContentsVec.size(); i++) {
-		if( myContentsVec[i].second.at(0) == '$' ){
-			script = myContentsVec[i].second;
-			//cout<<"prima: "<<script<<endl;
-			for (int j=0; j<(int)myContentsVec.size(); j++) {
-			
-				string dollarKey = "$"+myContentsVec[j].first;
-				while((int)script.find(dollarKey) != -1){
-	   				script.replace(script.find(myContentsVec[j].first)-1, myContentsVec[j].first.size()+1, myContentsVec[j].second);
-					
-	   			}
+	// Keys are evaluated on demand, so a formula may refer to keys defined after it
+	std::map<string,int> state;  // 1 = being evaluated, 2 = done
+	for (int i=0; i<(int)myContentsVec.size(); i++) {
+		const string key = myContentsVec[i].first;
+		if( state[key] != 0 ) continue;
+		try {
+			evaluateKey(key, state);
+		}
+		catch( Formula::parse_error& e ) {
+			cerr<<"[ERROR]: cannot evaluate <"<<key<<"> = "<<e.expr<<": "<<e.msg<<endl;
+			// leave the keys of the failed chain unevaluated
+			for( std::map<string,int>::iterator it = state.begin(); it != state.end(); ++it )
+				if( it->second == 1 ) it->second = 2;
+		}
+	}
+	for (int i=0; i<(int)myContentsVec.size(); i++)
+		myContentsVec[i].second = myContents[myContentsVec[i].first];
+
+}
+
+
+string ConfigFile::evaluateKey( const string& key, std::map<string,int>& state ){
+
+	// Return the value of key, evaluating it first if it is a formula
+	string value = myContents[key];
+	if( state[key] == 2 || value.empty() || value.at(0) != '$' ) {
+		state[key] = 2;
+		return value;
+	}
+	if( state[key] == 1 )
+		throw Formula::parse_error(value, "circular reference to <"+key+">");
+	state[key] = 1;
+
+	string result;
+	if( value.compare(0,4,"$sh(") == 0 ) {
+		// explicit opt-in: run the command through the shell
+		string script = substituteKeys(value.substr(4, value.rfind(")")-4), state);
+		result = runShell(script);
+	} else if( value.compare(0,2,"$(") == 0 ) {
+		Formula formula(value.substr(2, value.rfind(")")-2));
+		const vector<string>& vars = formula.GetVariables();
+
+		// scalar or vector value of each variable
+		vector< vector<double> > varValues(vars.size());
+		size_t length = 1;
+		bool isVector = false;
+		for (unsigned v=0; v<vars.size(); v++) {
+			if( myContents.find(vars[v]) == myContents.end() )
+				throw Formula::parse_error(value, "unknown key <"+vars[v]+">");
+			string varString = evaluateKey(vars[v], state);
+			vector<string> items;
+			if( varString.size() > 1 && varString.substr(0,myVectorSep.size()) == myVectorSep &&
+			    varString.substr(varString.size()-myVectorSep.size()) == myVectorSep ) {
+				string rest = varString.substr(myVectorSep.size());
+				while( rest.size() > 0 ) {
+					items.push_back(rest.substr(0, rest.find(myVectorSep)));
+					rest = rest.substr(rest.find(myVectorSep)+myVectorSep.size());
+				}
+				if( isVector && items.size() != length )
+					throw Formula::parse_error(value, "vectors of different length");
+				isVector = true;
+				length = items.size();
+			} else
+				items.push_back(varString);
+			for (unsigned k=0; k<items.size(); k++) {
+				string item = items[k];
+				trim(item);
+				char* end;
+				double x = strtod(item.c_str(), &end);
+				if( item.empty() || *end != 0 )
+					throw Formula::parse_error(value, "<"+vars[v]+"> = "+varString+" is not numeric");
+				varValues[v].push_back(x);
 			}
-			//cout<<"dopo: "<<script<<endl;
-			if (script.at(0) == '$' && script.at(1) == '(') {
-				script = script.substr(2,script.rfind(")")-2);
-			}/* else if( script.at(0) == '$' ) {
-				script = script.substr(1);
-			}*/
-			FILE *in;
-			char buff[512];
-			in = popen(script.c_str(), "r");
-			string result =""; 
-			if(fgets(buff, sizeof(buff), in)!=NULL) {
-				string tempString(buff);
-				
-				tempString=tempString.substr(0, tempString.find("\n"));
-				//cout<<"valore: *"<<buff<<"*"<<endl;
-				//cout<<"stringa: *"<<tempString<<"*"<<endl;
-				myContents[myContentsVec[i].first] = tempString;
-				myContentsVec[i].second = tempString;
+		}
+
+		// element by element, scalars are broadcast over vectors
+		std::ostringstream ost;
+		ost.precision(15);
+		vector<double> x(vars.size());
+		if( isVector ) ost << myVectorSep;
+		for (size_t k=0; k<length; k++) {
+			for (unsigned v=0; v<vars.size(); v++)
+				x[v] = varValues[v].size() == 1 ? varValues[v][0] : varValues[v][k];
+			ost << formula.Eval(x.empty() ? 0 : &x[0]);
+			if( isVector ) ost << myVectorSep;
+		}
+		result = ost.str();
+	} else {
+		// plain reference(s) to other keys
+		result = substituteKeys(value, state);
+	}
+
+	myContents[key] = result;
+	state[key] = 2;
+	return result;
+
+}
+
+
+string ConfigFile::substituteKeys( const string& text, std::map<string,int>& state ){
+
+	// Replace each "$key" by the value of key, taking the longest matching name
+	string out;
+	size_t pos = 0;
+	while( pos < text.size() ) {
+		if( text[pos] == '$' ) {
+			size_t end = pos+1;
+			while( end < text.size() && (isalnum(text[end]) || text[end] == '_') )
+				end++;
+			string name = text.substr(pos+1, end-pos-1);
+			if( name.size() > 0 && myContents.find(name) != myContents.end() ) {
+				out += evaluateKey(name, state);
+				pos = end;
+				continue;
 			}
-			
 		}
-        }
+		out += text[pos];
+		pos++;
+	}
+	return out;
+
+}
+
+
+string ConfigFile::runShell( const string& command ){
+
+	FILE *in;
+	char buff[512];
+	in = popen(command.c_str(), "r");
+	string result = "";
+	if( in == NULL ) return result;
+	if(fgets(buff, sizeof(buff), in)!=NULL) {
+		string tempString(buff);
+		result = tempString.substr(0, tempString.find("\n"));
+	}
+	pclose(in);
+	return result;
 
 }
 void ConfigFile::showValues(){
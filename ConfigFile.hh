@@ -79,6 +79,8 @@ public:
 	
 	string setValue(const string& key, string value);
 	//string getLineByKey( const string& key);
+	// Evaluate "$(expression)" values in-process, "$sh(command)" through the shell,
+	// and substitute "$key" references in any other value starting with '$'
 	void calculateFormulas();
 	void showValues();
 	// Search for key and read value or optional default value
@@ -115,6 +117,9 @@ protected:
         template<class T> static string T_as_string( const T& t );
         template<class T> static T string_as_T( const string& st );
 	static void trim( string& st );
+	string evaluateKey( const string& key, std::map<string,int>& state );
+	string substituteKeys( const string& text, std::map<string,int>& state );
+	string runShell( const string& command );
 
 
 // Exception types
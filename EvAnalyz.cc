@@ -1,37 +1,313 @@
 #include "EvAnalyz.hh"
 #include "ConfigFile.hh"
+#include "PerfReport.hh"
+#include "GausFit.hh"
+#include "FastHisto.hh"
+#include "SkimFile.hh"
+#include "ArrowFile.hh"
+#include "Formula.hh"
+#include "Pipeline.hh"
+#include "Checkpoint.hh"
 
 #include <vector>
 #include <string>
+#include <thread>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <cmath>
+#include <cstring>
 
 #include "TString.h"
 #include "TCanvas.h"
 #include "TF1.h"
 #include "TFile.h"
 #include "TTree.h"
+#include "TChainElement.h"
 #include "TLegend.h"
 #include "TLatex.h"
 #include "TStyle.h"
 
 using namespace std;
 
+// bin that Fill would use, -1 for under/overflow as Fill returns; the profile is not touched,
+// so the corrections can look up bins from several threads
 int GetBinNumber(TProfile* p,float x)
 {
-  TProfile p_aux(*p);
-  return p_aux.Fill(x,0.);
+  int bin = p->GetXaxis()->FindFixBin(x);
+  if(bin<1 || bin>p->GetXaxis()->GetNbins())
+    return -1;
+  return bin;
 }
 
 int GetBinNumber2d(TProfile2D* p2, float x, float y)
 {
-  TProfile2D p2_aux(*p2);
-  return p2_aux.Fill(x,y,0.);
+  int binx = p2->GetXaxis()->FindFixBin(x);
+  int biny = p2->GetYaxis()->FindFixBin(y);
+  if(binx<1 || binx>p2->GetXaxis()->GetNbins() || biny<1 || biny>p2->GetYaxis()->GetNbins())
+    return -1;
+  return p2->GetBin(binx,biny);
 }
 
+static const int kBatchSize = 4096;
+static const int kJackknifeGroups = 10;   // max number of groups of strata of the preview errors
+static const int kPreviewChunk = 256;     // contiguous entries read at a time in preview mode
+static const int kTimeBins = 200;         // binning of the time histograms, times relative to the offset
+static const double kTimeMin = -0.505;
+static const double kTimeMax = 1.495;
+static const int kMaxSeparateThr = 8;     // above this number of thresholds the plots are compact by default
+static const int kMaxImpactMaps = 4;      // impact point maps drawn in the compact layout
+
+// checkpoint i/o of a vector of accumulators; Read fills them in place, the number comes
+// from the empty sums of the pass
+template<class T> void WriteAll(std::ostream& out, const std::vector<T>& v)
+{
+   for(unsigned k=0; k<v.size(); k++)
+      v[k].Write(out);
+}
+template<class T> bool ReadAll(std::istream& in, std::vector<T>& v)
+{
+   for(unsigned k=0; k<v.size(); k++)
+      if(!v[k].Read(in))
+         return false;
+   return true;
+}
+
+// the moments are taken relative to a shift known before the first batch, which keeps their
+// sums of squares well conditioned: the middle of the fit range or of the time histograms
+static float MomentShift(float min, float max) {return min<max ? 0.5*(min+max) : 0.5*(kTimeMin+kTimeMax);}
+
+// count, sum and sum of squares of the times of one batch in the unbinned fit range, for
+// each threshold and jackknife group: the fit and its replicas need nothing else
+struct MomentSums
+{
+   int ngroups;
+   std::vector<double> mom;      // threshold i, group g at 3*(i*ngroups+g)
+   float min, max, shift;
+
+   MomentSums(int nthr=0, int ngroups_=1, float min_=0, float max_=0) : ngroups(ngroups_), mom(3*nthr*ngroups_,0.), min(min_), max(max_), shift(MomentShift(min_,max_)) {};
+   void Fill(const EventBatch& batch)
+   {
+      for(int i=0; 3*i*ngroups<(int)mom.size(); i++)
+         AddGausMoments(batch.Time(i),batch.size,min,max,shift,&mom[3*(i*ngroups+batch.group)]);
+   };
+   void Merge(const MomentSums& other)
+   {
+      for(unsigned k=0; k<mom.size(); k++)
+         mom[k] += other.mom[k];
+   };
+   void Reset() {std::fill(mom.begin(),mom.end(),0.);};
+   bool Identical(const MomentSums& other) const
+   {
+      return mom.size()==other.mom.size() && (mom.empty() || memcmp(&mom[0],&other.mom[0],mom.size()*sizeof(double))==0);
+   };
+   void Write(std::ostream& out) const {WriteRaw(out,mom);};
+   bool Read(std::istream& in) {return ReadRaw(in,mom);};
+};
+
+// time histograms of one batch, for each threshold and for each threshold and jackknife group,
+// with the moments of the unbinned fit
+struct HistoSums
+{
+   std::vector<BatchHisto1D> time;
+   std::vector<std::vector<BatchHisto1D> > group;
+   MomentSums moments;
+
+   void Merge(const HistoSums& other)
+   {
+      for(unsigned i=0; i<time.size(); i++)
+      {
+         time[i].Merge(other.time[i]);
+         for(unsigned g=0; g<group[i].size(); g++)
+            group[i][g].Merge(other.group[i][g]);
+      }
+      moments.Merge(other.moments);
+   };
+   void Reset()
+   {
+      for(unsigned i=0; i<time.size(); i++)
+      {
+         time[i].Reset();
+         for(unsigned g=0; g<group[i].size(); g++)
+            group[i][g].Reset();
+      }
+      moments.Reset();
+   };
+   bool Identical(const HistoSums& other) const
+   {
+      for(unsigned i=0; i<time.size(); i++)
+      {
+         if(!time[i].Identical(other.time[i]))
+            return false;
+         for(unsigned g=0; g<group[i].size(); g++)
+            if(!group[i][g].Identical(other.group[i][g]))
+               return false;
+      }
+      return moments.Identical(other.moments);
+   };
+   void Write(std::ostream& out) const
+   {
+      WriteAll(out,time);
+      for(unsigned i=0; i<group.size(); i++)
+         WriteAll(out,group[i]);
+      moments.Write(out);
+   };
+   bool Read(std::istream& in)
+   {
+      bool ok = ReadAll(in,time);
+      for(unsigned i=0; ok && i<group.size(); i++)
+         ok = ReadAll(in,group[i]);
+      return ok && moments.Read(in);
+   };
+};
+
+// time profiles of one batch, the ones not requested stay empty
+struct ProfileSums
+{
+   std::vector<BatchProfile1D> amp, risetime;
+   std::vector<BatchProfile2D> pos;
+   std::vector<ResolutionMap2D> res;
+
+   void Merge(const ProfileSums& other)
+   {
+      for(unsigned i=0; i<amp.size(); i++)
+         amp[i].Merge(other.amp[i]);
+      for(unsigned i=0; i<risetime.size(); i++)
+         risetime[i].Merge(other.risetime[i]);
+      for(unsigned i=0; i<pos.size(); i++)
+         pos[i].Merge(other.pos[i]);
+      for(unsigned i=0; i<res.size(); i++)
+         res[i].Merge(other.res[i]);
+   };
+   void Reset()
+   {
+      for(unsigned i=0; i<amp.size(); i++)
+         amp[i].Reset();
+      for(unsigned i=0; i<risetime.size(); i++)
+         risetime[i].Reset();
+      for(unsigned i=0; i<pos.size(); i++)
+         pos[i].Reset();
+      for(unsigned i=0; i<res.size(); i++)
+         res[i].Reset();
+   };
+   bool Identical(const ProfileSums& other) const
+   {
+      for(unsigned i=0; i<amp.size(); i++)
+         if(!amp[i].Identical(other.amp[i]))
+            return false;
+      for(unsigned i=0; i<risetime.size(); i++)
+         if(!risetime[i].Identical(other.risetime[i]))
+            return false;
+      for(unsigned i=0; i<pos.size(); i++)
+         if(!pos[i].Identical(other.pos[i]))
+            return false;
+      for(unsigned i=0; i<res.size(); i++)
+         if(!res[i].Identical(other.res[i]))
+            return false;
+      return true;
+   };
+   void Write(std::ostream& out) const
+   {
+      WriteAll(out,amp);
+      WriteAll(out,risetime);
+      WriteAll(out,pos);
+      WriteAll(out,res);
+   };
+   bool Read(std::istream& in)
+   {
+      return ReadAll(in,amp) && ReadAll(in,risetime) && ReadAll(in,pos) && ReadAll(in,res);
+   };
+};
+
+// time vs (amplitude, impact point) of one batch, for each threshold
+struct JointSums
+{
+   std::vector<SparseProfile3D> time;
+
+   void Merge(const JointSums& other)
+   {
+      for(unsigned i=0; i<time.size(); i++)
+         time[i].Merge(other.time[i]);
+   };
+   void Reset()
+   {
+      for(unsigned i=0; i<time.size(); i++)
+         time[i].Reset();
+   };
+   bool Identical(const JointSums& other) const
+   {
+      for(unsigned i=0; i<time.size(); i++)
+         if(!time[i].Identical(other.time[i]))
+            return false;
+      return true;
+   };
+   void Write(std::ostream& out) const {WriteAll(out,time);};
+   bool Read(std::istream& in) {return ReadAll(in,time);};
+};
+
+// the products filled together by a pass, the ones not requested stay empty
+struct ProductSums
+{
+   HistoSums histo;
+   ProfileSums profile;
+
+   void Merge(const ProductSums& other) {histo.Merge(other.histo); profile.Merge(other.profile);};
+   void Reset() {histo.Reset(); profile.Reset();};
+   bool Identical(const ProductSums& other) const {return histo.Identical(other.histo) && profile.Identical(other.profile);};
+   void Write(std::ostream& out) const {histo.Write(out); profile.Write(out);};
+   bool Read(std::istream& in) {return histo.Read(in) && profile.Read(in);};
+};
+
+// operator new calls of the derive and kernel stages of a pass of FillBatches, per batch slot,
+// and of its in-order merge; after the warm-up the batches and the accumulators have their
+// final size and any allocation fails the check
+struct AllocationCount
+{
+   std::vector<Long64_t> slot;
+   int warmup;
+   Long64_t batches, events, stages, commits;
+
+   AllocationCount(int nslots) : slot(nslots,0), warmup(2*nslots), batches(0), events(0), stages(0), commits(0) {};
+   void Commit(int s, int size, Long64_t commit)
+   {
+      if(warmup>0)
+         warmup--;
+      else
+      {
+         batches++;
+         events += size;
+         stages += slot[s];
+         commits += commit;
+      }
+      slot[s] = 0;
+   };
+   void Check(const std::string& label) const
+   {
+      if(batches==0)
+         return;
+      cout<<">> "<<stages+commits<<" allocations in the event loop of "<<label<<" over "<<batches<<" batches ("<<events<<" events) after the warm-up, "
+          <<stages<<" in the batch stages and "<<commits<<" in the commit"<<endl;
+      if(stages+commits>0)
+      {
+         cerr<<"[ERROR]: the event loop of "<<label<<" allocates after the warm-up"<<endl;
+         exit(EXIT_FAILURE);
+      }
+   };
+};
+
 void FindSmallestInterval(float* ret, TH1F* histo, const float& fraction, const bool& verbosity);
 
 EvAnalyz::EvAnalyz(const ConfigFile & config)//:
 //fconfig(config)
 {
+   fmoment_groups = 0;
+   fresident = 0;
+   fh2_time_thr = 0;
+   fzones = 0;
+   fproducts = 0;
+   frequested = 0;
+   fstager = 0;
+   fstage_first = fstage_end = 0;
    gStyle->SetOptStat(0);
    gStyle->SetOptTitle(0);
    vector<string> Filename;
@@ -54,29 +330,88 @@ EvAnalyz::EvAnalyz(const ConfigFile & config)//:
    cout<<"> Parsing config file"<<endl; 
    ParseConfigFile(config); 
 
-   fDataTree = new TChain("digi","digi");
-   int nfiles=0;
-   for(std::vector<string>::iterator it = Filename.begin() ; it != Filename.end(); ++it)
-      nfiles += fDataTree->Add(it->c_str());
-   if(nfiles==0)
+   if(Filename.size()==1 && TString(Filename[0]).EndsWith(".skim"))
    {
-      cerr<<"[ERROR]: empty tree"<<endl;
-      exit(EXIT_FAILURE);
+      PerfScope perf("OpenSkim",fDataLabel);
+      fDataTree = 0;
+      fSkim = new SkimReader(Filename[0]);
+      cout<<"> skim "<<Filename[0]<<" opened, "<<fSkim->GetEntries()<<" entries"<<endl;
+      if(fthr.empty())
+         DiscoverThresholds(config.read<float>("thr_min",0),config.read<float>("thr_max",1e9));
+      SetSkimColumns();
    }
    else
-      cout<<"> "<<nfiles<<" file added to chain for a total of "<<fDataTree->GetEntries()<<" entries"<<endl;
-   SetBranchTree();
-   CreateProfile();
-   CreateHisto();
-   FillProfile();
-   FillHisto();
-
+   {
+      PerfScope perf("OpenChain",fDataLabel);
+      fSkim = 0;
+      fDataTree = new TChain("digi","digi");
+      string index_file = config.read<string>("chain_index","");
+      findex = ChainIndex("digi",index_file);
+      int nfiles=0;
+      bool unindexed=false;
+      for(std::vector<string>::iterator it = Filename.begin() ; it != Filename.end(); ++it)
+      {
+         int first = findex.GetNFiles();
+         if(findex.AddGlob(*it)>0)
+            nfiles += findex.FillChain(fDataTree,first);
+         else
+         {
+            //not a local glob (e.g. a remote url): let TChain resolve it
+            nfiles += fDataTree->Add(it->c_str());
+            unindexed = true;
+         }
+      }
+      findex.Save();
+      if(unindexed)
+      {
+         findex = ChainIndex();
+         findex.AddChain(fDataTree);
+      }
+      if(nfiles==0)
+      {
+         cerr<<"[ERROR]: empty tree"<<endl;
+         exit(EXIT_FAILURE);
+      }
+      else
+         cout<<"> "<<nfiles<<" file added to chain for a total of "<<fDataTree->GetEntries()<<" entries"<<endl;
+      if(fthr.empty())
+         DiscoverThresholds(config.read<float>("thr_min",0),config.read<float>("thr_max",1e9));
+      SetBranchTree();
+      //zones need the identity of the files, as the chain index
+      string zone_file = config.read<string>("zone_map","");
+      if(!unindexed && zone_file!="")
+      {
+         std::vector<string> columns;
+         columns.push_back("mu_x_hit");
+         columns.push_back("mu_y_hit");
+         columns.push_back("AMP_MAX");
+         for(int i=0; i<fNthr; i++)
+            columns.push_back(Form("LDE%.0f",fthr[i]));
+         fzones = new ZoneMap(zone_file,columns);
+         fzones->Attach(findex);
+      }
+      //copies of the next files made while the current one is read, shared by the runs
+      string stage_dir = config.read<string>("stage_dir","");
+      if(!unindexed && stage_dir!="")
+      {
+         fstager = new FileStager(stage_dir,(Long64_t)(config.read<double>("stage_budget",20000)*1024*1024),config.read<int>("stage_ahead",2));
+         fstager->Attach(findex);
+      }
+   }
+   CompileDerived();
+   //histograms and profiles are filled on first request
+   BuildSample();
 }
 
 
 //---------------------------------------------------------------------------------------------------------------
-EvAnalyz::EvAnalyz(TChain* outtree, int Nthr, vector<float> thr, string DataLabel, float amp_min, float amp_max, float risetime_min, float risetime_max, float time_offset):
+EvAnalyz::EvAnalyz(TChain* outtree, int Nthr, vector<float> thr, string DataLabel, float amp_min, float amp_max, float risetime_min, float risetime_max, float time_offset, const EvAnalyzOptions& opt):
 fDataTree(outtree),
+fzones(0),
+fstager(0),
+fstage_first(0),
+fstage_end(0),
+fSkim(0),
 fNthr(Nthr),
 fthr(thr),
 fDataLabel(DataLabel),
@@ -84,15 +419,51 @@ famp_min(amp_min),
 famp_max(amp_max),
 frisetime_min(risetime_min),
 frisetime_max(risetime_max),
-ftime_offset(time_offset)
+ftime_offset(time_offset),
+fh2_time_thr(0),
+fmoment_groups(0),
+fresident(0),
+fproducts(0),
+frequested(0),
+fopt(opt)
 {
    gStyle->SetOptStat(0);
    gStyle->SetOptTitle(0);
+   findex.AddChain(fDataTree);
    SetBranchTree();
-   CreateProfile();
-   CreateHisto();
-   FillProfile();
-   FillHisto();
+   CompileDerived();
+   BuildSample();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+EvAnalyz::EvAnalyz(SkimReader* skim, int Nthr, vector<float> thr, string DataLabel, float amp_min, float amp_max, float risetime_min, float risetime_max, float time_offset, const EvAnalyzOptions& opt):
+fDataTree(0),
+fzones(0),
+fstager(0),
+fstage_first(0),
+fstage_end(0),
+fSkim(skim),
+fNthr(Nthr),
+fthr(thr),
+fDataLabel(DataLabel),
+famp_min(amp_min),
+famp_max(amp_max),
+frisetime_min(risetime_min),
+frisetime_max(risetime_max),
+ftime_offset(time_offset),
+fh2_time_thr(0),
+fmoment_groups(0),
+fresident(0),
+fproducts(0),
+frequested(0),
+fopt(opt)
+{
+   gStyle->SetOptStat(0);
+   gStyle->SetOptTitle(0);
+   SetSkimColumns();
+   CompileDerived();
+   BuildSample();
 }
 
 //---------------------------------------------------------------------------------------------------------------
@@ -112,10 +483,20 @@ EvAnalyz::~EvAnalyz()
    {
       delete fh_time[fthr[i]];
    }
+   delete fh2_time_thr;
+   for(std::map<std::string,TH2F*>::iterator it=fthr_maps.begin(); it!=fthr_maps.end(); ++it)
+      delete it->second;
+   for(std::map<std::string,TH2F*>::iterator it=fres_maps.begin(); it!=fres_maps.end(); ++it)
+      delete it->second;
    cout<<"OK"<<endl;
 
+   delete fzones;
+   delete fstager;
+
    cout<<"> Deleting chain";
    delete fDataTree;
+   delete fSkim;
+   delete fresident;
    cout<<"OK"<<endl;
 
    cout<<"> Deleting canvases";
@@ -142,7 +523,10 @@ void EvAnalyz::ParseConfigFile(const ConfigFile & config)
       fDataLabel = Label_ToBeModified.Data();
    }
 
-   if(config.keyExists("thr"))
+   //thr = auto takes all the LDE branches, found once the chain is open
+   if(config.keyExists("thr") && config.read<string>("thr")=="auto")
+      fthr.clear();
+   else if(config.keyExists("thr"))
       config.readIntoVect(fthr,"thr");
    else
    {
@@ -176,12 +560,95 @@ void EvAnalyz::ParseConfigFile(const ConfigFile & config)
    else
       ftime_offset = 10;
 
+   if(config.keyExists("nthreads"))
+      fopt.nthreads = config.read<int>("nthreads");
+   else
+      fopt.nthreads = std::thread::hardware_concurrency();
+   if(fopt.nthreads<1)
+      fopt.nthreads = 1;
+
+   //the reader is always one thread, the chain cannot be read concurrently
+   fopt.pipeline_derive_threads = config.read<int>("pipeline_derive_threads",1);
+   fopt.pipeline_kernel_threads = config.read<int>("pipeline_kernel_threads",fopt.nthreads);
+   fopt.pipeline_depth = config.read<int>("pipeline_depth",0);
+
+   if(config.keyExists("ml_fit_min") && config.keyExists("ml_fit_max"))
+   {
+      fopt.ml_fit_min = config.read<float>("ml_fit_min");
+      fopt.ml_fit_max = config.read<float>("ml_fit_max");
+   }
+
+   if(config.keyExists("skim_format"))
+   {
+      string format = config.read<string>("skim_format");
+      if(format!="root" && format!="quantized")
+      {
+         cerr<<"[ERROR]: unknown skim_format "<<format<<", use root or quantized"<<endl;
+         exit(EXIT_FAILURE);
+      }
+      fopt.skim = (format=="quantized");
+   }
+   fopt.skim_time_lsb = config.read<float>("skim_time_lsb",fopt.skim_time_lsb);
+   fopt.skim_pos_lsb = config.read<float>("skim_pos_lsb",fopt.skim_pos_lsb);
+   fopt.skim_amp_lsb = config.read<float>("skim_amp_lsb",fopt.skim_amp_lsb);
+
+   if(config.keyExists("preview_fraction"))
+      fopt.preview_fraction = config.read<float>("preview_fraction");
+   else
+      fopt.preview_fraction = 1;
+   if(fopt.preview_fraction<=0 || fopt.preview_fraction>1)
+   {
+      cerr<<"[ERROR]: <preview_fraction> must be in (0,1]"<<endl;
+      exit(EXIT_FAILURE);
+   }
+
+   //derived_<name> = <expression> defines the column <name>, in order of appearance
+   fopt.derived.clear();
+   for(unsigned k=0; k<config.myContentsVec.size(); k++)
+   {
+      const string& key = config.myContentsVec[k].first;
+      if(key.compare(0,8,"derived_")==0 && key.size()>8)
+         fopt.derived.push_back(std::make_pair(key.substr(8),config.read<string>(key)));
+   }
+   fopt.cut = config.read<string>("cut","");
+
+   string layout = config.read<string>("thr_layout","auto");
+   fopt.thr_layout = (layout=="compact") ? 1 : (layout=="separate") ? 0 : -1;
+
+   if(config.keyExists("joint_amp_bins"))
+      fopt.joint_amp_bins = config.read<int>("joint_amp_bins");
+   else
+      fopt.joint_amp_bins = 20;
+
+   fopt.check_allocations = config.read<bool>("check_allocations",false);
+   if(fopt.check_allocations && !PerfReport::CountsAllocations())
+   {
+      cerr<<"[WARNING]: check_allocations needs a build with -DCOUNT_ALLOCATIONS, ignored"<<endl;
+      fopt.check_allocations = false;
+   }
+   if(config.keyExists("verify_reduction"))
+      fopt.verify_reduction = config.read<bool>("verify_reduction");
+   else
+      fopt.verify_reduction = false;
+
+   if(config.keyExists("target_precision"))
+      fopt.target_precision = config.read<float>("target_precision");
+   else
+      fopt.target_precision = 0;
+
+   if(config.keyExists("memory_budget"))
+      fopt.memory_budget = config.read<float>("memory_budget");
+   else
+      fopt.memory_budget = 1024;
+   fopt.scratch_dir = config.read<string>("scratch_dir","/tmp");
+
 }
 
 
 //---------------------------------------------------------------------------------------------------------------
 void EvAnalyz::SetBranchTree()
 {
+   PerfScope perf("SetBranchTree",fDataLabel);
    cout<<">> Branching the chain"<<endl;
    fDataTree->SetBranchStatus("*", 0);
    
@@ -192,10 +659,12 @@ void EvAnalyz::SetBranchTree()
    fDataTree -> SetBranchAddress("mu_y_hit",&fmu_x_hit);
    fDataTree -> SetBranchAddress("AMP_MAX",&fAMP_MAX);
 
+   ftime_addr.resize(fNthr);
    for(int i=0; i<fNthr; i++)
    {
       fDataTree -> SetBranchStatus(Form("LDE%.0f",fthr[i]),1); 
       fDataTree -> SetBranchAddress(Form("LDE%.0f",fthr[i]),&ftime[fthr[i]]);
+      ftime_addr[i] = &ftime[fthr[i]];
    }
 
    //fDataTree -> SetBranchStatus("PH2",1); fDataTree -> SetBranchAddress("PH2",&Phtime2);
@@ -207,6 +676,696 @@ void EvAnalyz::SetBranchTree()
 }
 
 
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::DiscoverThresholds(float thr_min, float thr_max)
+{
+   //every LDE<n> branch of the tree (or column of the skim) with thr_min <= n <= thr_max
+   std::vector<std::string> names;
+   if(fSkim)
+      for(int c=0; c<fSkim->GetNColumns(); c++)
+         names.push_back(fSkim->GetColumn(c).name);
+   else
+   {
+      fDataTree->LoadTree(0);
+      TObjArray* branches = fDataTree->GetListOfBranches();
+      for(int b=0; branches && b<branches->GetEntriesFast(); b++)
+         names.push_back(branches->At(b)->GetName());
+   }
+   fthr.clear();
+   for(unsigned k=0; k<names.size(); k++)
+   {
+      const std::string& name = names[k];
+      if(name.size()<4 || name.compare(0,3,"LDE")!=0 || name.find_first_not_of("0123456789",3)!=std::string::npos)
+         continue;
+      float thr = atof(name.c_str()+3);
+      if(thr>=thr_min && thr<=thr_max)
+         fthr.push_back(thr);
+   }
+   std::sort(fthr.begin(),fthr.end());
+   fthr.erase(std::unique(fthr.begin(),fthr.end()),fthr.end());
+   fNthr = fthr.size();
+   if(fNthr==0)
+   {
+      cerr<<"[ERROR]: no LDE branch found for thr = auto"<<endl;
+      exit(EXIT_FAILURE);
+   }
+   cout<<"> "<<fNthr<<" thresholds found, from "<<fthr.front()<<" to "<<fthr.back()<<" ph"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool EvAnalyz::IsCompactLayout() const
+{
+   return fopt.thr_layout>0 || (fopt.thr_layout<0 && fNthr>kMaxSeparateThr);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+std::vector<double> EvAnalyz::GetThresholdEdges() const
+{
+   //one bin per threshold, edges halfway between consecutive thresholds
+   std::vector<double> edges(fNthr+1);
+   for(int i=1; i<fNthr; i++)
+      edges[i] = 0.5*(fthr[i-1]+fthr[i]);
+   double first = fNthr>1 ? fthr[1]-fthr[0] : 1;
+   double last = fNthr>1 ? fthr[fNthr-1]-fthr[fNthr-2] : 1;
+   edges[0] = fthr[0]-0.5*first;
+   edges[fNthr] = fthr[fNthr-1]+0.5*last;
+   return edges;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+TH2F* EvAnalyz::ThresholdMap(const std::string& name, std::map<float,TProfile*>& profiles)
+{
+   //mean time of each bin of the profiles, one row per threshold
+   TProfile* p = profiles[fthr[0]];
+   int nx = p->GetXaxis()->GetNbins();
+   std::vector<double> edges = GetThresholdEdges();
+   delete fthr_maps[name];
+   TH2F* map = new TH2F(name.c_str(),name.c_str(),nx,p->GetXaxis()->GetXmin(),p->GetXaxis()->GetXmax(),fNthr,&edges[0]);
+   for(int i=0; i<fNthr; i++)
+      for(int b=1; b<=nx; b++)
+         map->SetBinContent(b,i+1,profiles[fthr[i]]->GetBinContent(b));
+   fthr_maps[name] = map;
+   return map;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+TH2F* EvAnalyz::ResolutionMap(float thr, const std::string& option)
+{
+   //option: "rms", "width68" (half width of the central 68% interval) or "entries", 0 if not filled
+   Require(kPosProfile);
+   int ithr = std::find(fthr.begin(),fthr.end(),thr)-fthr.begin();
+   if(ithr>=(int)fres_x_y.size() || !fp2_time_x_y.count(thr))
+      return 0;
+   TProfile2D* p = fp2_time_x_y[thr];
+   std::string name = Form("%s, time %s vs impact point, thr = %.0f ph",fDataLabel.c_str(),option.c_str(),thr);
+   delete fres_maps[name];
+   TH2F* map = new TH2F(name.c_str(),name.c_str(),p->GetXaxis()->GetNbins(),p->GetXaxis()->GetXmin(),p->GetXaxis()->GetXmax(),
+                        p->GetYaxis()->GetNbins(),p->GetYaxis()->GetXmin(),p->GetYaxis()->GetXmax());
+   if(option=="entries")
+   {
+      for(int bx=1; bx<=p->GetXaxis()->GetNbins(); bx++)
+         for(int by=1; by<=p->GetYaxis()->GetNbins(); by++)
+            map->SetBinContent(bx,by,fres_x_y[ithr].GetEntries(bx,by));
+   }
+   else
+      fres_x_y[ithr].CopyTo(option=="rms" ? map : 0, option=="rms" ? 0 : map);
+   fres_maps[name] = map;
+   return map;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::SetSkimColumns()
+{
+   //same x/y swap as SetBranchTree: column mu_x_hit goes to y and viceversa
+   fskim_col.clear();
+   fskim_col.push_back(fSkim->FindColumn("mu_y_hit"));
+   fskim_col.push_back(fSkim->FindColumn("mu_x_hit"));
+   fskim_col.push_back(fSkim->FindColumn("AMP_MAX"));
+   for(int i=0; i<fNthr; i++)
+      fskim_col.push_back(fSkim->FindColumn(Form("LDE%.0f",fthr[i])));
+   for(unsigned c=0; c<fskim_col.size(); c++)
+      if(fskim_col[c]<0)
+      {
+         cerr<<"[ERROR]: missing column in skim "<<fSkim->GetFileName()<<endl;
+         exit(EXIT_FAILURE);
+      }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::CompileDerived()
+{
+   //columns are numbered x, y, AMP_MAX, the thresholds, then the derived columns in order
+   std::vector<std::string> names;
+   names.push_back("mu_x_hit");
+   names.push_back("mu_y_hit");
+   names.push_back("AMP_MAX");
+   for(int i=0; i<fNthr; i++)
+      names.push_back(Form("LDE%.0f",fthr[i]));
+
+   //the risetime is a derived column as well, time(50)-time(20) unless redefined
+   std::vector<std::pair<std::string,std::string> > derived = fopt.derived;
+   bool risetime = false;
+   for(unsigned k=0; k<derived.size(); k++)
+      risetime |= (derived[k].first=="risetime");
+   if(!risetime)
+      derived.insert(derived.begin(),std::make_pair(std::string("risetime"),std::string("LDE50-LDE20")));
+
+   fderived.clear();
+   fderived_args.clear();
+   for(unsigned k=0; k<=derived.size(); k++)
+   {
+      bool iscut = (k==derived.size());
+      if(iscut && fopt.cut.empty())
+         break;
+      const std::string& name = iscut ? std::string("cut") : derived[k].first;
+      const std::string& expr = iscut ? fopt.cut : derived[k].second;
+      Formula* formula = 0;
+      try
+      {
+         formula = new Formula(expr);
+      }
+      catch(Formula::parse_error& e)
+      {
+         cerr<<"[ERROR]: cannot parse <"<<name<<"> = "<<expr<<": "<<e.msg<<endl;
+         exit(EXIT_FAILURE);
+      }
+      std::vector<int> args;
+      for(unsigned v=0; v<formula->GetVariables().size(); v++)
+      {
+         const std::string& var = formula->GetVariables()[v];
+         int col = std::find(names.begin(),names.end(),var)-names.begin();
+         if(col==(int)names.size())
+         {
+            cerr<<"[ERROR]: <"<<name<<"> uses "<<var<<", which is neither a column, a threshold in <thr> nor a derived column defined before"<<endl;
+            if(name=="risetime" && !risetime)
+               cerr<<"[ERROR]: the default risetime needs thresholds 20 and 50, add them to <thr> or define <derived_risetime>"<<endl;
+            exit(EXIT_FAILURE);
+         }
+         args.push_back(col);
+      }
+      fderived.push_back(*formula);
+      fderived_args.push_back(args);
+      delete formula;
+      if(!iscut)
+      {
+         names.push_back(name);
+         if(name=="risetime")
+            frisetime_col = k;
+      }
+   }
+   fNderived = derived.size();
+   fcolumns = names;
+   //everything until the next pass says what it uses; the branches stay as the last pass set them
+   fderived_eval.assign(fNderived,1);
+   if(fread_col.empty())
+      fread_col.assign(3+fNthr,1);
+   PruneZones();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::Project(int columns)
+{
+   //columns used by the pass, then the ones of the cut and of the derived columns they need:
+   //only their branches are read and only those derived columns evaluated, the other
+   //columns of the batches are left as they are
+   int nbase = 3+fNthr;
+   std::vector<char> need(nbase+fNderived,0);
+   need[0] = need[1] = (columns & kColPos)!=0;
+   need[2] = (columns & kColAmp)!=0;
+   for(int i=0; i<fNthr; i++)
+      need[3+i] = (columns & kColTimes)!=0;
+   if(columns & kColRiseTime)
+      need[nbase+frisetime_col] = 1;
+   if(columns & kColDerived)
+      std::fill(need.begin()+nbase,need.end(),1);
+   if((int)fderived.size()>fNderived)
+      for(unsigned v=0; v<fderived_args[fNderived].size(); v++)
+         need[fderived_args[fNderived][v]] = 1;
+   //a file without zones gets them from the next pass that reads it whole: every column is
+   //read, but only for the files the sample covers entirely (none in preview)
+   if(fzones && !fresident && fzones->IsBuilding())
+   {
+      std::vector<std::pair<Long64_t,Long64_t> > ranges;
+      for(unsigned r=0; r<fsample.size(); r++)
+         ranges.push_back(std::make_pair(fsample[r].first,fsample[r].last));
+      fzones->KeepBuilding(ranges);
+      if(fzones->IsBuilding())
+         std::fill(need.begin(),need.begin()+nbase,1);
+   }
+   //a derived column only uses the columns before it
+   for(int k=fNderived-1; k>=0; k--)
+      if(need[nbase+k])
+         for(unsigned v=0; v<fderived_args[k].size(); v++)
+            need[fderived_args[k][v]] = 1;
+   fderived_eval.assign(need.begin()+nbase,need.end());
+   need.resize(nbase);
+   if(need==fread_col)
+      return;
+   fread_col = need;
+   if(fSkim)
+   {
+      std::vector<char> selected(fSkim->GetNColumns(),0);
+      for(int c=0; c<nbase; c++)
+         selected[fskim_col[c]] = fread_col[c];
+      fSkim->Select(selected);
+   }
+   if(!fDataTree)
+      return;
+   //branch names as in the files, x and y swapped
+   fDataTree->SetBranchStatus("mu_y_hit",fread_col[0]);
+   fDataTree->SetBranchStatus("mu_x_hit",fread_col[1]);
+   fDataTree->SetBranchStatus("AMP_MAX",fread_col[2]);
+   for(int i=0; i<fNthr; i++)
+      fDataTree->SetBranchStatus(Form("LDE%.0f",fthr[i]),fread_col[3+i]);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::PruneZones()
+{
+   //bounds of every column over each cluster, derived ones included, then of the cut:
+   //the clusters where it is 0 for sure are skipped by ReadBatch
+   fzone_skip.clear();
+   if(!fzones || (int)fderived.size()==fNderived)
+      return;
+   int nzones = fzones->GetNZones();
+   int ncols = 3+fNthr+fNderived;
+   fzone_skip.assign(nzones,0);
+   std::vector<double> lo(ncols), hi(ncols), arglo, arghi;
+   Long64_t skipped = 0, nskipped = 0;
+   for(int z=0; z<nzones; z++)
+   {
+      //same x/y swap as SetBranchTree: zone column mu_x_hit is y
+      const float* zmin = fzones->GetMin(z);
+      const float* zmax = fzones->GetMax(z);
+      lo[0] = zmin[1]; hi[0] = zmax[1];
+      lo[1] = zmin[0]; hi[1] = zmax[0];
+      lo[2] = zmin[2]; hi[2] = zmax[2];
+      for(int i=0; i<fNthr; i++)
+      {
+         //the same float subtraction as ReadBatch, monotonic
+         lo[3+i] = zmin[3+i]-ftime_offset;
+         hi[3+i] = zmax[3+i]-ftime_offset;
+      }
+      for(unsigned k=0; k<=(unsigned)fNderived; k++)
+      {
+         arglo.clear();
+         arghi.clear();
+         for(unsigned v=0; v<fderived_args[k].size(); v++)
+         {
+            arglo.push_back(lo[fderived_args[k][v]]);
+            arghi.push_back(hi[fderived_args[k][v]]);
+         }
+         double outlo, outhi;
+         fderived[k].EvalRange(arglo.empty() ? 0 : &arglo[0],arghi.empty() ? 0 : &arghi[0],outlo,outhi);
+         if((int)k==fNderived)
+         {
+            fzone_skip[z] = (outlo==0 && outhi==0);
+            break;
+         }
+         //derived columns are stored as float: room for the rounding
+         lo[3+fNthr+k] = outlo-1e-6*fabs(outlo);
+         hi[3+fNthr+k] = outhi+1e-6*fabs(outhi);
+      }
+      if(fzone_skip[z])
+      {
+         skipped += fzones->GetLast(z)-fzones->GetFirst(z);
+         nskipped++;
+      }
+   }
+   if(nzones>0)
+      cout<<">> Zone map: the cut skips "<<nskipped<<" of "<<nzones<<" clusters, "<<skipped<<" entries"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+const float* EvAnalyz::GetColumn(const EventBatch& batch, int col) const
+{
+   if(col==0) return &batch.mu_x_hit[0];
+   if(col==1) return &batch.mu_y_hit[0];
+   if(col==2) return &batch.AMP_MAX[0];
+   if(col<3+fNthr) return batch.Time(col-3);
+   return batch.Derived(col-3-fNthr);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::EvalDerived(EventBatch& batch) const
+{
+   //derived columns in order, then the cut compacts all the columns in place;
+   //the scratch is in the batch, several batches can be evaluated at once
+   std::vector<const float*>& vars = batch.args;
+   for(int k=0; k<fNderived; k++)
+   {
+      if(!fderived_eval[k])
+         continue;
+      vars.clear();
+      for(unsigned v=0; v<fderived_args[k].size(); v++)
+         vars.push_back(GetColumn(batch,fderived_args[k][v]));
+      fderived[k].EvalN(batch.size,vars.empty() ? 0 : &vars[0],batch.Derived(k),batch.stack);
+   }
+   if(fderived_eval[frisetime_col])
+      std::copy(batch.Derived(frisetime_col),batch.Derived(frisetime_col)+batch.size,batch.risetime.begin());
+   if((int)fderived.size()==fNderived)
+      return;
+
+   vars.clear();
+   for(unsigned v=0; v<fderived_args[fNderived].size(); v++)
+      vars.push_back(GetColumn(batch,fderived_args[fNderived][v]));
+   batch.mask.resize(batch.size);
+   fderived[fNderived].EvalN(batch.size,vars.empty() ? 0 : &vars[0],batch.mask.data(),batch.stack);
+   int kept = 0;
+   for(int j=0; j<batch.size; j++)
+   {
+      if(batch.mask[j]==0)
+         continue;
+      batch.mu_x_hit[kept] = batch.mu_x_hit[j];
+      batch.mu_y_hit[kept] = batch.mu_y_hit[j];
+      batch.AMP_MAX[kept] = batch.AMP_MAX[j];
+      batch.risetime[kept] = batch.risetime[j];
+      for(int i=0; i<fNthr; i++)
+         batch.Time(i)[kept] = batch.Time(i)[j];
+      for(int k=0; k<fNderived; k++)
+         batch.Derived(k)[kept] = batch.Derived(k)[j];
+      kept++;
+   }
+   batch.size = kept;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::BuildSample()
+{
+   //ranges already drawn by the dataset this one is derived from
+   fsample.swap(fopt.preview_sample);
+   fopt.preview_sample.clear();
+   fngroups = 1;
+   fjackknife = false;
+   fjackknife_group = -1;
+   for(unsigned r=0; r<fsample.size(); r++)
+      fngroups = max(fngroups,fsample[r].group+1);
+   if(!fsample.empty())
+      return;
+
+   Long64_t nentries = GetEntries();
+   if(fopt.preview_fraction>=1 && fopt.target_precision<=0)
+   {
+      fsample.push_back(EntryRange(0,nentries,0));
+      return;
+   }
+
+   //strata are the files of the chain, or equal slices of a skim
+   std::vector<Long64_t> bounds;
+   for(int f=0; f<findex.GetNFiles(); f++)
+      bounds.push_back(findex.GetFile(f).offset);
+   if(bounds.empty())
+      for(int s=0; s<kJackknifeGroups; s++)
+         bounds.push_back(nentries*s/kJackknifeGroups);
+   bounds.push_back(nentries);
+   int nstrata = bounds.size()-1;
+   fngroups = min(nstrata,kJackknifeGroups);
+
+   //the same fraction of every stratum, in chunks evenly spread over it
+   Long64_t chunk = fopt.preview_fraction<1 ? kPreviewChunk : kBatchSize;
+   Long64_t nsampled = 0;
+   std::vector<std::vector<EntryRange> > chunks(nstrata);
+   for(int s=0; s<nstrata; s++)
+   {
+      Long64_t n = bounds[s+1]-bounds[s];
+      if(n<=0)
+         continue;
+      Long64_t nsample = min((Long64_t)ceil(fopt.preview_fraction*n),n);
+      Long64_t nchunks = (nsample+chunk-1)/chunk;
+      if(nsample==n)
+      {
+         //the whole stratum, only cut in chunks for the early stop
+         for(Long64_t first=bounds[s]; first<bounds[s+1]; first+=chunk)
+            chunks[s].push_back(EntryRange(first,min(first+chunk,bounds[s+1]),s%fngroups));
+         nsampled += n;
+         continue;
+      }
+      for(Long64_t k=0; k<nchunks; k++)
+      {
+         //chunk k starts after the k chunks before it and k shares of the entries left out,
+         //so that the chunks never overlap and the last one ends within the stratum
+         Long64_t skipped = k*(n-nsample)/nchunks;
+         Long64_t first = bounds[s]+skipped+k*nsample/nchunks;
+         Long64_t last = bounds[s]+skipped+(k+1)*nsample/nchunks;
+         chunks[s].push_back(EntryRange(first,last,s%fngroups));
+         nsampled += last-first;
+      }
+   }
+
+   //with a target precision the loop can stop at any chunk: visit the strata round-robin
+   //so that the entries read so far are always spread over all of them
+   for(unsigned k=0; ; k++)
+   {
+      bool left = false;
+      for(int s=0; s<nstrata; s++)
+      {
+         if(fopt.target_precision<=0)
+         {
+            if(k==0)
+               fsample.insert(fsample.end(),chunks[s].begin(),chunks[s].end());
+            continue;
+         }
+         if(k<chunks[s].size())
+         {
+            fsample.push_back(chunks[s][k]);
+            left = true;
+         }
+      }
+      if(!left)
+         break;
+   }
+   if(fopt.preview_fraction<1)
+      cout<<"> Preview: "<<nsampled<<" of "<<nentries<<" entries from "<<nstrata<<" strata, "<<fngroups<<" jackknife groups"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool EvAnalyz::ReadNextBatch(EventBatch& batch, unsigned& range, Long64_t& next, bool verbose)
+{
+   //next batch of the sampled ranges in order, never across two ranges; false at the end
+   while(range<fsample.size() && next>=fsample[range].last)
+      if(++range<fsample.size())
+         next = fsample[range].first;
+   if(range>=fsample.size())
+      return false;
+   if(verbose)
+      cout<<"\tReading entry "<<next<< "\r" << std::flush;
+   int nrows = ReadBatch(batch,next,fsample[range].last);
+   batch.group = fsample[range].group;
+   batch.range = range;
+   next += nrows;
+   batch.last = next;
+   batch.endrange = next>=fsample[range].last;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int EvAnalyz::GetPipelineDepth() const
+{
+   //enough batches to keep every thread busy and one batch queued in front of each stage
+   if(fopt.pipeline_depth>0)
+      return fopt.pipeline_depth;
+   return 2*(fopt.pipeline_derive_threads+fopt.pipeline_kernel_threads)+2;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Long64_t EvAnalyz::ForEachBatch(int columns, const std::function<void(EventBatch&)>& body, bool verbose, const std::function<void(EventBatch&)>& kernel)
+{
+   //read, derived columns and the kernel run in the pipeline stages, the body runs on this
+   //thread with the batches in read order; the body writes outputs that allocate as they
+   //flush, the allocation check is left to the passes of FillBatches
+   SettleSample();
+   Project(columns);
+   Long64_t nread = 0;
+   unsigned range = 0;
+   Long64_t next = fsample.empty() ? 0 : fsample[0].first;
+   BatchPipeline pipeline(GetPipelineDepth(),fopt.pipeline_derive_threads,fopt.pipeline_kernel_threads,EventBatch(kBatchSize,fNthr,fNderived));
+   BatchPipeline::StageFunc kernelstage;
+   if(kernel)
+      kernelstage = [&](int, EventBatch& batch)
+      {
+         kernel(batch);
+      };
+   pipeline.Run([&](int, EventBatch& batch)
+   {
+      if(!ReadNextBatch(batch,range,next,verbose))
+         return false;
+      nread += next-batch.first;
+      return true;
+   },
+   [&](int, EventBatch& batch)
+   {
+      EvalDerived(batch);
+   },
+   kernelstage,
+   [&](int, EventBatch& batch)
+   {
+      body(batch);
+      return true;
+   });
+   PerfReport::Instance().CountEntries(nread);
+   if(verbose)
+   {
+      cout<<"\n";
+      pipeline.PrintStats(fDataLabel);
+   }
+   return nread;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Long64_t EvAnalyz::GetSampleEntries() const
+{
+   Long64_t n = 0;
+   for(unsigned r=0; r<fsample.size(); r++)
+      n += fsample[r].last-fsample[r].first;
+   return n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+template<class Sums> Sums EvAnalyz::FillBatches(const std::string& what, int columns, const Sums& empty, const std::function<void(Sums&,const EventBatch&)>& fill, const std::function<bool(const Sums&)>& stop)
+{
+   //every batch is a leaf of a fixed reduction tree: the kernel threads fill each batch into
+   //the sums of its slot and this thread merges them in read order, so the result only
+   //depends on the sample and not on the threads; a pass that can stop early fixes the sample
+   if(!stop)
+      SettleSample();
+   Project(columns);
+   Long64_t nread = 0;
+   unsigned range = 0;
+   Long64_t next = fsample.empty() ? 0 : fsample[0].first;
+   BatchPipeline pipeline(GetPipelineDepth(),fopt.pipeline_derive_threads,fopt.pipeline_kernel_threads,EventBatch(kBatchSize,fNthr,fNderived));
+   std::vector<Sums> leaves(pipeline.GetNSlots(),empty);
+   OrderedReduction<Sums> sum;
+   //the stop criterion looks at the sums so far, kept here in read order rather than
+   //folded out of the reduction tree at every range
+   Sums running = empty;
+   bool reserved = false;
+   unsigned stopped = fsample.size();
+   AllocationCount allocs(pipeline.GetNSlots());
+   bool count = fopt.check_allocations && PerfReport::CountsAllocations();
+
+   //a pass saved by an interrupted job goes on from there, a completed one reads nothing
+   Checkpoint& checkpoint = Checkpoint::Instance();
+   Checkpoint::Pass pass;
+   pass.name = what;
+   pass.label = fDataLabel;
+   pass.entries = GetSampleEntries();
+   const Checkpoint::Pass* saved = checkpoint.BeginPass(pass.name,pass.label,pass.entries);
+   if(saved)
+   {
+      std::istringstream in(saved->sums);
+      if(!sum.Read(in,empty))
+      {
+         cerr<<"[ERROR]: corrupted checkpoint of the "<<what<<" of "<<fDataLabel<<endl;
+         exit(EXIT_FAILURE);
+      }
+      stopped = saved->stopped;
+      if(stop)
+         running = sum.Result(empty);
+      range = saved->done ? fsample.size() : saved->range;
+      next = saved->next;
+      if(saved->done)
+         cout<<">> "<<what<<" restored from the checkpoint"<<endl;
+      else
+      {
+         int ifile = (fSkim || fresident) ? -1 : findex.FindFile(next);
+         cout<<">> Resuming the "<<what<<" from the checkpoint at entry ";
+         if(ifile>=0)
+            cout<<next-findex.GetFile(ifile).offset<<" of "<<findex.GetFile(ifile).path<<endl;
+         else
+            cout<<next<<endl;
+      }
+   }
+   std::function<void(unsigned,Long64_t,bool)> save = [&](unsigned r, Long64_t n, bool done)
+   {
+      std::ostringstream out;
+      sum.Write(out);
+      pass.sums = out.str();
+      pass.range = r;
+      pass.next = n;
+      pass.done = done;
+      pass.stopped = stopped;
+      checkpoint.Save(pass);
+   };
+
+   pipeline.Run([&](int, EventBatch& batch)
+   {
+      if(!ReadNextBatch(batch,range,next,true))
+         return false;
+      nread += next-batch.first;
+      return true;
+   },
+   [&](int slot, EventBatch& batch)
+   {
+      Long64_t before = count ? PerfReport::ThreadAllocations() : 0;
+      EvalDerived(batch);
+      if(count)
+         allocs.slot[slot] += PerfReport::ThreadAllocations()-before;
+   },
+   [&](int slot, EventBatch& batch)
+   {
+      Long64_t before = count ? PerfReport::ThreadAllocations() : 0;
+      //only the bins filled by the previous batch of the slot are cleared
+      leaves[slot].Reset();
+      fill(leaves[slot],batch);
+      if(count)
+         allocs.slot[slot] += PerfReport::ThreadAllocations()-before;
+   },
+   [&](int slot, EventBatch& batch)
+   {
+      Long64_t before = count ? PerfReport::ThreadAllocations() : 0;
+      if(stop)
+         running.Merge(leaves[slot]);
+      if(!reserved)
+         sum.Reserve(GetSampleEntries()/kBatchSize+fsample.size()+1,leaves[slot]);
+      reserved = true;
+      sum.Take(leaves[slot]);
+      allocs.Commit(slot,batch.size,count ? PerfReport::ThreadAllocations()-before : 0);
+      //early stop at the end of a range: the following passes read the same entries
+      if(stop && batch.endrange && batch.range+1<fsample.size() && stop(running))
+      {
+         stopped = batch.range+1;
+         return false;
+      }
+      //every few minutes, with the position after this batch; the batches read ahead are read again
+      if(checkpoint.IsDue())
+         save(batch.range,batch.last,false);
+      return true;
+   });
+   if(checkpoint.IsEnabled())
+      save(0,0,true);
+   if(stopped<fsample.size())
+   {
+      fsample.resize(stopped);
+      fngroups = 1;
+      for(unsigned k=0; k<fsample.size(); k++)
+         fngroups = max(fngroups,fsample[k].group+1);
+   }
+   PerfReport::Instance().CountEntries(nread);
+   cout<<"\n";
+   pipeline.PrintStats(fDataLabel);
+   if(count)
+      allocs.Check(fDataLabel);
+   return sum.Result(empty);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+template<class Sums> void EvAnalyz::VerifyReduction(const std::string& what, int columns, const Sums& result, const Sums& empty, const std::function<void(Sums&,const EventBatch&)>& fill)
+{
+   //the same leaves filled by a single thread: any difference is a bug of the parallel path
+   int nthreads = fopt.pipeline_kernel_threads;
+   int nderive = fopt.pipeline_derive_threads;
+   cout<<">> Verifying the "<<what<<" against a serial run"<<endl;
+   fopt.pipeline_kernel_threads = 1;
+   fopt.pipeline_derive_threads = 1;
+   Sums serial = FillBatches("serial "+what,columns,empty,fill);
+   fopt.pipeline_kernel_threads = nthreads;
+   fopt.pipeline_derive_threads = nderive;
+   if(!result.Identical(serial))
+   {
+      cerr<<"[ERROR]: "<<what<<" filled with "<<nthreads<<" threads differ from the serial ones"<<endl;
+      exit(EXIT_FAILURE);
+   }
+   cout<<">> "<<what<<" bitwise identical with 1 and "<<nthreads<<" threads"<<endl;
+}
+
+
 //---------------------------------------------------------------------------------------------------------------
 void EvAnalyz::CreateProfile(bool mkamp, bool mkrisetime, bool mkpos)
 {
@@ -229,56 +1388,379 @@ void EvAnalyz::CreateProfile(bool mkamp, bool mkrisetime, bool mkpos)
 }
 
 
-//-------------------------------------------------------------------------------------------------------------
-void EvAnalyz::CreateHisto()
+//-------------------------------------------------------------------------------------------------------------
+void EvAnalyz::CreateHisto()
+{
+   cout<<">> Creating time histogram"<<endl;
+   for(int i=0; i<fNthr; i++)
+      fh_time[fthr[i]] = new TH1F(	Form("%s, time distribution, thr = %.0f ph",fDataLabel.c_str(),fthr[i]),
+					Form("%s, time distribution, thr = %.0f ph",fDataLabel.c_str(),fthr[i]),
+					kTimeBins,kTimeMin,kTimeMax);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::Require(int products)
+{
+   //products are filled on first use; the ones requested before and still pending go in
+   //the same pass
+   Request(products);
+   if((products & ~fproducts)==0)
+      return;
+   int fill = frequested;
+   //reading up to the target precision fixes the sample: the time histograms go in the first pass
+   if(fopt.target_precision>0 && !(fproducts & kTimeHisto))
+      fill |= kTimeHisto;
+   FillProducts(fill);
+   frequested &= ~fill;
+
+   //files read whole by the first pass have their zones now
+   if(fzones && fzones->IsBuilding())
+   {
+      fzones->Save();
+      fzones->Attach(findex);
+      PruneZones();
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::Invalidate(int products)
+{
+   //the products already used are filled again at the next request, the others stay lazy
+   frequested |= fproducts & products;
+   fproducts &= ~products;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::SettleSample()
+{
+   //the passes reading the dataset for something else than the products see the final sample
+   if(fopt.target_precision>0 && !(fproducts & kTimeHisto))
+      Require(kTimeHisto);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::FillProducts(int products)
+{
+   PerfScope perf("FillProducts",fDataLabel);
+   bool mkhisto = products & kTimeHisto;
+   bool mkamp = products & kAmpProfile;
+   bool mkrisetime = products & kRiseTimeProfile;
+   bool mkpos = products & kPosProfile;
+   std::string what;
+   if(mkhisto)
+      what += ", time histograms";
+   if(mkamp)
+      what += ", time vs AMP_MAX";
+   if(mkrisetime)
+      what += ", time vs risetime";
+   if(mkpos)
+      what += ", time vs impact point";
+   what = what.substr(2);
+   cout<<">> Filling "<<what<<endl;
+
+   for(int i=0; i<fNthr; i++)
+   {
+      if(mkhisto)
+         delete fh_time[fthr[i]];
+      if(mkamp)
+         delete fp_time_amp[fthr[i]];
+      if(mkrisetime)
+         delete fp_time_risetime[fthr[i]];
+      if(mkpos)
+         delete fp2_time_x_y[fthr[i]];
+   }
+   if(mkhisto)
+      CreateHisto();
+   if(mkamp || mkrisetime || mkpos)
+      CreateProfile(mkamp,mkrisetime,mkpos);
+
+   //in preview mode each group of strata has its own histograms for the jackknife
+   bool grouped = fngroups>1;
+   ProductSums empty;
+   for(int i=0; mkhisto && i<fNthr; i++)
+   {
+      empty.histo.time.push_back(BatchHisto1D(fh_time[fthr[i]]));
+      empty.histo.group.push_back(std::vector<BatchHisto1D>(grouped ? fngroups : 0,BatchHisto1D(fh_time[fthr[i]])));
+   }
+   if(mkhisto)
+      empty.histo.moments = MomentSums(fNthr,fngroups,fopt.ml_fit_min,fopt.ml_fit_max);
+   for(int i=0; i<fNthr; i++)
+   {
+      if(mkamp)
+         empty.profile.amp.push_back(BatchProfile1D(fp_time_amp[fthr[i]]));
+      if(mkrisetime)
+         empty.profile.risetime.push_back(BatchProfile1D(fp_time_risetime[fthr[i]]));
+      if(mkpos)
+      {
+         TProfile2D* p = fp2_time_x_y[fthr[i]];
+         empty.profile.pos.push_back(BatchProfile2D(p));
+         //same cells as the profile, time bins of the time histogram
+         empty.profile.res.push_back(ResolutionMap2D(p->GetXaxis()->GetNbins(),p->GetXaxis()->GetXmin(),p->GetXaxis()->GetXmax(),
+                                                     p->GetYaxis()->GetNbins(),p->GetYaxis()->GetXmin(),p->GetYaxis()->GetXmax(),
+                                                     kTimeBins,kTimeMin,kTimeMax));
+      }
+   }
+
+   std::function<void(ProductSums&,const EventBatch&)> fill = [&](ProductSums& sums, const EventBatch& batch)
+   {
+      if(mkhisto)
+         sums.histo.moments.Fill(batch);
+      for(int i=0; i<fNthr; i++)
+      {
+         if(mkhisto)
+         {
+            sums.histo.time[i].FillN(batch.size,batch.Time(i));
+            if(grouped)
+               sums.histo.group[i][batch.group].FillN(batch.size,batch.Time(i));
+         }
+         if(mkamp)
+            sums.profile.amp[i].FillN(batch.size,&batch.AMP_MAX[0],batch.Time(i));
+         if(mkrisetime)
+            sums.profile.risetime[i].FillN(batch.size,&batch.risetime[0],batch.Time(i));
+         if(mkpos)
+         {
+            sums.profile.pos[i].FillN(batch.size,&batch.mu_x_hit[0],&batch.mu_y_hit[0],batch.Time(i));
+            sums.profile.res[i].FillN(batch.size,&batch.mu_x_hit[0],&batch.mu_y_hit[0],batch.Time(i));
+         }
+      }
+   };
+
+   //with a target precision, stop as soon as the RMS of every threshold is known well enough
+   std::function<bool(const ProductSums&)> converged;
+   if(mkhisto && fopt.target_precision>0)
+      converged = [&](const ProductSums& sums)
+      {
+         for(int i=0; i<fNthr; i++)
+            if(sums.histo.time[i].GetRMSRelError()>fopt.target_precision)
+               return false;
+         return true;
+      };
+
+   //the time histograms read the times only, each profile adds its variable
+   int columns = kColTimes;
+   if(mkamp)
+      columns |= kColAmp;
+   if(mkrisetime)
+      columns |= kColRiseTime;
+   if(mkpos)
+      columns |= kColPos;
+   ProductSums sums = FillBatches(what,columns,empty,fill,converged);
+   fproducts |= products;
+   if(fopt.verify_reduction)
+      VerifyReduction(what,columns,sums,empty,fill);
+
+   for(int i=0; i<fNthr; i++)
+   {
+      if(mkamp)
+         sums.profile.amp[i].CopyTo(fp_time_amp[fthr[i]]);
+      if(mkrisetime)
+         sums.profile.risetime[i].CopyTo(fp_time_risetime[fthr[i]]);
+      if(mkpos)
+         sums.profile.pos[i].CopyTo(fp2_time_x_y[fthr[i]]);
+   }
+   if(mkpos)
+      fres_x_y = sums.profile.res;
+   if(!mkhisto)
+      return;
+
+   fbh_time_group = sums.histo.group;
+   SetTimeMoments(sums.histo.moments.mom,sums.histo.moments.ngroups);
+   if(fopt.target_precision>0)
+   {
+      float worst = 0;
+      for(int i=0; i<fNthr; i++)
+         worst = max(worst,(float)sums.histo.time[i].GetRMSRelError());
+      if(worst>fopt.target_precision)
+         cout<<"[WARNING]: target precision "<<fopt.target_precision<<" not reached, ";
+      else
+         cout<<">> Target precision "<<fopt.target_precision<<" reached, ";
+      cout<<"RMS relative error "<<worst<<" with "<<GetSampleEntries()<<" of "<<GetEntries()<<" entries"<<endl;
+   }
+
+   for(int i=0; i<fNthr; i++)
+      sums.histo.time[i].CopyTo(fh_time[fthr[i]]);
+
+   //all the thresholds in one histogram, one row each
+   std::vector<double> edges = GetThresholdEdges();
+   delete fh2_time_thr;
+   fh2_time_thr = new TH2F(Form("%s, time vs threshold",fDataLabel.c_str()),Form("%s, time vs threshold",fDataLabel.c_str()),
+                           kTimeBins,kTimeMin,kTimeMax,fNthr,&edges[0]);
+   double entries = 0;
+   for(int i=0; i<fNthr; i++)
+   {
+      for(int b=0; b<=kTimeBins+1; b++)
+         fh2_time_thr->SetBinContent(b,i+1,fh_time[fthr[i]]->GetBinContent(b));
+      entries += fh_time[fthr[i]]->GetEntries();
+   }
+   fh2_time_thr->SetEntries(entries);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::FillTimeMoments()
+{
+   //only when the fit range changed after the time histograms were filled
+   cout<<">> Filling the moments of the unbinned fit"<<endl;
+   MomentSums empty(fNthr,fngroups,fopt.ml_fit_min,fopt.ml_fit_max);
+   std::function<void(MomentSums&,const EventBatch&)> fill = [](MomentSums& sums, const EventBatch& batch)
+   {
+      sums.Fill(batch);
+   };
+   MomentSums sums = FillBatches("unbinned fit moments",kColTimes,empty,fill);
+   SetTimeMoments(sums.mom,sums.ngroups);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::SetTimeMoments(const std::vector<double>& mom, int ngroups)
+{
+   ftime_moments = mom;
+   fmoment_groups = ngroups;
+   fmoment_min = fopt.ml_fit_min;
+   fmoment_max = fopt.ml_fit_max;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+GausFitResult EvAnalyz::UnbinnedFit(int ithr, int skipgroup)
 {
-   cout<<">> Creating time histogram"<<endl;
-   for(int i=0; i<fNthr; i++)
-      fh_time[fthr[i]] = new TH1F(	Form("%s, time distribution, thr = %.0f ph",fDataLabel.c_str(),fthr[i]),
-					Form("%s, time distribution, thr = %.0f ph",fDataLabel.c_str(),fthr[i]),
-					/*150*/200,-0.505,/*0.995*/1.495);
+   //the moments of threshold ithr summed over the groups in order, leaving out skipgroup
+   if(fmoment_groups==0 || fmoment_min!=fopt.ml_fit_min || fmoment_max!=fopt.ml_fit_max)
+      FillTimeMoments();
+   double mom[3] = {0,0,0};
+   for(int g=0; g<fmoment_groups; g++)
+      if(g!=skipgroup)
+         for(int j=0; j<3; j++)
+            mom[j] += ftime_moments[3*(ithr*fmoment_groups+g)+j];
+   UnbinnedGausFitter fitter(fopt.ml_fit_min,fopt.ml_fit_max);
+   fitter.SetMoments(mom,MomentShift(fopt.ml_fit_min,fopt.ml_fit_max));
+   return fitter.Fit();
 }
 
 //---------------------------------------------------------------------------------------------------------------
-void EvAnalyz::FillProfile(bool mkamp, bool mkrisetime, bool mkpos)
+int EvAnalyz::ReadBatch(EventBatch& batch, Long64_t first, Long64_t last)
 {
-   cout<<">> Filling profiles"<<endl;
-   Long64_t nentries = fDataTree->GetEntries();
-   for(Long64_t ientry=0; ientry<nentries; ientry++)
+   //reads the entries [first,last) up to the batch capacity, returns the entries consumed;
+   //the derived columns and the cut are left to EvalDerived
+   if(batch.nthr!=fNthr || batch.nderived!=fNderived)
+      batch.Resize(batch.capacity,fNthr,fNderived);
+   Long64_t n = last-first;
+   if(n>batch.capacity)
+      n = batch.capacity;
+   batch.first = first;
+   batch.size = n;
+   if(fresident)
    {
-      cout<<"\tReading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
+      //rows of the resident sample, times already relative to the offset
+      if(fread_col[0])
+         fresident->Read(0,first,n,&batch.mu_x_hit[0]);
+      if(fread_col[1])
+         fresident->Read(1,first,n,&batch.mu_y_hit[0]);
+      if(fread_col[2])
+         fresident->Read(2,first,n,&batch.AMP_MAX[0]);
+      for(int i=0; i<fNthr; i++)
+         if(fread_col[3+i])
+            fresident->Read(3+i,first,n,batch.Time(i));
+      return n;
+   }
+   if(fSkim)
+   {
+      Long64_t bytes = fSkim->GetBytesRead();
+      if(fread_col[0])
+         fSkim->Read(fskim_col[0],first,n,&batch.mu_x_hit[0]);
+      if(fread_col[1])
+         fSkim->Read(fskim_col[1],first,n,&batch.mu_y_hit[0]);
+      if(fread_col[2])
+         fSkim->Read(fskim_col[2],first,n,&batch.AMP_MAX[0]);
       for(int i=0; i<fNthr; i++)
       {
-         if(mkamp)
-            fp_time_amp[fthr[i]] -> Fill(fAMP_MAX,ftime[fthr[i]]-ftime_offset);
-         if(mkrisetime)
-            fp_time_risetime[fthr[i]] -> Fill(ftime[50]-ftime[20], ftime[fthr[i]]-ftime_offset);
-         if(mkpos)
-            fp2_time_x_y[fthr[i]] -> Fill(fmu_x_hit, fmu_y_hit, ftime[fthr[i]]-ftime_offset);
+         if(!fread_col[3+i])
+            continue;
+         float* time = batch.Time(i);
+         fSkim->Read(fskim_col[3+i],first,n,time);
+         for(int j=0; j<n; j++)
+            time[j] -= ftime_offset;
       }
+      PerfReport::Instance().CountRead(fSkim->GetBytesRead()-bytes);
+      return n;
    }
-   cout<<"\n";
+   //clusters failing the cut are skipped: more entries than rows may be consumed
+   int rows = 0;
+   Long64_t entry = first;
+   Long64_t zoneend = first;
+   while(entry<last && rows<n)
+   {
+      if(!fzone_skip.empty() && entry>=zoneend)
+      {
+         int z = fzones->FindZone(entry,zoneend);
+         if(z>=0 && fzone_skip[z])
+         {
+            entry = min(zoneend,last);
+            continue;
+         }
+      }
+      if(fstager && (entry<fstage_first || entry>=fstage_end))
+         StageFile(entry);
+      ReadEntry(entry);
+      batch.mu_x_hit[rows] = fmu_x_hit;
+      batch.mu_y_hit[rows] = fmu_y_hit;
+      batch.AMP_MAX[rows] = fAMP_MAX;
+      for(int i=0; i<fNthr; i++)
+         batch.Time(i)[rows] = *ftime_addr[i] - ftime_offset;
+      if(fzones && fzones->IsBuilding())
+      {
+         //branch names, as in the files
+         fzone_values.resize(3+fNthr);
+         fzone_values[0] = fmu_y_hit;
+         fzone_values[1] = fmu_x_hit;
+         fzone_values[2] = fAMP_MAX;
+         for(int i=0; i<fNthr; i++)
+            fzone_values[3+i] = *ftime_addr[i];
+         fzones->Fill(entry,fDataTree->GetTree(),&fzone_values[0]);
+      }
+      entry++;
+      rows++;
+   }
+   batch.size = rows;
+   return entry-first;
 }
 
+//---------------------------------------------------------------------------------------------------------------
+Long64_t EvAnalyz::GetEntries()
+{
+   return fSkim ? fSkim->GetEntries() : fDataTree->GetEntries();
+}
 
-//---------------------------------------------------------------------------------------------------------------------
-void EvAnalyz::FillHisto()
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::StageFile(Long64_t entry)
 {
-   cout<<">> Filling time histo"<<endl;;
-   Long64_t nentries = fDataTree->GetEntries();
-   for(Long64_t ientry=0; ientry<nentries; ientry++)
-   {
-      cout<<"\tReading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
-      for(int i=0; i<fNthr; i++)
-          fh_time[fthr[i]]->Fill(ftime[fthr[i]]-ftime_offset);
-   }
-   cout<<"\n";
+   //the chain opens the file named by the title of its element: the local copy when there is one
+   int ifile = findex.FindFile(entry);
+   if(ifile<0)
+      return;
+   const IndexedFile& file = findex.GetFile(ifile);
+   fstage_first = file.offset;
+   fstage_end = file.offset+file.entries;
+   string local = fstager->Acquire(ifile);
+   ((TChainElement*)fDataTree->GetListOfFiles()->At(ifile))->SetTitle(local!="" ? local.c_str() : file.path.c_str());
 }
+
+//---------------------------------------------------------------------------------------------------------------
+Int_t EvAnalyz::ReadEntry(Long64_t ientry)
+{
+   Int_t nbytes = fDataTree->GetEntry(ientry);
+   PerfReport::Instance().CountRead(nbytes);
+   return nbytes;
+}
+
 //---------------------------------------------------------------------------------------------------------------
 void EvAnalyz::DrawProfiles(float time_min, float time_max)
 {
+   Require(kAmpProfile|kRiseTimeProfile|kPosProfile);
+   PerfScope perf("DrawProfiles",fDataLabel);
    cout<<"> Drawing time profiles"<<endl;
 //creating canvas
    fPlots[fDataLabel+", time vs AMP_MAX"] = new TCanvas( Form("%s, time vs AMP_MAX",fDataLabel.c_str()) , Form("%s, time vs AMP_MAX",fDataLabel.c_str()) );
@@ -292,53 +1774,87 @@ void EvAnalyz::DrawProfiles(float time_min, float time_max)
    TLatex title;
    title.SetNDC();
 
+//compact layout: the impact point of a few thresholds only, evenly spaced
+   std::vector<int> drawn;
+   bool compact = IsCompactLayout();
    for(int i=0; i<fNthr; i++)
+      if(!compact || fNthr<=kMaxImpactMaps)
+         drawn.push_back(i);
+   for(int k=0; compact && fNthr>kMaxImpactMaps && k<kMaxImpactMaps; k++)
+      drawn.push_back(k*(fNthr-1)/(kMaxImpactMaps-1));
+
+   for(unsigned k=0; k<drawn.size(); k++)
    {
+      int i = drawn[k];
       fPlots[Form("%s, time vs impact point, thr=%.0f",fDataLabel.c_str(),fthr[i])] = new TCanvas( Form("%s, time vs impact point, thr=%.0f",fDataLabel.c_str(), fthr[i]) , Form("%s, time vs impact point",fDataLabel.c_str()) ,400,400);
    }
 
-//esthetical set
-   for(int i=0; i<fNthr; i++)
+//compact layout: one map per quantity, a row per threshold
+   if(compact)
    {
-      fp_time_amp[fthr[i]]->SetLineColor(i+1);  
-      fp_time_risetime[fthr[i]]->SetLineColor(i+1);  
+      TH2F* map_amp = ThresholdMap(fDataLabel+", time vs AMP_MAX and threshold",fp_time_amp);
+      TH2F* map_risetime = ThresholdMap(fDataLabel+", time vs risetime and threshold",fp_time_risetime);
+      fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
+      map_amp->Draw("COLZ");
+      map_amp->GetZaxis()->SetRangeUser(time_min,time_max);
+      map_amp->GetXaxis()->SetTitle("amp max (ph)");
+      map_amp->GetYaxis()->SetTitle("threshold (ph)");
+      map_amp->GetZaxis()->SetTitle("time (ns)");
+      title.DrawLatex(0.1,0.93,(fDataLabel+", time vs AMP_MAX").c_str());
+      fPlots[fDataLabel+", time vs risetime"]->cd();
+      map_risetime->Draw("COLZ");
+      map_risetime->GetZaxis()->SetRangeUser(time_min,time_max);
+      map_risetime->GetXaxis()->SetTitle("risetime 20-50(ns)");
+      map_risetime->GetYaxis()->SetTitle("threshold (ph)");
+      map_risetime->GetZaxis()->SetTitle("time (ns)");
+      title.DrawLatex(0.1,0.93,(fDataLabel+", time vs risetime").c_str());
    }
+   else
+   {
+//esthetical set
+      for(int i=0; i<fNthr; i++)
+      {
+         fp_time_amp[fthr[i]]->SetLineColor(i+1);  
+         fp_time_risetime[fthr[i]]->SetLineColor(i+1);  
+      }
 
 //draw time vs amp_max & vs risetime
-   fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
-   fp_time_amp[fthr[0]]->Draw("");  
-   leg_time_amp.AddEntry(fp_time_amp[fthr[0]],Form("thr = %.0f ph",fthr[0]),"l");
-   fp_time_amp[fthr[0]]->GetYaxis()->SetRangeUser(time_min,time_max);
-   fp_time_amp[fthr[0]]->GetXaxis()->SetTitle("amp max (ph)"); 
-   fp_time_amp[fthr[0]]->GetYaxis()->SetTitle("time (ns)");  
+      fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
+      fp_time_amp[fthr[0]]->Draw("");  
+      leg_time_amp.AddEntry(fp_time_amp[fthr[0]],Form("thr = %.0f ph",fthr[0]),"l");
+      fp_time_amp[fthr[0]]->GetYaxis()->SetRangeUser(time_min,time_max);
+      fp_time_amp[fthr[0]]->GetXaxis()->SetTitle("amp max (ph)"); 
+      fp_time_amp[fthr[0]]->GetYaxis()->SetTitle("time (ns)");  
  
-   fPlots[fDataLabel+", time vs risetime"]->cd();
-   fp_time_risetime[fthr[0]]->Draw("");  
-   leg_time_risetime.AddEntry(fp_time_risetime[fthr[0]],Form("thr = %.0f ph",fthr[0]),"l");
-   fp_time_risetime[fthr[0]]->GetYaxis()->SetRangeUser(time_min,time_max);
-   fp_time_risetime[fthr[0]]->GetXaxis()->SetTitle("risetime 20-50(ns)"); 
-   fp_time_risetime[fthr[0]]->GetYaxis()->SetTitle("time (ns)"); 
+      fPlots[fDataLabel+", time vs risetime"]->cd();
+      fp_time_risetime[fthr[0]]->Draw("");  
+      leg_time_risetime.AddEntry(fp_time_risetime[fthr[0]],Form("thr = %.0f ph",fthr[0]),"l");
+      fp_time_risetime[fthr[0]]->GetYaxis()->SetRangeUser(time_min,time_max);
+      fp_time_risetime[fthr[0]]->GetXaxis()->SetTitle("risetime 20-50(ns)"); 
+      fp_time_risetime[fthr[0]]->GetYaxis()->SetTitle("time (ns)"); 
 
-   for(int i=1; i<fNthr; i++)
-   {
+      for(int i=1; i<fNthr; i++)
+      {
+         fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
+         fp_time_amp[fthr[i]]->Draw("same"); 
+         leg_time_amp.AddEntry(fp_time_amp[fthr[i]],Form("thr = %.0f ph",fthr[i]),"l");
+         fPlots[fDataLabel+", time vs risetime"]->cd();
+         fp_time_risetime[fthr[i]]->Draw("same"); 
+         leg_time_risetime.AddEntry(fp_time_risetime[fthr[i]],Form("thr = %.0f ph",fthr[i]),"l");
+      } 
       fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
-      fp_time_amp[fthr[i]]->Draw("same"); 
-      leg_time_amp.AddEntry(fp_time_amp[fthr[i]],Form("thr = %.0f ph",fthr[i]),"l");
-      fPlots[fDataLabel+", time vs risetime"]->cd();
-      fp_time_risetime[fthr[i]]->Draw("same"); 
-      leg_time_risetime.AddEntry(fp_time_risetime[fthr[i]],Form("thr = %.0f ph",fthr[i]),"l");
-   } 
-   fPlots[fDataLabel+", time vs AMP_MAX"]->cd();
-   leg_time_amp.Draw();
-   title.DrawLatex(0.1,0.93,(fDataLabel+", time vs AMP_MAX").c_str());
+      leg_time_amp.Draw();
+      title.DrawLatex(0.1,0.93,(fDataLabel+", time vs AMP_MAX").c_str());
 
-   fPlots[fDataLabel+", time vs risetime"]->cd();
-   leg_time_risetime.Draw();
-   title.DrawLatex(0.1,0.93,(fDataLabel+", time vs risetime").c_str());
+      fPlots[fDataLabel+", time vs risetime"]->cd();
+      leg_time_risetime.Draw();
+      title.DrawLatex(0.1,0.93,(fDataLabel+", time vs risetime").c_str());
+   }
 
 //draw time vs impact point
-   for(int i=0; i<fNthr; i++)
+   for(unsigned k=0; k<drawn.size(); k++)
    {
+      int i = drawn[k];
       fPlots[Form("%s, time vs impact point, thr=%.0f",fDataLabel.c_str(),fthr[i])] -> cd();
       fp2_time_x_y[fthr[i]] -> Draw("COLZ");
       fp2_time_x_y[fthr[i]] -> GetZaxis()->SetRangeUser(time_min,time_max);
@@ -369,8 +1885,9 @@ void EvAnalyz::DrawProfiles(float time_min, float time_max)
    plotname.ReplaceAll("pdf","png");
    fPlots[fDataLabel+", time vs risetime"]->Print(plotname.Data());
 
-   for(int i=0; i<fNthr; i++)
+   for(unsigned k=0; k<drawn.size(); k++)
    {
+      int i = drawn[k];
       plotname = Form("%s, time vs impact point, thr=%.0f",fDataLabel.c_str(),fthr[i]);
       plotname.ReplaceAll(" ","_");
       plotname.ReplaceAll("=","");
@@ -382,17 +1899,66 @@ void EvAnalyz::DrawProfiles(float time_min, float time_max)
       fPlots[Form("%s, time vs impact point, thr=%.0f",fDataLabel.c_str(),fthr[i])]->Print(plotname.Data());
    }
 
+//draw and print the time resolution vs impact point, same thresholds
+   for(unsigned k=0; k<drawn.size(); k++)
+   {
+      int i = drawn[k];
+      TH2F* res = ResolutionMap(fthr[i],"width68");
+      if(!res)
+         continue;
+      string name = Form("%s, time resolution vs impact point, thr=%.0f",fDataLabel.c_str(),fthr[i]);
+      fPlots[name] = new TCanvas(name.c_str(),name.c_str(),400,400);
+      res->Draw("COLZ");
+      res->GetXaxis()->SetTitle("x (mm)");
+      res->GetYaxis()->SetTitle("y (mm)");
+      res->GetZaxis()->SetTitle("68% half width (ns)");
+      title.DrawLatex(0.1,0.93,Form("%s, time resolution vs impact point, thr = %.0f",fDataLabel.c_str(),fthr[i]));
+      plotname = name;
+      plotname.ReplaceAll(" ","_");
+      plotname.ReplaceAll("=","");
+      plotname.ReplaceAll(",","_");
+      plotname.ReplaceAll(".","p");
+      plotname+= ".pdf";
+      fPlots[name]->Print(plotname.Data());
+      plotname.ReplaceAll("pdf","png");
+      fPlots[name]->Print(plotname.Data());
+   }
+
 }
 
 
 //---------------------------------------------------------------------------------------------------------------
 void EvAnalyz::DrawHistos()
 {
+   Require(kTimeHisto);
+   PerfScope perf("DrawHistos",fDataLabel);
    cout<<"> Drawing time histos"<<endl;
 
 //creating title object
    TLatex title;
    title.SetNDC();
+
+//compact layout: a single time vs threshold map
+   if(IsCompactLayout())
+   {
+      string name = fDataLabel+", time vs threshold";
+      fPlots[name] = new TCanvas(name.c_str(),name.c_str());
+      fh2_time_thr->Draw("COLZ");
+      fh2_time_thr->GetXaxis()->SetTitle("time (ns)");
+      fh2_time_thr->GetYaxis()->SetTitle("threshold (ph)");
+      title.DrawLatex(0.1,0.93,name.c_str());
+      TString plotname = name;
+      plotname.ReplaceAll(" ","_");
+      plotname.ReplaceAll("=","");
+      plotname.ReplaceAll(",","_");
+      plotname.ReplaceAll(".","p");
+      plotname+= ".pdf";
+      fPlots[name]->Print(plotname.Data());
+      plotname.ReplaceAll("pdf","png");
+      fPlots[name]->Print(plotname.Data());
+      return;
+   }
+
    //creating canvas
    for(int i=0; i<fNthr; i++)
    {
@@ -436,17 +2002,23 @@ void EvAnalyz::DrawHistos()
 //---------------------------------------------------------------------------------------------------------------
 EvAnalyz EvAnalyz::AmpCorrection()
 {
+   Require(kAmpProfile);
+   PerfScope perf("AmpCorrection",fDataLabel);
    cout<<"> Amplitude walk correction"<<endl;
-   std::map<int,TF1*> fitamw;
+   //one function per threshold, owned here: Fit keeps its own copy in the profile
+   std::vector<std::unique_ptr<TF1> > owned(fNthr);
+   std::map<float,TF1*> fitamw;
    for(int i=0;i<fNthr;i++)
    {
-      fitamw[fthr[i]] = new TF1(Form("amplitude walk correction, thr = %.0f",fthr[i]),"[2]+[0]*exp(-[1]*x)",famp_min,famp_max);
+      owned[i].reset(new TF1(Form("amplitude walk correction, thr = %.0f",fthr[i]),"[2]+[0]*exp(-[1]*x)",famp_min,famp_max));
+      fitamw[fthr[i]] = owned[i].get();
       fitamw[fthr[i]]->SetLineWidth(1);
       fitamw[fthr[i]]->SetLineColor(1);
    }
    fitamw[fthr[fNthr-1]]->SetParameters(0.01,0.0006,1.);
    for(int i=fNthr-1;i>-1;i--)
    {
+      PerfScope perffit(Form("Fit thr=%.0f",fthr[i]),fDataLabel);
       fp_time_amp[fthr[i]]->Fit(fitamw[fthr[i]],"R");
       if(i>=1)
       {
@@ -456,61 +2028,45 @@ EvAnalyz EvAnalyz::AmpCorrection()
       }
    }
 
-   //branch the new tree
-   cout<<">> Branching new tree"<<endl;
-   float mu_y_hit, mu_x_hit, AMP_MAX;
-   std::map<float,float> time;
-   TFile outfile(("/tmp/"+fDataLabel+"_amw.root").c_str(),"RECREATE");
-   TTree *outtree=new TTree("digi",(fDataLabel+" amplitude walk corrected").c_str());
-   //outtree->Branch("eventNb",&eventNb,"eventNb/I");
-   outtree->Branch("mu_x_hit",&mu_x_hit,"mu_x_hit/F");
-   outtree->Branch("mu_y_hit",&mu_y_hit,"mu_y_hit/F");
-   outtree->Branch("AMP_MAX",&AMP_MAX,"AMP_MAX/F");
-   for(int i=0; i<fNthr; i++)
-      outtree->Branch( Form("LDE%.0f",fthr[i]) , &time[fthr[i]] , Form("LDE%.0f/F",fthr[i]) );
-
-   
-   //amplitude correction 
-   cout<<">> Filling new tree"<<endl;
-   Long64_t nentries = fDataTree->GetEntries();
-   for (Long64_t ientry=0;ientry<nentries;ientry++)
-   {
-      cout<<"Reading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
-      mu_x_hit = fmu_x_hit;
-      mu_y_hit = fmu_y_hit;         
-      AMP_MAX = fAMP_MAX;
+   //amplitude correction, [2]+[0]*exp(-[1]*x) evaluated from the fitted parameters:
+   //TF1::Eval cannot be called from several threads
+   std::vector<double> par(3*fNthr);
+   for(int i=0;i<fNthr;i++)
+      for(int k=0;k<3;k++)
+         par[3*i+k] = fitamw[fthr[i]]->GetParameter(k);
+   return ApplyCorrection("_amw","amplitude walk corrected",[&](EventBatch& batch)
+   {
       for(int i=0;i<fNthr;i++)
-         time[fthr[i]] = ftime[fthr[i]] - ftime_offset - fitamw[fthr[i]]->Eval(AMP_MAX);
-
-      outtree->Fill();//Fill the output ntuple
-   }
-   outtree->Write();
-   outfile.Close();
-   TChain* outchain = new TChain("digi","digi amplitude walk corrected");
-   outchain->Add(("/tmp/"+fDataLabel+"_amw.root").c_str());
-   //create the new EvAnalyz
-   cout<<">> Creating "<<fDataLabel<<"_amw"<<endl;
-   EvAnalyz data_amw(outchain, fNthr, fthr, fDataLabel+"_amw", famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/);
-   return data_amw;
-
+      {
+         float* time = batch.Time(i);
+         const double* p = &par[3*i];
+         for(int j=0; j<batch.size; j++)
+            time[j] -= p[2]+p[0]*exp(-p[1]*batch.AMP_MAX[j]);
+      }
+   });
 }
 
 
 //---------------------------------------------------------------------------------------------------------------
 EvAnalyz EvAnalyz::MitigatedAmpCorrection(float amp_min_fit, float amp_max_fit)
 {
+   Require(kAmpProfile);
+   PerfScope perf("MitigatedAmpCorrection",fDataLabel);
    cout<<"> Mitigated amplitude walk correction"<<endl;
-   std::map<int,TF1*> fitamw;
+   //one function per threshold, owned here: Fit keeps its own copy in the profile
+   std::vector<std::unique_ptr<TF1> > owned(fNthr);
+   std::map<float,TF1*> fitamw;
    for(int i=0;i<fNthr;i++)
    {
-      fitamw[fthr[i]] = new TF1(Form("mitigated amplitude walk correction, thr = %.0f",fthr[i]),"[0] + [1]*log([2]*x)",amp_min_fit,amp_max_fit);
+      owned[i].reset(new TF1(Form("mitigated amplitude walk correction, thr = %.0f",fthr[i]),"[0] + [1]*log([2]*x)",amp_min_fit,amp_max_fit));
+      fitamw[fthr[i]] = owned[i].get();
       fitamw[fthr[i]]->SetLineWidth(1);
       fitamw[fthr[i]]->SetLineColor(1);
    }
    fitamw[fthr[fNthr-1]]->SetParameters(10.4,-0.3,0.00013);
    for(int i=fNthr-1;i>-1;i--)
    {
+      PerfScope perffit(Form("Fit thr=%.0f",fthr[i]),fDataLabel);
       fp_time_amp[fthr[i]]->Fit(fitamw[fthr[i]],"R");
       if(i>=1)
       {
@@ -520,145 +2076,344 @@ EvAnalyz EvAnalyz::MitigatedAmpCorrection(float amp_min_fit, float amp_max_fit)
       }
    }
 
-   //branch the new tree
-   cout<<">> Branching new tree"<<endl;
-   float mu_y_hit, mu_x_hit, AMP_MAX;
-   std::map<float,float> time;
-   TFile outfile(("/tmp/"+fDataLabel+"_mitigatedamw.root").c_str(),"RECREATE");
-   TTree *outtree=new TTree("digi",(fDataLabel+" mitigated amplitude walk corrected").c_str());
-   //outtree->Branch("eventNb",&eventNb,"eventNb/I");
-   outtree->Branch("mu_x_hit",&mu_x_hit,"mu_x_hit/F");
-   outtree->Branch("mu_y_hit",&mu_y_hit,"mu_y_hit/F");
-   outtree->Branch("AMP_MAX",&AMP_MAX,"AMP_MAX/F");
-   for(int i=0; i<fNthr; i++)
-      outtree->Branch( Form("LDE%.0f",fthr[i]) , &time[fthr[i]] , Form("LDE%.0f/F",fthr[i]) );
+   //amplitude correction, [0] + [1]*log([2]*x) evaluated from the fitted parameters
+   std::vector<double> par(3*fNthr);
+   for(int i=0;i<fNthr;i++)
+      for(int k=0;k<3;k++)
+         par[3*i+k] = fitamw[fthr[i]]->GetParameter(k);
+   return ApplyCorrection("_mitigatedamw","mitigated amplitude walk corrected",[&](EventBatch& batch)
+   {
+      for(int i=0;i<fNthr;i++)
+      {
+         float* time = batch.Time(i);
+         const double* p = &par[3*i];
+         for(int j=0; j<batch.size; j++)
+            time[j] -= p[0]+p[1]*log(p[2]*batch.AMP_MAX[j]);
+      }
+   });
+}
 
-   
-   //amplitude correction 
-   cout<<">> Filling new tree"<<endl;
-   Long64_t nentries = fDataTree->GetEntries();
-   for (Long64_t ientry=0;ientry<nentries;ientry++)
-   {
-      cout<<"Reading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
-      mu_x_hit = fmu_x_hit;
-      mu_y_hit = fmu_y_hit;         
-      AMP_MAX = fAMP_MAX;
+
+//---------------------------------------------------------------------------------------------------------------------------
+EvAnalyz EvAnalyz::PosCorrection()
+{
+   Require(kPosProfile);
+   PerfScope perf("PosCorrection",fDataLabel);
+   cout<<"> Position correction"<<endl;
+
+   //position correction, the profiles looked up once and not per event
+   std::vector<TProfile2D*> profiles(fNthr);
+   for(int i=0;i<fNthr;i++)
+      profiles[i] = fp2_time_x_y[fthr[i]];
+   return ApplyCorrection("_poscorr","impact point corrected",[&](EventBatch& batch)
+   {
       for(int i=0;i<fNthr;i++)
-         time[fthr[i]] = ftime[fthr[i]] - ftime_offset - fitamw[fthr[i]]->Eval(AMP_MAX);
+      {
+         float* time = batch.Time(i);
+         TProfile2D* p = profiles[i];
+         for(int j=0; j<batch.size; j++)
+            time[j] -= p->GetBinContent(GetBinNumber2d(p,batch.mu_x_hit[j],batch.mu_y_hit[j]));
+      }
+   });
+}
 
-      outtree->Fill();//Fill the output ntuple
-   }
-   outtree->Write();
-   outfile.Close();
-   TChain* outchain = new TChain("digi","digi mitigated amplitude walk corrected");
-   outchain->Add(("/tmp/"+fDataLabel+"_mitigatedamw.root").c_str());
-   //create the new EvAnalyz
-   cout<<">> Creating "<<fDataLabel<<"_mitigatedamw"<<endl;
-   EvAnalyz data_amw(outchain, fNthr, fthr, fDataLabel+"_mitigatedamw", famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/);
-   return data_amw;
+EvAnalyz EvAnalyz::RiseTimeCorrection()
+{
+   Require(kRiseTimeProfile);
+   PerfScope perf("RiseTimeCorrection",fDataLabel);
+   cout<<"> Risetime correction"<<endl;
 
+   //risetime correction 
+   std::vector<TProfile*> profiles(fNthr);
+   for(int i=0;i<fNthr;i++)
+      profiles[i] = fp_time_risetime[fthr[i]];
+   return ApplyCorrection("_risetimecorr","risetime corrected",[&](EventBatch& batch)
+   {
+      for(int i=0;i<fNthr;i++)
+      {
+         float* time = batch.Time(i);
+         TProfile* p = profiles[i];
+         for(int j=0; j<batch.size; j++)
+            time[j] -= p->GetBinContent(GetBinNumber(p,batch.risetime[j]));
+      }
+   });
 }
 
 
 //---------------------------------------------------------------------------------------------------------------------------
-EvAnalyz EvAnalyz::PosCorrection()
+EvAnalyz EvAnalyz::JointCorrection()
 {
-   cout<<"> Position correction"<<endl;
+   PerfScope perf("JointCorrection",fDataLabel);
+   cout<<"> Joint amplitude walk and impact point correction"<<endl;
 
-   //branch the new tree
-   cout<<">> Branching new tree"<<endl;
-   float mu_y_hit, mu_x_hit, AMP_MAX;
-   std::map<float,float> time;
-   TFile outfile(("/tmp/"+fDataLabel+"_poscorr.root").c_str(),"RECREATE");
-   TTree *outtree=new TTree("digi",(fDataLabel+" impact point correction").c_str());
-   //outtree->Branch("eventNb",&eventNb,"eventNb/I");
-   outtree->Branch("mu_x_hit",&mu_x_hit,"mu_x_hit/F");
-   outtree->Branch("mu_y_hit",&mu_y_hit,"mu_y_hit/F");
-   outtree->Branch("AMP_MAX",&AMP_MAX,"AMP_MAX/F");
+   //first pass: time vs (AMP_MAX, x, y), only the populated cells are stored
+   cout<<">> Filling time map"<<endl;
+   JointSums empty;
+   for(int i=0; i<fNthr; i++)
+      empty.time.push_back(SparseProfile3D(fopt.joint_amp_bins,famp_min,famp_max,22,-6.,6.,22,-6.,6.));
+   std::function<void(JointSums&,const EventBatch&)> fill = [&](JointSums& sums, const EventBatch& batch)
+   {
+      for(int i=0; i<fNthr; i++)
+         sums.time[i].FillN(batch.size,&batch.AMP_MAX[0],&batch.mu_x_hit[0],&batch.mu_y_hit[0],batch.Time(i));
+   };
+   JointSums map = FillBatches("joint map",kColPos|kColAmp|kColTimes,empty,fill);
+   if(fopt.verify_reduction)
+      VerifyReduction("time maps",kColPos|kColAmp|kColTimes,map,empty,fill);
    for(int i=0; i<fNthr; i++)
-      outtree->Branch( Form("LDE%.0f",fthr[i]) , &time[fthr[i]] , Form("LDE%.0f/F",fthr[i]) );
-
-   //position correction 
-   cout<<">> Filling new tree"<<endl;
-   Long64_t nentries = fDataTree->GetEntries();
-   for (Long64_t ientry=0;ientry<nentries;ientry++)
-   {
-      cout<<"Reading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
-      mu_x_hit = fmu_x_hit;
-      mu_y_hit = fmu_y_hit;         
-      AMP_MAX = fAMP_MAX;
+   {
+      map.time[i].Smooth();
+      cout<<">> thr = "<<fthr[i]<<": "<<map.time[i].GetNCells()<<" populated cells"<<endl;
+   }
+
+   //second pass: subtract the smoothed map
+   return ApplyCorrection("_jointcorr","amplitude walk and impact point corrected",[&](EventBatch& batch)
+   {
+      std::vector<float>& corr = batch.work;
+      corr.resize(batch.size);
       for(int i=0;i<fNthr;i++)
-         time[fthr[i]] = ftime[fthr[i]] - ftime_offset - fp2_time_x_y[fthr[i]]->GetBinContent(GetBinNumber2d(fp2_time_x_y[fthr[i]],fmu_x_hit,fmu_y_hit));
+      {
+         float* time = batch.Time(i);
+         map.time[i].Eval(batch.size,&batch.AMP_MAX[0],&batch.mu_x_hit[0],&batch.mu_y_hit[0],corr.data(),batch.bins);
+         for(int j=0; j<batch.size; j++)
+            time[j] -= corr[j];
+      }
+   });
+}
+
 
-      outtree->Fill();//Fill the output ntuple
+//---------------------------------------------------------------------------------------------------------------------------
+EvAnalyz EvAnalyz::ApplyCorrection(const std::string& suffix, const std::string& title, const std::function<void(EventBatch&)>& correct)
+{
+   //correct runs on the kernel threads of the pipeline, the output is written in read order.
+   //the corrected times are stored with the offset already subtracted, the new dataset has ftime_offset=0
+   string label = fDataLabel+suffix;
+   string filename = "/tmp/"+label+(fopt.skim ? ".skim" : ".root");
+   cout<<">> Filling new "<<(fopt.skim ? "skim" : "tree")<<endl;
+
+   //tree output
+   float mu_y_hit, mu_x_hit, AMP_MAX;
+   std::vector<float> time(fNthr);
+   TFile* outfile = 0;
+   TTree* outtree = 0;
+   //skim output
+   SkimWriter* skim = 0;
+   std::vector<const float*> columns(3+fNthr);
+   if(fopt.skim)
+      skim = new SkimWriter(filename,SkimColumns(0.));
+   else
+   {
+      outfile = new TFile(filename.c_str(),"RECREATE");
+      outtree = new TTree("digi",(fDataLabel+" "+title).c_str());
+      outtree->Branch("mu_x_hit",&mu_x_hit,"mu_x_hit/F");
+      outtree->Branch("mu_y_hit",&mu_y_hit,"mu_y_hit/F");
+      outtree->Branch("AMP_MAX",&AMP_MAX,"AMP_MAX/F");
+      for(int i=0; i<fNthr; i++)
+         outtree->Branch( Form("LDE%.0f",fthr[i]) , &time[i] , Form("LDE%.0f/F",fthr[i]) );
    }
-   outtree->Write();
-   outfile.Close();
-   TChain* outchain = new TChain("digi","digi impact point corrected");
-   outchain->Add(("/tmp/"+fDataLabel+"_poscorr.root").c_str());
+
+   //only the sampled entries passing the cut are written, the new dataset keeps their
+   //jackknife groups and does not apply the cut again
+   EvAnalyzOptions opt = fopt;
+   opt.cut = "";
+   Long64_t nout = 0;
+   ForEachBatch(kColAll,[&](EventBatch& batch)
+   {
+      if(opt.preview_sample.empty() || opt.preview_sample.back().group!=batch.group)
+         opt.preview_sample.push_back(EntryRange(nout,nout,batch.group));
+      opt.preview_sample.back().last += batch.size;
+      nout += batch.size;
+      if(skim)
+      {
+         columns[0] = &batch.mu_x_hit[0];
+         columns[1] = &batch.mu_y_hit[0];
+         columns[2] = &batch.AMP_MAX[0];
+         for(int i=0; i<fNthr; i++)
+            columns[3+i] = batch.Time(i);
+         skim->Fill(batch.size,&columns[0]);
+         return;
+      }
+      for(int j=0; j<batch.size; j++)
+      {
+         mu_x_hit = batch.mu_x_hit[j];
+         mu_y_hit = batch.mu_y_hit[j];
+         AMP_MAX = batch.AMP_MAX[j];
+         for(int i=0;i<fNthr;i++)
+            time[i] = batch.Time(i)[j];
+         outtree->Fill();//Fill the output ntuple
+      }
+   },true,correct);
+
    //create the new EvAnalyz
-   cout<<">> Creating "<<fDataLabel<<"_poscorr"<<endl;
-   EvAnalyz data_poscorr(outchain, fNthr, fthr, fDataLabel+"_poscorr", famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/);
-   return data_poscorr;
+   cout<<">> Creating "<<label<<endl;
+   if(skim)
+   {
+      skim->Close();
+      delete skim;
+      return EvAnalyz(new SkimReader(filename), fNthr, fthr, label, famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/, opt);
+   }
+   outtree->Write();
+   outfile->Close();
+   delete outfile;
+   TChain* outchain = new TChain("digi",("digi "+title).c_str());
+   outchain->Add(filename.c_str());
+   return EvAnalyz(outchain, fNthr, fthr, label, famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/, opt);
+}
+
 
+//---------------------------------------------------------------------------------------------------------------------------
+std::vector<SkimColumn> EvAnalyz::SkimColumns(float time_offset) const
+{
+   //same column names as the trees, times relative to the time offset
+   std::vector<SkimColumn> columns;
+   columns.push_back(SkimColumn("mu_x_hit",fopt.skim_pos_lsb));
+   columns.push_back(SkimColumn("mu_y_hit",fopt.skim_pos_lsb));
+   columns.push_back(SkimColumn("AMP_MAX",fopt.skim_amp_lsb));
+   for(int i=0; i<fNthr; i++)
+      columns.push_back(SkimColumn(Form("LDE%.0f",fthr[i]),fopt.skim_time_lsb,time_offset));
+   return columns;
 }
 
-EvAnalyz EvAnalyz::RiseTimeCorrection()
+
+//---------------------------------------------------------------------------------------------------------------------------
+void EvAnalyz::WriteSkim(const std::string& filename)
 {
-   cout<<"> Risetime correction"<<endl;
+   PerfScope perf("WriteSkim",fDataLabel);
+   cout<<"> Writing skim of "<<fDataLabel<<endl;
+   SkimWriter skim(filename,SkimColumns(ftime_offset));
+   std::vector<const float*> columns(3+fNthr);
+   ForEachBatch(kColPos|kColAmp|kColTimes,[&](EventBatch& batch)
+   {
+      //back to the raw times, the skim stores them relative to ftime_offset
+      for(int i=0; i<fNthr; i++)
+      {
+         float* time = batch.Time(i);
+         for(int j=0; j<batch.size; j++)
+            time[j] += ftime_offset;
+         columns[3+i] = time;
+      }
+      columns[0] = &batch.mu_x_hit[0];
+      columns[1] = &batch.mu_y_hit[0];
+      columns[2] = &batch.AMP_MAX[0];
+      skim.Fill(batch.size,&columns[0]);
+   },false);
+   skim.Close();
+}
 
-   //branch the new tree
-   cout<<">> Branching new tree"<<endl;
-   float mu_y_hit, mu_x_hit, AMP_MAX;
-   std::map<float,float> time;
-   TFile outfile(("/tmp/"+fDataLabel+"_risetimecorr.root").c_str(),"RECREATE");
-   TTree *outtree=new TTree("digi",(fDataLabel+" risetime correction").c_str());
-   //outtree->Branch("eventNb",&eventNb,"eventNb/I");
-   outtree->Branch("mu_x_hit",&mu_x_hit,"mu_x_hit/F");
-   outtree->Branch("mu_y_hit",&mu_y_hit,"mu_y_hit/F");
-   outtree->Branch("AMP_MAX",&AMP_MAX,"AMP_MAX/F");
+
+//---------------------------------------------------------------------------------------------------------------------------
+void EvAnalyz::MakeResident()
+{
+   //the sampled entries passing the cut, in read order and within the memory budget: the
+   //following passes read them instead of the chain, with the cut already applied
+   if(fresident)
+      return;
+   PerfScope perf("MakeResident",fDataLabel);
+   cout<<"> Keeping "<<fDataLabel<<" resident"<<endl;
+   ColumnStore* store = new ColumnStore(3+fNthr,(Long64_t)(fopt.memory_budget*1024*1024),fopt.scratch_dir);
+   std::vector<const float*> columns(3+fNthr);
+   std::vector<EntryRange> sample;
+   Long64_t nrows = 0;
+   ForEachBatch(kColPos|kColAmp|kColTimes,[&](EventBatch& batch)
+   {
+      columns[0] = &batch.mu_x_hit[0];
+      columns[1] = &batch.mu_y_hit[0];
+      columns[2] = &batch.AMP_MAX[0];
+      for(int i=0; i<fNthr; i++)
+         columns[3+i] = batch.Time(i);
+      store->Append(batch.size,&columns[0]);
+      if(sample.empty() || sample.back().group!=batch.group)
+         sample.push_back(EntryRange(nrows,nrows,batch.group));
+      sample.back().last += batch.size;
+      nrows += batch.size;
+   },false);
+   store->Close();
+   fresident = store;
+   fsample = sample;
+   fopt.cut = "";
+   CompileDerived();
+   cout<<">> "<<nrows<<" entries resident"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------------------
+void EvAnalyz::ExportArrow(const std::string& filename, int chunksize)
+{
+   //the sampled entries passing the cut, every column and derived column as the expressions
+   //see it (times relative to the time offset), one record batch every chunksize entries
+   PerfScope perf("ExportArrow",fDataLabel);
+   cout<<"> Exporting "<<fDataLabel<<" to "<<filename<<endl;
+   ArrowWriter arrow(filename,fcolumns,chunksize);
+   std::vector<const float*> columns(fcolumns.size());
+   ForEachBatch(kColAll|kColDerived,[&](EventBatch& batch)
+   {
+      for(unsigned c=0; c<columns.size(); c++)
+         columns[c] = GetColumn(batch,c);
+      arrow.Fill(batch.size,&columns[0]);
+   },false);
+   arrow.Close();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------------------
+std::vector<std::string> EvAnalyz::GetColumnNames() const
+{
+   std::vector<std::string> names;
+   names.push_back("mu_x_hit");
+   names.push_back("mu_y_hit");
+   names.push_back("AMP_MAX");
+   names.push_back("risetime");
    for(int i=0; i<fNthr; i++)
-      outtree->Branch( Form("LDE%.0f",fthr[i]) , &time[fthr[i]] , Form("LDE%.0f/F",fthr[i]) );
+      names.push_back(Form("LDE%.0f",fthr[i]));
+   for(unsigned k=0; k<fopt.derived.size(); k++)
+      names.push_back(fopt.derived[k].first);
+   return names;
+}
 
-   //risetime correction 
-   cout<<">> Filling new tree"<<endl;
-   Long64_t nentries = fDataTree->GetEntries();
-   for (Long64_t ientry=0;ientry<nentries;ientry++)
-   {
-      cout<<"Reading entry "<<ientry<< "\r" << std::flush;
-      fDataTree->GetEntry(ientry);
-      mu_x_hit = fmu_x_hit;
-      mu_y_hit = fmu_y_hit;         
-      AMP_MAX = fAMP_MAX;
-      for(int i=0;i<fNthr;i++)
-         time[fthr[i]] = ftime[fthr[i]] - ftime_offset - fp_time_risetime[fthr[i]]->GetBinContent(GetBinNumber(fp_time_risetime[fthr[i]],ftime[50]-ftime[20]));
 
-      outtree->Fill();//Fill the output ntuple
+//---------------------------------------------------------------------------------------------------------------------------
+bool EvAnalyz::CheckCut(const std::string& cut, std::string& error) const
+{
+   //an expression of the columns of this dataset, or empty
+   if(!cut.empty())
+   {
+      std::vector<std::string> names = GetColumnNames();
+      try
+      {
+         Formula formula(cut);
+         for(unsigned v=0; v<formula.GetVariables().size(); v++)
+            if(std::find(names.begin(),names.end(),formula.GetVariables()[v])==names.end())
+            {
+               error = "unknown variable "+formula.GetVariables()[v];
+               return false;
+            }
+      }
+      catch(Formula::parse_error& e)
+      {
+         error = e.msg;
+         return false;
+      }
    }
-   outtree->Write();
-   outfile.Close();
-   TChain* outchain = new TChain("digi","digi risetime corrected");
-   outchain->Add(("/tmp/"+fDataLabel+"_risetimecorr.root").c_str());
-   //create the new EvAnalyz
-   cout<<">> Creating "<<fDataLabel<<"_risetimecorr"<<endl;
-   EvAnalyz data_risetimecorr(outchain, fNthr, fthr, fDataLabel+"_risetimecorr", famp_min, famp_max, frisetime_min, frisetime_max, 0./*ftime_offset=0*/);
-   return data_risetimecorr;
+   return true;
+}
 
+bool EvAnalyz::SetCut(const std::string& cut, std::string& error)
+{
+   //new selection of the following passes (on top of the one applied when made resident):
+   //histograms and profiles are filled again when requested, a bad expression leaves everything untouched
+   if(!CheckCut(cut,error))
+      return false;
+   fopt.cut = cut;
+   CompileDerived();
+   fmoment_groups = 0;
+   Invalidate(kAllProducts);
+   return true;
 }
 
 void EvAnalyz::SetAmpRange(float amp_min,float amp_max)
 {
    famp_min=amp_min;
    famp_max=amp_max;
-   cout<<"> Updating time vs amp profile"<<endl;
-   for(int i=0; i<fNthr; i++)
-   {
-      delete fp_time_amp[fthr[i]];
-   }
-   CreateProfile(true,false,false);
-   FillProfile(true,false,false);
+   Invalidate(kAmpProfile);
 }
 
 
@@ -666,16 +2421,12 @@ void EvAnalyz::SetRiseTimeRange(float risetime_min,float risetime_max)
 {
    frisetime_min=risetime_min;
    frisetime_max=risetime_max;
-   cout<<"> Updating time vs risetime profile"<<endl;
-   for(int i=0; i<fNthr; i++)
-      delete fp_time_risetime[fthr[i]];
-
-   CreateProfile(false,true,false);
-   FillProfile(false,true,false);
+   Invalidate(kRiseTimeProfile);
 }
 
 TGraphErrors* EvAnalyz::ThrScan(std::string option)
 {
+   Require(kTimeHisto);
 
    TGraphErrors* res_thr = new TGraphErrors();
    res_thr->SetName((fDataLabel+"_res_thr").c_str());
@@ -697,6 +2448,7 @@ TGraphErrors* EvAnalyz::ThrScan(std::string option)
          {
             fitfunc->SetParameter(1,fh_time[fthr[i]]->GetMean());
             fitfunc->SetParameter(2,fh_time[fthr[i]]->GetRMS());
+            PerfScope perffit(Form("Fit thr=%.0f",fthr[i]),fDataLabel);
             fh_time[fthr[i]]->Fit(fitfunc);
             res_thr->SetPoint(i,fthr[i],fitfunc->GetParameter(2));
             res_thr->SetPointError(i,0.,fitfunc->GetParError(2));
@@ -704,7 +2456,10 @@ TGraphErrors* EvAnalyz::ThrScan(std::string option)
          else
             if(option=="SMALLESTINTERVAL" || option=="smallestinterval" || option=="SmallestInterval")
             {
-               FindSmallestInterval(vals,fh_time[fthr[i]],0.68,true); 
+               {
+                  PerfScope perfsi(Form("FindSmallestInterval thr=%.0f",fthr[i]),fDataLabel);
+                  FindSmallestInterval(vals,fh_time[fthr[i]],0.68,true);
+               }
                min = vals[2];
                max = vals[3];
                SmallInt = 0.5*(max-min);
@@ -712,16 +2467,175 @@ TGraphErrors* EvAnalyz::ThrScan(std::string option)
                res_thr->SetPointError(i,0.,fh_time[fthr[i]]->GetRMSError());
             }
             else
-            {
-               cout<<"[ERROR]: Option "<<option<<" not valid"<<endl;
-               break;
-            } 
+               if(option=="UNBINNED" || option=="unbinned" || option=="Unbinned")
+               {
+                  PerfScope perffit(Form("UnbinnedFit thr=%.0f",fthr[i]),fDataLabel);
+                  GausFitResult fitres = UnbinnedFit(i,fjackknife ? fjackknife_group : -1);
+                  if(!fitres.converged)
+                     cerr<<"[WARNING]: unbinned fit not converged for thr = "<<fthr[i]<<endl;
+                  res_thr->SetPoint(i,fthr[i],fitres.sigma);
+                  res_thr->SetPointError(i,0.,fitres.sigma_err);
+               }
+               else
+               {
+                  cout<<"[ERROR]: Option "<<option<<" not valid"<<endl;
+                  break;
+               } 
    }
    if(vals) delete[] vals;
+   if(fngroups>1 && !fjackknife && res_thr->GetN()==fNthr)
+      JackknifeErrors(option,res_thr);
    return res_thr;   
 }
 
 
+//---------------------------------------------------------------------------------------------------------------
+void EvAnalyz::JackknifeErrors(const std::string& option, TGraphErrors* res_thr)
+{
+   //repeats the scan leaving out one group of strata at a time, the spread of the
+   //replicas gives the error of the preview including the sampling of the files
+   cout<<"> Jackknife errors over "<<fngroups<<" groups"<<endl;
+   std::map<float,TH1F*> full_h_time = fh_time;
+   std::vector<std::vector<double> > replicas(fNthr);
+
+   fjackknife = true;
+   for(int g=0; g<fngroups; g++)
+   {
+      for(int i=0; i<fNthr; i++)
+      {
+         TH1F* h = new TH1F(*full_h_time[fthr[i]]);
+         h->SetName(Form("%s, jackknife %d, thr = %.0f ph",fDataLabel.c_str(),g,fthr[i]));
+         BatchHisto1D sum(h);
+         for(int k=0; k<fngroups; k++)
+            if(k!=g)
+               sum.Merge(fbh_time_group[i][k]);
+         sum.CopyTo(h);
+         fh_time[fthr[i]] = h;
+      }
+      fjackknife_group = g;
+      TGraphErrors* replica = ThrScan(option);
+      for(int i=0; i<fNthr; i++)
+      {
+         replicas[i].push_back(replica->GetY()[i]);
+         delete fh_time[fthr[i]];
+      }
+      delete replica;
+   }
+   fjackknife = false;
+   fh_time = full_h_time;
+
+   for(int i=0; i<fNthr; i++)
+   {
+      double mean = 0, var = 0;
+      for(int g=0; g<fngroups; g++)
+         mean += replicas[i][g]/fngroups;
+      for(int g=0; g<fngroups; g++)
+         var += (replicas[i][g]-mean)*(replicas[i][g]-mean);
+      var *= (fngroups-1.)/fngroups;
+      res_thr->SetPointError(i,0.,sqrt(var));
+      cout<<">> thr = "<<fthr[i]<<": "<<res_thr->GetY()[i]<<" +- "<<sqrt(var)<<" (jackknife)"<<endl;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+// solves a*x = b in place for a symmetric positive definite n x n matrix (Cholesky),
+// false if it is not positive definite
+static bool SolvePositiveDefinite(std::vector<double>& a, std::vector<double>& b, int n)
+{
+   for(int j=0; j<n; j++)
+   {
+      double d = a[j*n+j];
+      for(int k=0; k<j; k++)
+         d -= a[j*n+k]*a[j*n+k];
+      if(!(d>0))
+         return false;
+      a[j*n+j] = sqrt(d);
+      for(int i=j+1; i<n; i++)
+      {
+         double sum = a[i*n+j];
+         for(int k=0; k<j; k++)
+            sum -= a[i*n+k]*a[j*n+k];
+         a[i*n+j] = sum/a[j*n+j];
+      }
+   }
+   for(int i=0; i<n; i++)
+   {
+      for(int k=0; k<i; k++)
+         b[i] -= a[i*n+k]*b[k];
+      b[i] /= a[i*n+i];
+   }
+   for(int i=n-1; i>=0; i--)
+   {
+      for(int k=i+1; k<n; k++)
+         b[i] -= a[k*n+i]*b[k];
+      b[i] /= a[i*n+i];
+   }
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+double EvAnalyz::CombineThresholds()
+{
+   //covariance C of the times of all the thresholds in one pass; the weights w = C^-1 1 / 1^T C^-1 1
+   //give the combination with the smallest variance w^T C w = 1 / 1^T C^-1 1 among those
+   //with sum 1. The combined time is added as the derived column LDEcomb, so that the
+   //datasets corrected from this one compute it from their corrected times.
+   PerfScope perf("CombineThresholds",fDataLabel);
+   cout<<"> Combining the thresholds"<<endl;
+   if(fNthr<2)
+   {
+      cout<<"[WARNING]: one threshold only, nothing to combine"<<endl;
+      return 0;
+   }
+   //events with every time inside the range of the time histograms
+   BatchCovariance empty(fNthr,kTimeMin,kTimeMax);
+   std::function<void(BatchCovariance&,const EventBatch&)> fill = [&](BatchCovariance& cov, const EventBatch& batch)
+   {
+      cov.FillN(batch.size,batch.Time(0),batch.capacity);
+   };
+   BatchCovariance cov = FillBatches("threshold covariance",kColTimes,empty,fill);
+   if(fopt.verify_reduction)
+      VerifyReduction("threshold covariance",kColTimes,cov,empty,fill);
+
+   std::vector<double> c((size_t)fNthr*fNthr), w(fNthr,1.);
+   for(int a=0; a<fNthr; a++)
+      for(int b=0; b<fNthr; b++)
+         c[a*fNthr+b] = cov.GetCovariance(a,b);
+   if(cov.GetEntries()<=fNthr || !SolvePositiveDefinite(c,w,fNthr))
+   {
+      cout<<"[WARNING]: singular covariance of the threshold times with "<<cov.GetEntries()<<" events, thresholds not combined"<<endl;
+      return 0;
+   }
+   double norm = 0;
+   for(int i=0; i<fNthr; i++)
+      norm += w[i];
+   double sigma = sqrt(1./norm);
+   int best = 0;
+   std::string expr;
+   for(int i=0; i<fNthr; i++)
+   {
+      w[i] /= norm;
+      if(cov.GetCovariance(i,i)<cov.GetCovariance(best,best))
+         best = i;
+      cout<<">> thr = "<<fthr[i]<<": sigma "<<sqrt(cov.GetCovariance(i,i))<<", weight "<<w[i]<<endl;
+      expr += Form("%s(%.9g)*LDE%.0f",i>0 ? "+" : "",w[i],fthr[i]);
+   }
+   cout<<">> Combined: sigma "<<sigma<<" with "<<cov.GetEntries()<<" events, best single threshold "<<fthr[best]<<": "<<sqrt(cov.GetCovariance(best,best))<<endl;
+
+   std::vector<std::pair<std::string,std::string> >::iterator it = fopt.derived.begin();
+   while(it!=fopt.derived.end() && it->first!="LDEcomb")
+      ++it;
+   if(it==fopt.derived.end())
+      fopt.derived.push_back(std::make_pair(std::string("LDEcomb"),expr));
+   else
+      it->second = expr;
+   CompileDerived();
+   return sigma;
+}
+
+
 void FindSmallestInterval(float* ret, TH1F* histo, const float& fraction, const bool& verbosity)
 {
   float integralMax = fraction * histo->Integral();
@@ -735,16 +2649,13 @@ void FindSmallestInterval(float* ret, TH1F* histo, const float& fraction, const
     if( histo->GetBinContent(bin1+1) > 0. ) M2 = bin1+2;
   }
   
-  std::map<int,float> binCenters;
-  std::map<int,float> binContents;
-  std::map<int,float> binIntegrals;
+  //running integrals of the bins M1..M2-1 (M1 can be the underflow), summed in the same order
+  std::vector<float> binIntegrals(max(M2-M1,0));
+  float integral = 0.;
   for(int bin1 = M1; bin1 < M2; ++bin1)
   {
-    binCenters[bin1] = histo->GetBinCenter(bin1+1);
-    binContents[bin1] = histo->GetBinContent(bin1+1);
-    
-    for(int bin2 = M1; bin2 <= bin1; ++bin2)
-      binIntegrals[bin1] += binContents[bin2];
+    integral += (float)histo->GetBinContent(bin1+1);
+    binIntegrals[bin1-M1] = integral;
   }
   
   float min = 0.;
@@ -754,7 +2665,7 @@ void FindSmallestInterval(float* ret, TH1F* histo, const float& fraction, const
   {
     for(int bin2 = bin1+1; bin2 < M2; ++bin2)
     {
-      if( (binIntegrals[bin2]-binIntegrals[bin1]) < integralMax ) continue;
+      if( (binIntegrals[bin2-M1]-binIntegrals[bin1-M1]) < integralMax ) continue;
       
       float tmpMin = histo -> GetBinCenter(bin1+1);
       float tmpMax = histo -> GetBinCenter(bin2+1);
@@ -770,19 +2681,25 @@ void FindSmallestInterval(float* ret, TH1F* histo, const float& fraction, const
     }
   }
   
-  TH1F* smallHisto = (TH1F*)( histo->Clone("smallHisto") );
-  for(int bin = 1; bin <= smallHisto->GetNbinsX(); ++bin)
+  //mean and error of the mean of the bins inside [min,max], as TH1::GetMean and
+  //GetMeanError would give on a copy of the histogram with the other bins emptied
+  double sumw = 0., sumw2 = 0., sumwx = 0., sumwx2 = 0.;
+  for(int bin = 1; bin <= N; ++bin)
   {
-    if( smallHisto->GetBinCenter(bin) < min )
-      smallHisto -> SetBinContent(bin,0);
-    
-    if( smallHisto->GetBinCenter(bin) > max )
-      smallHisto -> SetBinContent(bin,0);
+    double x = histo->GetBinCenter(bin);
+    if( x < min || x > max )
+      continue;
+    double w = histo->GetBinContent(bin);
+    double err = histo->GetBinError(bin);
+    sumw += w;
+    sumw2 += err*err;
+    sumwx += w*x;
+    sumwx2 += w*x*x;
   }
-  smallHisto -> SetFillColor(kYellow);
-  
-  float mean = smallHisto -> GetMean();
-  float meanErr = smallHisto -> GetMeanError();  
+  float mean = sumw!=0. ? sumwx/sumw : 0.;
+  double rms2 = sumw!=0. ? fabs(sumwx2/sumw - (sumwx/sumw)*(sumwx/sumw)) : 0.;
+  double neff = sumw2>0. ? sumw*sumw/sumw2 : 0.;
+  float meanErr = neff>0. ? sqrt(rms2/neff) : 0.;
   
   ret[0] = mean;
   ret[1] = meanErr;
@@ -4,13 +4,24 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <functional>
 
 #include "TChain.h"
 #include "TProfile.h"
 #include "TProfile2D.h"
 #include "ConfigFile.hh"
+#include "ChainIndex.hh"
+#include "ZoneMap.hh"
+#include "FileStager.hh"
+#include "EventBatch.hh"
+#include "SkimFile.hh"
+#include "FastHisto.hh"
+#include "Formula.hh"
+#include "ColumnStore.hh"
+#include "GausFit.hh"
 #include "TCanvas.h"
 #include "TGraphErrors.h"
+#include "TH2F.h"
 //#include "TH2.h"
 //#include "TH2F.h"
 
@@ -22,14 +33,64 @@
 //using std::string;
 using namespace std;
 
+// Run-wide tuning knobs, propagated to the datasets created by the corrections
+struct EvAnalyzOptions
+{
+   int nthreads;                    // worker threads for the parallel kernels
+   int pipeline_derive_threads;     // threads of the derived columns and cut stage of every pass
+   int pipeline_kernel_threads;     // threads filling the histograms or applying the corrections
+   int pipeline_depth;              // batches in flight between the stages, 0 for automatic
+   float ml_fit_min, ml_fit_max;    // range of the unbinned fit, no truncation if min>=max
+   bool skim;                       // corrections write quantized skims instead of ROOT trees
+   float skim_time_lsb;             // skim precision of times [ns], positions and amplitudes
+   float skim_pos_lsb, skim_amp_lsb;
+   float preview_fraction;          // fraction of the entries of each file read in preview mode
+   std::vector<std::pair<std::string,std::string> > derived;   // name and expression of the derived columns
+   std::string cut;                 // expression of the event selection, empty for none
+   int joint_amp_bins;              // amplitude bins of the map of JointCorrection
+   int thr_layout;                  // plots: 1 one map per quantity with a row per threshold, 0 one plot per threshold, -1 automatic
+   bool verify_reduction;           // repeat the parallel filling with one thread and require identical sums
+   bool check_allocations;          // count the allocations of the histogram and profile loops, fail if they allocate after the warm-up
+   float target_precision;          // relative error on the time RMS at which the filling stops, 0 to read everything
+   float memory_budget;             // MB of the resident store kept in memory, the rest is spilled to scratch_dir
+   std::string scratch_dir;
+   std::vector<EntryRange> preview_sample;   // sample already drawn, for datasets derived from a preview
+
+   EvAnalyzOptions() : nthreads(1), pipeline_derive_threads(1), pipeline_kernel_threads(1), pipeline_depth(0), ml_fit_min(0), ml_fit_max(0), skim(false), skim_time_lsb(0.001), skim_pos_lsb(0.001), skim_amp_lsb(0.01), preview_fraction(1), joint_amp_bins(20), thr_layout(-1), verify_reduction(false), check_allocations(false), target_precision(0), memory_budget(1024), scratch_dir("/tmp") {};
+};
+
 class EvAnalyz 
 {
+   public:
+      // histograms and profiles, filled together on first request
+      enum Product {kTimeHisto=1, kAmpProfile=2, kRiseTimeProfile=4, kPosProfile=8, kAllProducts=15};
+
+   protected:
+      // columns used by a pass, the ones of the cut are always read; kColAll are the stored ones
+      enum Column {kColPos=1, kColAmp=2, kColTimes=4, kColRiseTime=8, kColAll=15, kColDerived=16};
+
    // Data
    protected:
       //ConfigFile fconfig;
       TChain* fDataTree;
+      ChainIndex findex;
+      ZoneMap* fzones;                              // min/max per cluster of the chain files, 0 if disabled
+      std::vector<char> fzone_skip;                 // clusters where the cut fails for every event
+      std::vector<float> fzone_values;
+      FileStager* fstager;                          // local copies of the chain files, 0 if disabled
+      Long64_t fstage_first, fstage_end;            // entries of the file being read
+      SkimReader* fSkim;                            // replaces the chain when reading a skim
+      std::vector<int> fskim_col;                   // skim column of y, x, amp and each threshold
+      std::vector<Formula> fderived;                // derived columns, then the cut if any
+      std::vector<std::vector<int> > fderived_args; // column of each variable of each expression
+      std::vector<std::string> fcolumns;            // name of each column, numbered as in the expressions
+      int fNderived;
+      int frisetime_col;                            // derived column of the risetime
+      std::vector<char> fread_col;                  // columns read by the current pass: x, y, amp and each threshold
+      std::vector<char> fderived_eval;              // derived columns evaluated by the current pass
       float fmu_y_hit, fmu_x_hit, fAMP_MAX;
       std::map<float,float> ftime;
+      std::vector<float*> ftime_addr;               // branch address of each threshold
       int fNthr;
       std::vector<float> fthr;
       std::string fDataLabel;
@@ -39,34 +100,104 @@ class EvAnalyz
       std::map<float,TProfile*> fp_time_amp;
       std::map<float,TProfile*> fp_time_risetime;
       std::map<float,TProfile2D*> fp2_time_x_y;
+      std::vector<ResolutionMap2D> fres_x_y;        // time resolution vs impact point, for each threshold
+      std::map<std::string,TH2F*> fres_maps;        // resolution maps requested so far
       std::map<std::string,TCanvas*> fPlots;
       std::map<float,TH1F*> fh_time;
+      TH2F* fh2_time_thr;                           // time distribution of all the thresholds, one row each
+      std::map<std::string,TH2F*> fthr_maps;        // profiles of all the thresholds drawn as maps
+      std::vector<double> ftime_moments;            // sufficient statistics of the unbinned fit, 3 per threshold and group
+      int fmoment_groups;                           // groups of ftime_moments, 0 until filled
+      float fmoment_min, fmoment_max;               // fit range of ftime_moments
+      ColumnStore* fresident;                       // x, y, AMP_MAX and times of the sample, read instead of the chain once resident
+      std::vector<EntryRange> fsample;              // entries read by every pass, the whole dataset unless in preview
+      int fngroups;                                 // jackknife groups of strata of the sample
+      std::vector<std::vector<BatchHisto1D> > fbh_time_group;   // time histos of each group, for each threshold
+      bool fjackknife;
+      int fjackknife_group;                         // group left out by the current replica
+      int fproducts;                                // Product flags filled
+      int frequested;                               // Product flags requested and not filled yet
+      EvAnalyzOptions fopt;
 
    // Methods
    public:
       EvAnalyz(const ConfigFile & config);
-      EvAnalyz(TChain* outtree, int Nthr, vector<float> thr, string DataLabel, float famp_min, float famp_max, float frisetime_min, float frisetime_max, float ftime_offset);
+      EvAnalyz(TChain* outtree, int Nthr, vector<float> thr, string DataLabel, float famp_min, float famp_max, float frisetime_min, float frisetime_max, float ftime_offset, const EvAnalyzOptions& opt=EvAnalyzOptions());
+      EvAnalyz(SkimReader* skim, int Nthr, vector<float> thr, string DataLabel, float famp_min, float famp_max, float frisetime_min, float frisetime_max, float ftime_offset, const EvAnalyzOptions& opt=EvAnalyzOptions());
       ~EvAnalyz();
-      void FillProfile(bool mkamp=true, bool mkrisetime=true, bool mkpos=true);
-      void FillHisto();
+      void Request(int products) {frequested |= products & ~fproducts;};
+      void Require(int products);
       EvAnalyz AmpCorrection();
       EvAnalyz MitigatedAmpCorrection(float amp_min_fit, float amp_max_fit);
       EvAnalyz PosCorrection();
       EvAnalyz RiseTimeCorrection();
+      EvAnalyz JointCorrection();
       TGraphErrors* ThrScan(std::string option);
+      double CombineThresholds();
+      void WriteSkim(const std::string& filename);
+      void MakeResident();
+      void ExportArrow(const std::string& filename, int chunksize=1<<20);
+      bool SetCut(const std::string& cut, std::string& error);
+      bool CheckCut(const std::string& cut, std::string& error) const;
+      const std::string& GetCut() const {return fopt.cut;};
       void DrawHistos();
       void DrawProfiles(float time_min=0,float time_max=2);
       void SetAmpRange(float amp_min,float amp_max);
       void SetRiseTimeRange(float risetime_min,float risetime_max);
+      void SetUnbinnedFitRange(float fit_min,float fit_max) {fopt.ml_fit_min=fit_min; fopt.ml_fit_max=fit_max;};
       TChain* GetChain() {return fDataTree;};
+      TH2F* GetTimeThrHisto() {Require(kTimeHisto); return fh2_time_thr;};
+      const std::vector<float>& GetThresholds() const {return fthr;};
+      const std::string& GetDataLabel() const {return fDataLabel;};
+      TH1F* GetTimeHisto(float thr) {Require(kTimeHisto); return fh_time.count(thr) ? fh_time[thr] : 0;};
+      TProfile* GetTimeAmpProfile(float thr) {Require(kAmpProfile); return fp_time_amp.count(thr) ? fp_time_amp[thr] : 0;};
+      TProfile* GetTimeRiseTimeProfile(float thr) {Require(kRiseTimeProfile); return fp_time_risetime.count(thr) ? fp_time_risetime[thr] : 0;};
+      TProfile2D* GetTimePosProfile(float thr) {Require(kPosProfile); return fp2_time_x_y.count(thr) ? fp2_time_x_y[thr] : 0;};
+      TH2F* ResolutionMap(float thr, const std::string& option);
+      Long64_t GetEntries();
+      const ChainIndex& GetIndex() const {return findex;};
+      float GetAmpMin() const {return famp_min;};
+      float GetAmpMax() const {return famp_max;};
+      float GetRiseTimeMin() const {return frisetime_min;};
+      float GetRiseTimeMax() const {return frisetime_max;};
       //std::map<float,TProfile*>& Getp_time_amp();
       //std::map<float,TProfile*>& Getp_time_risetime();
       //std::map<float,TProfile2D*>& Getp2_time_x_y();
 
    protected:
       void SetBranchTree();
+      void DiscoverThresholds(float thr_min, float thr_max);
+      bool IsCompactLayout() const;
+      std::vector<double> GetThresholdEdges() const;
+      TH2F* ThresholdMap(const std::string& name, std::map<float,TProfile*>& profiles);
+      void SetSkimColumns();
+      void CompileDerived();
+      void PruneZones();
+      void EvalDerived(EventBatch& batch) const;
+      const float* GetColumn(const EventBatch& batch, int col) const;
+      void BuildSample();
+      void Project(int columns);
+      Long64_t ForEachBatch(int columns, const std::function<void(EventBatch&)>& body, bool verbose=true, const std::function<void(EventBatch&)>& kernel=std::function<void(EventBatch&)>());
+      bool ReadNextBatch(EventBatch& batch, unsigned& range, Long64_t& next, bool verbose);
+      int GetPipelineDepth() const;
+      Long64_t GetSampleEntries() const;
+      std::vector<std::string> GetColumnNames() const;
+      template<class Sums> Sums FillBatches(const std::string& what, int columns, const Sums& empty, const std::function<void(Sums&,const EventBatch&)>& fill, const std::function<bool(const Sums&)>& stop=std::function<bool(const Sums&)>());
+      template<class Sums> void VerifyReduction(const std::string& what, int columns, const Sums& result, const Sums& empty, const std::function<void(Sums&,const EventBatch&)>& fill);
+      void JackknifeErrors(const std::string& option, TGraphErrors* res_thr);
+      Int_t ReadEntry(Long64_t ientry);
+      void StageFile(Long64_t entry);
+      int ReadBatch(EventBatch& batch, Long64_t first, Long64_t last);
       void CreateProfile(bool mkamp=true, bool mkrisetime=true, bool mkpos=true);
       void CreateHisto();
+      void FillProducts(int products);
+      void Invalidate(int products);
+      void SettleSample();
+      void FillTimeMoments();
+      void SetTimeMoments(const std::vector<double>& mom, int ngroups);
+      GausFitResult UnbinnedFit(int ithr, int skipgroup=-1);
+      EvAnalyz ApplyCorrection(const std::string& suffix, const std::string& title, const std::function<void(EventBatch&)>& correct);
+      std::vector<SkimColumn> SkimColumns(float time_offset) const;
       void ParseConfigFile(const ConfigFile & config);
 };
 
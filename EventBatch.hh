@@ -0,0 +1,62 @@
+#ifndef EVENTBATCH_H
+#define EVENTBATCH_H
+
+#include <vector>
+
+#include "Rtypes.h"
+
+using namespace std;
+
+// Range of entries [first,last) read by a pass, with the jackknife group of its stratum
+struct EntryRange
+{
+   Long64_t first, last;
+   int group;
+
+   EntryRange(Long64_t first_=0, Long64_t last_=0, int group_=0) : first(first_), last(last_), group(group_) {};
+};
+
+// Column buffers of a block of consecutive entries of the chain
+struct EventBatch
+{
+   int size;                      // entries in the batch
+   int capacity;
+   int nthr;
+   int nderived;
+   Long64_t first;                // chain entry of the first row
+   Long64_t last;                 // entry after the ones read, beyond first+size if clusters were skipped
+   int group;                     // jackknife group of the range the batch belongs to
+   unsigned range;                // sampled range the batch belongs to
+   bool endrange;                 // the batch reaches the end of its range
+   std::vector<float> mu_x_hit;
+   std::vector<float> mu_y_hit;
+   std::vector<float> AMP_MAX;
+   std::vector<float> risetime;   // the derived column "risetime", time(50) - time(20) by default
+   std::vector<float> time;       // one column of capacity rows per threshold, time offset subtracted
+   std::vector<float> derived;    // one column per derived variable
+   std::vector<double> stack;     // scratch of the evaluation of the derived columns and of the cut
+   std::vector<float> mask;
+   std::vector<const float*> args;
+   std::vector<int> bins;         // scratch of the kernels; the scratch keeps its capacity
+   std::vector<float> work;       // from one batch to the next, the stages do not allocate
+
+   EventBatch(int capacity_=4096, int nthr_=0, int nderived_=0) : size(0), capacity(0), nthr(0), nderived(0), first(0), last(0), group(0), range(0), endrange(false) {Resize(capacity_,nthr_,nderived_);};
+   void Resize(int capacity_, int nthr_, int nderived_=0)
+   {
+      capacity = capacity_;
+      nthr = nthr_;
+      nderived = nderived_;
+      mu_x_hit.resize(capacity);
+      mu_y_hit.resize(capacity);
+      AMP_MAX.resize(capacity);
+      risetime.resize(capacity);
+      time.resize(capacity*nthr);
+      derived.resize(capacity*nderived);
+   };
+   float* Time(int ithr) {return &time[ithr*capacity];};
+   const float* Time(int ithr) const {return &time[ithr*capacity];};
+   float* Derived(int k) {return &derived[k*capacity];};
+   const float* Derived(int k) const {return &derived[k*capacity];};
+};
+
+#endif  // EVENTBATCH_H
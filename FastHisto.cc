@@ -0,0 +1,938 @@
+#include "FastHisto.hh"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// bitwise comparison, NaN included
+static bool SameBits(const std::vector<double>& a, const std::vector<double>& b)
+{
+   return a.size()==b.size() && (a.empty() || memcmp(&a[0],&b[0],a.size()*sizeof(double))==0);
+}
+
+// the bins where sumw is not 0, after a Read
+static void FindTouched(const std::vector<double>& sumw, std::vector<int>& touched)
+{
+   touched.clear();
+   touched.reserve(sumw.size());
+   for(unsigned bin=0; bin<sumw.size(); bin++)
+      if(sumw[bin]!=0)
+         touched.push_back(bin);
+}
+
+// zero the bins with entries of each array, the others are 0 already; the list keeps the
+// capacity of every bin, filling never allocates
+static void ClearTouched(std::vector<int>& touched, int nbins, std::vector<double>* a, std::vector<double>* b=0, std::vector<double>* c=0)
+{
+   std::vector<double>* arrays[3] = {a,b,c};
+   for(int k=0; k<3 && arrays[k]; k++)
+   {
+      std::vector<double>& v = *arrays[k];
+      if((int)v.size()!=nbins)
+         v.assign(nbins,0.);
+      for(unsigned t=0; t<touched.size(); t++)
+         v[touched[t]] = 0;
+   }
+   touched.clear();
+   if((int)touched.capacity()<nbins)
+      touched.reserve(nbins);
+}
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchAxis::FindBins(int n, const float* x, int* bins) const
+{
+   //same arithmetic as TAxis::FindBin for fixed bins, NaN goes to the overflow
+   const double width = fMax-fMin;
+   for(int i=0; i<n; i++)
+   {
+      double v = x[i];
+      double t = fN*(v-fMin)/width;
+      t = t<0 ? 0 : t;
+      t = t>fN ? fN : t;
+      int bin = 1 + (int)t;
+      bin = v<fMin ? 0 : bin;
+      bin = !(v<fMax) ? fN+1 : bin;
+      bins[i] = bin;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+BatchHisto1D::BatchHisto1D(int nx, double xmin, double xmax):
+fX(nx,xmin,xmax)
+{
+   Reset();
+}
+
+BatchHisto1D::BatchHisto1D(TH1* h):
+fX(h->GetNbinsX(),h->GetXaxis()->GetXmin(),h->GetXaxis()->GetXmax())
+{
+   Reset();
+}
+
+void BatchHisto1D::Reset()
+{
+   ClearTouched(fTouched,fX.fN+2,&fSumw);
+   for(int k=0; k<4; k++)
+      fStats[k] = 0;
+   fEntries = 0;
+}
+
+void BatchHisto1D::FillN(int n, const float* x)
+{
+   if((int)fBins.size()<n)
+      fBins.resize(n);
+   fX.FindBins(n,x,&fBins[0]);
+
+   double sumw = 0, sumwx = 0, sumwx2 = 0;
+   for(int i=0; i<n; i++)
+   {
+      int bin = fBins[i];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += 1;
+      if(bin>0 && bin<=fX.fN)
+      {
+         double v = x[i];
+         sumw += 1;
+         sumwx += v;
+         sumwx2 += v*v;
+      }
+   }
+   fStats[0] += sumw;
+   fStats[1] += sumw;
+   fStats[2] += sumwx;
+   fStats[3] += sumwx2;
+   fEntries += n;
+}
+
+void BatchHisto1D::Merge(const BatchHisto1D& other)
+{
+   //the bins of other without entries would add 0
+   fTouched.reserve(fSumw.size());
+   for(unsigned t=0; t<other.fTouched.size(); t++)
+   {
+      int bin = other.fTouched[t];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += other.fSumw[bin];
+   }
+   for(int k=0; k<4; k++)
+      fStats[k] += other.fStats[k];
+   fEntries += other.fEntries;
+}
+
+void BatchHisto1D::CopyTo(TH1* h) const
+{
+   TArrayD* sumw2 = h->GetSumw2();
+   for(int bin=0; bin<fX.fN+2; bin++)
+   {
+      h->SetBinContent(bin,fSumw[bin]);
+      if(sumw2->GetSize())
+         sumw2->fArray[bin] = fSumw[bin];
+   }
+   double stats[4];
+   for(int k=0; k<4; k++)
+      stats[k] = fStats[k];
+   h->PutStats(stats);
+   h->SetEntries(fEntries);
+}
+
+double BatchHisto1D::GetRMS() const
+{
+   if(fStats[0]<=0)
+      return 0;
+   double mean = fStats[2]/fStats[0];
+   double var = fStats[3]/fStats[0] - mean*mean;
+   return var>0 ? sqrt(var) : 0;
+}
+
+double BatchHisto1D::GetRMSRelError() const
+{
+   //sigma(s)/s = sqrt((m4/m2^2-1)/n)/2, with the fourth moment from the bin centers;
+   //1/sqrt(2n) for a gaussian, larger for the tails of the time distributions
+   double n = fStats[0];
+   double rms = GetRMS();
+   if(n<2 || rms<=0)
+      return 1;
+   double mean = fStats[2]/n;
+   double m4 = 0;
+   const double width = (fX.fMax-fX.fMin)/fX.fN;
+   for(int bin=1; bin<=fX.fN; bin++)
+   {
+      double d = fX.fMin+(bin-0.5)*width - mean;
+      m4 += fSumw[bin]*d*d*d*d;
+   }
+   m4 /= n;
+   double kurt = m4/(rms*rms*rms*rms);
+   return 0.5*sqrt(max(kurt-1,0.)/n);
+}
+
+bool BatchHisto1D::Identical(const BatchHisto1D& other) const
+{
+   return SameBits(fSumw,other.fSumw) && memcmp(fStats,other.fStats,sizeof(fStats))==0 && memcmp(&fEntries,&other.fEntries,sizeof(fEntries))==0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchHisto1D::Write(std::ostream& out) const
+{
+   WriteRaw(out,fX);
+   WriteRaw(out,fSumw);
+   WriteRaw(out,fStats);
+   WriteRaw(out,fEntries);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool BatchHisto1D::Read(std::istream& in)
+{
+   if(!ReadRaw(in,fX) || !ReadRaw(in,fSumw) || !ReadRaw(in,fStats) || !ReadRaw(in,fEntries))
+      return false;
+   FindTouched(fSumw,fTouched);
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+BatchProfile1D::BatchProfile1D(int nx, double xmin, double xmax):
+fX(nx,xmin,xmax)
+{
+   Reset();
+}
+
+BatchProfile1D::BatchProfile1D(TProfile* p):
+fX(p->GetNbinsX(),p->GetXaxis()->GetXmin(),p->GetXaxis()->GetXmax())
+{
+   Reset();
+}
+
+void BatchProfile1D::Reset()
+{
+   ClearTouched(fTouched,fX.fN+2,&fSumw,&fSumwy,&fSumwy2);
+   for(int k=0; k<6; k++)
+      fStats[k] = 0;
+   fEntries = 0;
+}
+
+void BatchProfile1D::FillN(int n, const float* x, const float* y)
+{
+   if((int)fBins.size()<n)
+      fBins.resize(n);
+   fX.FindBins(n,x,&fBins[0]);
+
+   double sumw = 0, sumwx = 0, sumwx2 = 0, sumwy = 0, sumwy2 = 0;
+   for(int i=0; i<n; i++)
+   {
+      int bin = fBins[i];
+      double vy = y[i];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += 1;
+      fSumwy[bin] += vy;
+      fSumwy2[bin] += vy*vy;
+      if(bin>0 && bin<=fX.fN)
+      {
+         double vx = x[i];
+         sumw += 1;
+         sumwx += vx;
+         sumwx2 += vx*vx;
+         sumwy += vy;
+         sumwy2 += vy*vy;
+      }
+   }
+   fStats[0] += sumw;
+   fStats[1] += sumw;
+   fStats[2] += sumwx;
+   fStats[3] += sumwx2;
+   fStats[4] += sumwy;
+   fStats[5] += sumwy2;
+   fEntries += n;
+}
+
+void BatchProfile1D::Merge(const BatchProfile1D& other)
+{
+   fTouched.reserve(fSumw.size());
+   for(unsigned t=0; t<other.fTouched.size(); t++)
+   {
+      int bin = other.fTouched[t];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += other.fSumw[bin];
+      fSumwy[bin] += other.fSumwy[bin];
+      fSumwy2[bin] += other.fSumwy2[bin];
+   }
+   for(int k=0; k<6; k++)
+      fStats[k] += other.fStats[k];
+   fEntries += other.fEntries;
+}
+
+void BatchProfile1D::CopyTo(TProfile* p) const
+{
+   //TProfile stores sum(w*y) as bin content, sum(w*y^2) in fSumw2 and sum(w) as bin entries
+   TArrayD* sumw2 = p->GetSumw2();
+   TArrayD* binsumw2 = p->GetBinSumw2();
+   for(int bin=0; bin<fX.fN+2; bin++)
+   {
+      p->SetBinContent(bin,fSumwy[bin]);
+      p->SetBinEntries(bin,fSumw[bin]);
+      sumw2->fArray[bin] = fSumwy2[bin];
+      if(binsumw2->GetSize())
+         binsumw2->fArray[bin] = fSumw[bin];
+   }
+   double stats[6];
+   for(int k=0; k<6; k++)
+      stats[k] = fStats[k];
+   p->PutStats(stats);
+   p->SetEntries(fEntries);
+}
+
+bool BatchProfile1D::Identical(const BatchProfile1D& other) const
+{
+   return SameBits(fSumw,other.fSumw) && SameBits(fSumwy,other.fSumwy) && SameBits(fSumwy2,other.fSumwy2) &&
+          memcmp(fStats,other.fStats,sizeof(fStats))==0 && memcmp(&fEntries,&other.fEntries,sizeof(fEntries))==0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchProfile1D::Write(std::ostream& out) const
+{
+   WriteRaw(out,fX);
+   WriteRaw(out,fSumw);
+   WriteRaw(out,fSumwy);
+   WriteRaw(out,fSumwy2);
+   WriteRaw(out,fStats);
+   WriteRaw(out,fEntries);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool BatchProfile1D::Read(std::istream& in)
+{
+   if(!ReadRaw(in,fX) || !ReadRaw(in,fSumw) || !ReadRaw(in,fSumwy) || !ReadRaw(in,fSumwy2) || !ReadRaw(in,fStats) || !ReadRaw(in,fEntries))
+      return false;
+   FindTouched(fSumw,fTouched);
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+BatchProfile2D::BatchProfile2D(int nx, double xmin, double xmax, int ny, double ymin, double ymax):
+fX(nx,xmin,xmax),
+fY(ny,ymin,ymax)
+{
+   Reset();
+}
+
+BatchProfile2D::BatchProfile2D(TProfile2D* p):
+fX(p->GetNbinsX(),p->GetXaxis()->GetXmin(),p->GetXaxis()->GetXmax()),
+fY(p->GetNbinsY(),p->GetYaxis()->GetXmin(),p->GetYaxis()->GetXmax())
+{
+   Reset();
+}
+
+void BatchProfile2D::Reset()
+{
+   ClearTouched(fTouched,(fX.fN+2)*(fY.fN+2),&fSumw,&fSumwz,&fSumwz2);
+   for(int k=0; k<9; k++)
+      fStats[k] = 0;
+   fEntries = 0;
+}
+
+void BatchProfile2D::FillN(int n, const float* x, const float* y, const float* z)
+{
+   if((int)fBins.size()<n)
+   {
+      fBins.resize(n);
+      fBinsY.resize(n);
+   }
+   fX.FindBins(n,x,&fBins[0]);
+   fY.FindBins(n,y,&fBinsY[0]);
+
+   double stats[9] = {0,0,0,0,0,0,0,0,0};
+   const int nx2 = fX.fN+2;
+   for(int i=0; i<n; i++)
+   {
+      int binx = fBins[i];
+      int biny = fBinsY[i];
+      int bin = biny*nx2+binx;
+      double vz = z[i];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += 1;
+      fSumwz[bin] += vz;
+      fSumwz2[bin] += vz*vz;
+      if(binx>0 && binx<=fX.fN && biny>0 && biny<=fY.fN)
+      {
+         double vx = x[i];
+         double vy = y[i];
+         stats[0] += 1;
+         stats[2] += vx;
+         stats[3] += vx*vx;
+         stats[4] += vy;
+         stats[5] += vy*vy;
+         stats[6] += vx*vy;
+         stats[7] += vz;
+         stats[8] += vz*vz;
+      }
+   }
+   stats[1] = stats[0];
+   for(int k=0; k<9; k++)
+      fStats[k] += stats[k];
+   fEntries += n;
+}
+
+void BatchProfile2D::Merge(const BatchProfile2D& other)
+{
+   fTouched.reserve(fSumw.size());
+   for(unsigned t=0; t<other.fTouched.size(); t++)
+   {
+      int bin = other.fTouched[t];
+      if(fSumw[bin]==0)
+         fTouched.push_back(bin);
+      fSumw[bin] += other.fSumw[bin];
+      fSumwz[bin] += other.fSumwz[bin];
+      fSumwz2[bin] += other.fSumwz2[bin];
+   }
+   for(int k=0; k<9; k++)
+      fStats[k] += other.fStats[k];
+   fEntries += other.fEntries;
+}
+
+void BatchProfile2D::CopyTo(TProfile2D* p) const
+{
+   //global bin numbering is biny*(nx+2)+binx, as in ROOT
+   TArrayD* sumw2 = p->GetSumw2();
+   TArrayD* binsumw2 = p->GetBinSumw2();
+   for(unsigned bin=0; bin<fSumw.size(); bin++)
+   {
+      p->SetBinContent(bin,fSumwz[bin]);
+      p->SetBinEntries(bin,fSumw[bin]);
+      sumw2->fArray[bin] = fSumwz2[bin];
+      if(binsumw2->GetSize())
+         binsumw2->fArray[bin] = fSumw[bin];
+   }
+   double stats[9];
+   for(int k=0; k<9; k++)
+      stats[k] = fStats[k];
+   p->PutStats(stats);
+   p->SetEntries(fEntries);
+}
+
+bool BatchProfile2D::Identical(const BatchProfile2D& other) const
+{
+   return SameBits(fSumw,other.fSumw) && SameBits(fSumwz,other.fSumwz) && SameBits(fSumwz2,other.fSumwz2) &&
+          memcmp(fStats,other.fStats,sizeof(fStats))==0 && memcmp(&fEntries,&other.fEntries,sizeof(fEntries))==0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchProfile2D::Write(std::ostream& out) const
+{
+   WriteRaw(out,fX);
+   WriteRaw(out,fY);
+   WriteRaw(out,fSumw);
+   WriteRaw(out,fSumwz);
+   WriteRaw(out,fSumwz2);
+   WriteRaw(out,fStats);
+   WriteRaw(out,fEntries);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool BatchProfile2D::Read(std::istream& in)
+{
+   if(!ReadRaw(in,fX) || !ReadRaw(in,fY) || !ReadRaw(in,fSumw) || !ReadRaw(in,fSumwz) || !ReadRaw(in,fSumwz2) || !ReadRaw(in,fStats) || !ReadRaw(in,fEntries))
+      return false;
+   FindTouched(fSumw,fTouched);
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+SparseProfile3D::SparseProfile3D(int nx, double xmin, double xmax, int ny, double ymin, double ymax, int nz, double zmin, double zmax):
+fX(nx,xmin,xmax),
+fY(ny,ymin,ymax),
+fZ(nz,zmin,zmax),
+fEntries(0)
+{
+}
+
+void SparseProfile3D::FillN(int n, const float* x, const float* y, const float* z, const float* t)
+{
+   if((int)fBinsX.size()<n)
+   {
+      fBinsX.resize(n);
+      fBinsY.resize(n);
+      fBinsZ.resize(n);
+   }
+   fX.FindBins(n,x,&fBinsX[0]);
+   fY.FindBins(n,y,&fBinsY[0]);
+   fZ.FindBins(n,z,&fBinsZ[0]);
+
+   //events sorted by cell, in their order inside each cell: the sums of a cell are the
+   //same as filling one event at a time
+   fOrder.resize(n);
+   for(int i=0; i<n; i++)
+      fOrder[i] = std::make_pair(GetBin(fBinsX[i],fBinsY[i],fBinsZ[i]),i);
+   std::sort(fOrder.begin(),fOrder.end());
+   fBatch.clear();
+   for(int k=0; k<n; k++)
+   {
+      if(fBatch.empty() || fBatch.back().first!=fOrder[k].first)
+         fBatch.push_back(std::make_pair(fOrder[k].first,Cell()));
+      Cell& cell = fBatch.back().second;
+      double vt = t[fOrder[k].second];
+      cell.sumw += 1;
+      cell.sumwt += vt;
+      cell.sumwt2 += vt*vt;
+   }
+   //swapped rather than copied: the buffers keep their capacity from one batch to the next
+   if(fCells.empty())
+      fCells.swap(fBatch);
+   else
+      MergeCells(fBatch);
+   fEntries += n;
+}
+
+void SparseProfile3D::MergeCells(const std::vector<std::pair<Long64_t,Cell> >& cells)
+{
+   if(fCells.empty())
+   {
+      fCells = cells;
+      return;
+   }
+   fMerged.clear();
+   unsigned i = 0, j = 0;
+   while(i<fCells.size() || j<cells.size())
+   {
+      if(j==cells.size() || (i<fCells.size() && fCells[i].first<cells[j].first))
+         fMerged.push_back(fCells[i++]);
+      else if(i==fCells.size() || cells[j].first<fCells[i].first)
+         fMerged.push_back(cells[j++]);
+      else
+      {
+         fMerged.push_back(fCells[i]);
+         Cell& cell = fMerged.back().second;
+         cell.sumw += cells[j].second.sumw;
+         cell.sumwt += cells[j].second.sumwt;
+         cell.sumwt2 += cells[j].second.sumwt2;
+         i++;
+         j++;
+      }
+   }
+   fCells.swap(fMerged);
+}
+
+void SparseProfile3D::Merge(const SparseProfile3D& other)
+{
+   MergeCells(other.fCells);
+   fEntries += other.fEntries;
+}
+
+void SparseProfile3D::Reset()
+{
+   fCells.clear();
+   fSmoothed.clear();
+   fEntries = 0;
+}
+
+bool SparseProfile3D::Identical(const SparseProfile3D& other) const
+{
+   if(fCells.size()!=other.fCells.size() || memcmp(&fEntries,&other.fEntries,sizeof(fEntries))!=0)
+      return false;
+   for(unsigned k=0; k<fCells.size(); k++)
+      if(fCells[k].first!=other.fCells[k].first || memcmp(&fCells[k].second,&other.fCells[k].second,sizeof(Cell))!=0)
+         return false;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SparseProfile3D::Write(std::ostream& out) const
+{
+   WriteRaw(out,fX);
+   WriteRaw(out,fY);
+   WriteRaw(out,fZ);
+   WriteRaw(out,fCells);
+   WriteRaw(out,fSmoothed);
+   WriteRaw(out,fEntries);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool SparseProfile3D::Read(std::istream& in)
+{
+   return ReadRaw(in,fX) && ReadRaw(in,fY) && ReadRaw(in,fZ) && ReadRaw(in,fCells) && ReadRaw(in,fSmoothed) && ReadRaw(in,fEntries);
+}
+
+
+const SparseProfile3D::Cell* SparseProfile3D::FindCell(Long64_t bin) const
+{
+   std::vector<std::pair<Long64_t,Cell> >::const_iterator it = std::lower_bound(fCells.begin(),fCells.end(),std::make_pair(bin,Cell()),
+      [](const std::pair<Long64_t,Cell>& a, const std::pair<Long64_t,Cell>& b) {return a.first<b.first;});
+   return (it!=fCells.end() && it->first==bin) ? &it->second : 0;
+}
+
+void SparseProfile3D::Smooth()
+{
+   static const double kKernel[3] = {0.5,1.,0.5};
+   const int nx2 = fX.fN+2, ny2 = fY.fN+2;
+   fSmoothed.clear();
+   for(unsigned c=0; c<fCells.size(); c++)
+   {
+      Long64_t bin = fCells[c].first;
+      int binx = bin%nx2;
+      int biny = (bin/nx2)%ny2;
+      int binz = bin/((Long64_t)nx2*ny2);
+      double sumw = 0, sumwt = 0;
+      for(int dz=-1; dz<=1; dz++)
+         for(int dy=-1; dy<=1; dy++)
+            for(int dx=-1; dx<=1; dx++)
+            {
+               int bx = binx+dx, by = biny+dy, bz = binz+dz;
+               if(bx<0 || bx>fX.fN+1 || by<0 || by>fY.fN+1 || bz<0 || bz>fZ.fN+1)
+                  continue;
+               const Cell* nb = FindCell(GetBin(bx,by,bz));
+               if(!nb)
+                  continue;
+               double k = kKernel[dx+1]*kKernel[dy+1]*kKernel[dz+1];
+               sumw += k*nb->sumw;
+               sumwt += k*nb->sumwt;
+            }
+      fSmoothed.push_back(std::make_pair(bin,sumwt/sumw));
+   }
+}
+
+void SparseProfile3D::Eval(int n, const float* x, const float* y, const float* z, float* out, std::vector<int>& bins) const
+{
+   //cells never filled give 0; the bins go to the scratch of the caller, several threads
+   //can evaluate at once
+   if(n<=0)
+      return;
+   if((int)bins.size()<3*n)
+      bins.resize(3*n);
+   fX.FindBins(n,x,&bins[0]);
+   fY.FindBins(n,y,&bins[n]);
+   fZ.FindBins(n,z,&bins[2*n]);
+   for(int i=0; i<n; i++)
+   {
+      Long64_t bin = GetBin(bins[i],bins[n+i],bins[2*n+i]);
+      std::vector<std::pair<Long64_t,double> >::const_iterator it = std::lower_bound(fSmoothed.begin(),fSmoothed.end(),std::make_pair(bin,-HUGE_VAL));
+      out[i] = (it==fSmoothed.end() || it->first!=bin) ? 0 : it->second;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+ResolutionMap2D::ResolutionMap2D(int nx, double xmin, double xmax, int ny, double ymin, double ymax, int nt, double tmin, double tmax):
+fX(nx,xmin,xmax),
+fY(ny,ymin,ymax),
+fT(nt,tmin,tmax),
+fSumw((nx+2)*(ny+2),0.),
+fSumt((nx+2)*(ny+2),0.),
+fSumt2((nx+2)*(ny+2),0.)
+{
+   fTouched.reserve(fSumw.size());
+}
+
+void ResolutionMap2D::Reset()
+{
+   ClearTouched(fTouched,fSumw.size(),&fSumw,&fSumt,&fSumt2);
+   fCounts.clear();
+}
+
+void ResolutionMap2D::FillN(int n, const float* x, const float* y, const float* t)
+{
+   if((int)fBinsX.size()<n)
+   {
+      fBinsX.resize(n);
+      fBinsY.resize(n);
+      fBinsT.resize(n);
+   }
+   fX.FindBins(n,x,&fBinsX[0]);
+   fY.FindBins(n,y,&fBinsY[0]);
+   fT.FindBins(n,t,&fBinsT[0]);
+
+   const int nx2 = fX.fN+2, nt2 = fT.fN+2;
+   fKeys.resize(n);
+   for(int i=0; i<n; i++)
+   {
+      int cell = fBinsY[i]*nx2+fBinsX[i];
+      double vt = t[i];
+      if(fSumw[cell]==0)
+         fTouched.push_back(cell);
+      fSumw[cell] += 1;
+      fSumt[cell] += vt;
+      fSumt2[cell] += vt*vt;
+      fKeys[i] = (Long64_t)cell*nt2+fBinsT[i];
+   }
+
+   //the batch as sorted (key,count) pairs, then merged with the sketch
+   std::sort(fKeys.begin(),fKeys.begin()+n);
+   fBatch.clear();
+   for(int i=0; i<n; i++)
+      if(fBatch.empty() || fBatch.back().first!=fKeys[i])
+         fBatch.push_back(std::make_pair(fKeys[i],1.));
+      else
+         fBatch.back().second += 1;
+   if(fCounts.empty())
+      fCounts.swap(fBatch);
+   else
+      MergeCounts(fBatch);
+}
+
+void ResolutionMap2D::MergeCounts(const std::vector<std::pair<Long64_t,double> >& counts)
+{
+   if(fCounts.empty())
+   {
+      fCounts = counts;
+      return;
+   }
+   fMerged.clear();
+   unsigned i = 0, j = 0;
+   while(i<fCounts.size() || j<counts.size())
+   {
+      if(j==counts.size() || (i<fCounts.size() && fCounts[i].first<counts[j].first))
+         fMerged.push_back(fCounts[i++]);
+      else if(i==fCounts.size() || counts[j].first<fCounts[i].first)
+         fMerged.push_back(counts[j++]);
+      else
+      {
+         fMerged.push_back(std::make_pair(fCounts[i].first,fCounts[i].second+counts[j].second));
+         i++;
+         j++;
+      }
+   }
+   fCounts.swap(fMerged);
+}
+
+void ResolutionMap2D::Merge(const ResolutionMap2D& other)
+{
+   fTouched.reserve(fSumw.size());
+   for(unsigned t=0; t<other.fTouched.size(); t++)
+   {
+      int cell = other.fTouched[t];
+      if(fSumw[cell]==0)
+         fTouched.push_back(cell);
+      fSumw[cell] += other.fSumw[cell];
+      fSumt[cell] += other.fSumt[cell];
+      fSumt2[cell] += other.fSumt2[cell];
+   }
+   MergeCounts(other.fCounts);
+}
+
+bool ResolutionMap2D::Identical(const ResolutionMap2D& other) const
+{
+   if(!SameBits(fSumw,other.fSumw) || !SameBits(fSumt,other.fSumt) || !SameBits(fSumt2,other.fSumt2))
+      return false;
+   return fCounts.size()==other.fCounts.size() && (fCounts.empty() || memcmp(&fCounts[0],&other.fCounts[0],fCounts.size()*sizeof(fCounts[0]))==0);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ResolutionMap2D::Write(std::ostream& out) const
+{
+   WriteRaw(out,fX);
+   WriteRaw(out,fY);
+   WriteRaw(out,fT);
+   WriteRaw(out,fSumw);
+   WriteRaw(out,fSumt);
+   WriteRaw(out,fSumt2);
+   WriteRaw(out,fCounts);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool ResolutionMap2D::Read(std::istream& in)
+{
+   if(!ReadRaw(in,fX) || !ReadRaw(in,fY) || !ReadRaw(in,fT) || !ReadRaw(in,fSumw) || !ReadRaw(in,fSumt) || !ReadRaw(in,fSumt2) || !ReadRaw(in,fCounts))
+      return false;
+   FindTouched(fSumw,fTouched);
+   return true;
+}
+
+double ResolutionMap2D::GetMean(int binx, int biny) const
+{
+   int cell = biny*(fX.fN+2)+binx;
+   return fSumw[cell]>0 ? fSumt[cell]/fSumw[cell] : 0;
+}
+
+double ResolutionMap2D::GetRMS(int binx, int biny) const
+{
+   int cell = biny*(fX.fN+2)+binx;
+   if(fSumw[cell]<2)
+      return 0;
+   double mean = fSumt[cell]/fSumw[cell];
+   double var = fSumt2[cell]/fSumw[cell]-mean*mean;
+   return var>0 ? sqrt(var) : 0;
+}
+
+double ResolutionMap2D::GetWidth68(int binx, int biny) const
+{
+   //(q84-q16)/2, quantiles interpolated linearly inside the time bins; the under/overflow
+   //entries sit at the edges of the range
+   int cell = biny*(fX.fN+2)+binx;
+   double n = fSumw[cell];
+   if(n<2)
+      return 0;
+   const int nt2 = fT.fN+2;
+   const double width = (fT.fMax-fT.fMin)/fT.fN;
+   std::vector<std::pair<Long64_t,double> >::const_iterator first = std::lower_bound(fCounts.begin(),fCounts.end(),std::make_pair((Long64_t)cell*nt2,-1.));
+   const double prob[2] = {0.15865525, 0.84134475};
+   double q[2];
+   for(int k=0; k<2; k++)
+   {
+      double target = prob[k]*n;
+      double cum = 0;
+      q[k] = fT.fMax;
+      for(std::vector<std::pair<Long64_t,double> >::const_iterator it=first; it!=fCounts.end() && it->first<(Long64_t)(cell+1)*nt2; ++it)
+      {
+         int tbin = it->first-(Long64_t)cell*nt2;
+         if(cum+it->second>=target)
+         {
+            if(tbin==0)
+               q[k] = fT.fMin;
+            else if(tbin>fT.fN)
+               q[k] = fT.fMax;
+            else
+               q[k] = fT.fMin + (tbin-1)*width + (target-cum)/it->second*width;
+            break;
+         }
+         cum += it->second;
+      }
+   }
+   return 0.5*(q[1]-q[0]);
+}
+
+void ResolutionMap2D::CopyTo(TH2* rms, TH2* width68) const
+{
+   for(int bx=1; bx<=fX.fN; bx++)
+      for(int by=1; by<=fY.fN; by++)
+      {
+         if(rms)
+            rms->SetBinContent(bx,by,GetRMS(bx,by));
+         if(width68)
+            width68->SetBinContent(bx,by,GetWidth68(bx,by));
+      }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+BatchCovariance::BatchCovariance(int n, double min, double max):
+fN(n),
+fMin(min),
+fMax(max),
+fEntries(0),
+fMean(n,0.),
+fComoment((size_t)n*n,0.)
+{}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchCovariance::FillN(int nrows, const float* x, int stride)
+{
+   //column c at x+c*stride; a row is used only if all its columns are in range, NaN excluded
+   fValid.assign(nrows,1.);
+   for(int c=0; c<fN; c++)
+   {
+      const float* xc = x+(size_t)c*stride;
+      for(int j=0; j<nrows; j++)
+         fValid[j] = (xc[j]>=fMin && xc[j]<fMax) ? fValid[j] : 0.;
+   }
+   double nvalid = 0;
+   for(int j=0; j<nrows; j++)
+      nvalid += fValid[j];
+   if(nvalid==0)
+      return;
+
+   fBatchMean.resize(fN);
+   fDev.resize((size_t)fN*nrows);
+   for(int c=0; c<fN; c++)
+   {
+      const float* xc = x+(size_t)c*stride;
+      double* dev = &fDev[(size_t)c*nrows];
+      double sum = 0;
+      for(int j=0; j<nrows; j++)
+         sum += fValid[j]>0 ? xc[j] : 0.;
+      fBatchMean[c] = sum/nvalid;
+      for(int j=0; j<nrows; j++)
+         dev[j] = fValid[j]>0 ? xc[j]-fBatchMean[c] : 0.;
+   }
+   fBatchComoment.resize((size_t)fN*fN);
+   for(int a=0; a<fN; a++)
+   {
+      const double* da = &fDev[(size_t)a*nrows];
+      for(int b=a; b<fN; b++)
+      {
+         const double* db = &fDev[(size_t)b*nrows];
+         double sum = 0;
+         for(int j=0; j<nrows; j++)
+            sum += da[j]*db[j];
+         fBatchComoment[a*fN+b] = fBatchComoment[b*fN+a] = sum;
+      }
+   }
+   Add(nvalid,&fBatchMean[0],&fBatchComoment[0]);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchCovariance::Add(double n, const double* mean, const double* comoment)
+{
+   if(n==0)
+      return;
+   double total = fEntries+n;
+   double f = fEntries*n/total;
+   fDelta.resize(fN);
+   for(int c=0; c<fN; c++)
+      fDelta[c] = mean[c]-fMean[c];
+   for(int a=0; a<fN; a++)
+      for(int b=0; b<fN; b++)
+         fComoment[a*fN+b] += comoment[a*fN+b] + fDelta[a]*fDelta[b]*f;
+   for(int c=0; c<fN; c++)
+      fMean[c] += fDelta[c]*n/total;
+   fEntries = total;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchCovariance::Merge(const BatchCovariance& other)
+{
+   Add(other.fEntries,&other.fMean[0],&other.fComoment[0]);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchCovariance::Reset()
+{
+   fEntries = 0;
+   std::fill(fMean.begin(),fMean.end(),0.);
+   std::fill(fComoment.begin(),fComoment.end(),0.);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool BatchCovariance::Identical(const BatchCovariance& other) const
+{
+   return SameBits(fMean,other.fMean) && SameBits(fComoment,other.fComoment) && memcmp(&fEntries,&other.fEntries,sizeof(fEntries))==0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchCovariance::Write(std::ostream& out) const
+{
+   WriteRaw(out,fN);
+   WriteRaw(out,fMin);
+   WriteRaw(out,fMax);
+   WriteRaw(out,fEntries);
+   WriteRaw(out,fMean);
+   WriteRaw(out,fComoment);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool BatchCovariance::Read(std::istream& in)
+{
+   return ReadRaw(in,fN) && ReadRaw(in,fMin) && ReadRaw(in,fMax) && ReadRaw(in,fEntries) && ReadRaw(in,fMean) && ReadRaw(in,fComoment);
+}
@@ -0,0 +1,362 @@
+#ifndef FASTHISTO_H
+#define FASTHISTO_H
+
+#include <vector>
+#include <map>
+#include <cstring>
+#include <iostream>
+
+#include "TH1F.h"
+#include "TProfile.h"
+#include "TProfile2D.h"
+#include "TH2.h"
+
+using namespace std;
+
+// Compact uniform-binning accumulators filled with whole arrays of values.
+// Bin indices are computed for the full batch in a vectorizable loop before the scatter,
+// there is no per-value virtual call. Bins 0 and n+1 are under/overflow, as in ROOT, and the
+// bin contents and statistics reproduce those of the equivalent sequence of TH1::Fill calls.
+// Accumulators of the same binning can be merged, the ROOT object is only produced by CopyTo.
+// The dense ones keep the list of their bins with entries: Reset and Merge only visit those,
+// a leaf of a reduction costs what its batch filled and not the whole binning.
+// Write and Read dump and restore the whole state in native binary form, for the checkpoints.
+
+template<class T> void WriteRaw(std::ostream& out, const T& value) {out.write((const char*)&value,sizeof(T));}
+template<class T> bool ReadRaw(std::istream& in, T& value) {return !!in.read((char*)&value,sizeof(T));}
+template<class T> void WriteRaw(std::ostream& out, const std::vector<T>& v)
+{
+   Long64_t n = v.size();
+   WriteRaw(out,n);
+   if(n>0)
+      out.write((const char*)&v[0],n*sizeof(T));
+}
+template<class T> bool ReadRaw(std::istream& in, std::vector<T>& v)
+{
+   Long64_t n;
+   if(!ReadRaw(in,n) || n<0)
+      return false;
+   v.resize(n);
+   return n==0 || !!in.read((char*)&v[0],n*sizeof(T));
+}
+
+class BatchAxis
+{
+   public:
+      int fN;
+      double fMin, fMax;
+
+      BatchAxis(int n=1, double min=0, double max=1) : fN(n), fMin(min), fMax(max) {};
+      void FindBins(int n, const float* x, int* bins) const;
+};
+
+
+class BatchHisto1D
+{
+   // Data
+   protected:
+      BatchAxis fX;
+      std::vector<double> fSumw;
+      double fStats[4];     // sumw, sumw2, sumwx, sumwx2
+      double fEntries;
+      std::vector<int> fBins;
+      std::vector<int> fTouched;   // bins with entries
+
+   // Methods
+   public:
+      BatchHisto1D(int nx=1, double xmin=0, double xmax=1);
+      BatchHisto1D(TH1* h);
+      void FillN(int n, const float* x);
+      void Merge(const BatchHisto1D& other);
+      void Reset();
+      void CopyTo(TH1* h) const;
+      double GetRMS() const;
+      double GetRMSRelError() const;
+      bool Identical(const BatchHisto1D& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+};
+
+
+class BatchProfile1D
+{
+   // Data
+   protected:
+      BatchAxis fX;
+      std::vector<double> fSumw, fSumwy, fSumwy2;
+      double fStats[6];     // sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2
+      double fEntries;
+      std::vector<int> fBins;
+      std::vector<int> fTouched;   // bins with entries
+
+   // Methods
+   public:
+      BatchProfile1D(int nx=1, double xmin=0, double xmax=1);
+      BatchProfile1D(TProfile* p);
+      void FillN(int n, const float* x, const float* y);
+      void Merge(const BatchProfile1D& other);
+      void Reset();
+      void CopyTo(TProfile* p) const;
+      bool Identical(const BatchProfile1D& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+};
+
+
+class BatchProfile2D
+{
+   // Data
+   protected:
+      BatchAxis fX, fY;
+      std::vector<double> fSumw, fSumwz, fSumwz2;
+      double fStats[9];     // sumw, sumw2, sumwx, sumwx2, sumwy, sumwy2, sumwxy, sumwz, sumwz2
+      double fEntries;
+      std::vector<int> fBins, fBinsY;
+      std::vector<int> fTouched;   // cells with entries
+
+   // Methods
+   public:
+      BatchProfile2D(int nx=1, double xmin=0, double xmax=1, int ny=1, double ymin=0, double ymax=1);
+      BatchProfile2D(TProfile2D* p);
+      void FillN(int n, const float* x, const float* y, const float* z);
+      void Merge(const BatchProfile2D& other);
+      void Reset();
+      void CopyTo(TProfile2D* p) const;
+      bool Identical(const BatchProfile2D& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+};
+
+
+
+// Time profile in three dimensions (e.g. amplitude and impact point) that only stores the
+// cells with entries, sorted by global bin. Smooth() averages each cell with its neighbours,
+// weighted by their entries and by (1/2,1,1/2) along each axis, so that sparsely populated
+// cells borrow the statistics of the surrounding ones; Eval then returns the smoothed mean of
+// the cell. The scratch keeps its capacity: refilling an accumulator does not allocate.
+class SparseProfile3D
+{
+   public:
+      struct Cell
+      {
+         double sumw, sumwt, sumwt2;
+         Cell() : sumw(0), sumwt(0), sumwt2(0) {};
+      };
+
+   // Data
+   protected:
+      BatchAxis fX, fY, fZ;
+      std::vector<std::pair<Long64_t,Cell> > fCells;    // global bin (biny*(nx+2)+binx)+binz*(nx+2)*(ny+2), sorted
+      std::vector<std::pair<Long64_t,double> > fSmoothed;
+      std::vector<int> fBinsX, fBinsY, fBinsZ;
+      std::vector<std::pair<Long64_t,int> > fOrder;     // (bin, event) of the batch being filled
+      std::vector<std::pair<Long64_t,Cell> > fBatch, fMerged;
+      double fEntries;
+
+   // Methods
+   public:
+      SparseProfile3D(int nx=1, double xmin=0, double xmax=1, int ny=1, double ymin=0, double ymax=1, int nz=1, double zmin=0, double zmax=1);
+      void FillN(int n, const float* x, const float* y, const float* z, const float* t);
+      void Merge(const SparseProfile3D& other);
+      void Reset();
+      bool Identical(const SparseProfile3D& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+      void Smooth();
+      void Eval(int n, const float* x, const float* y, const float* z, float* out, std::vector<int>& bins) const;
+      int GetNCells() const {return fCells.size();};
+      double GetEntries() const {return fEntries;};
+
+   protected:
+      Long64_t GetBin(int binx, int biny, int binz) const {return binx + (fX.fN+2)*(biny + (Long64_t)(fY.fN+2)*binz);};
+      void MergeCells(const std::vector<std::pair<Long64_t,Cell> >& cells);
+      const Cell* FindCell(Long64_t bin) const;
+};
+
+
+// Time resolution in the cells of a 2D map (e.g. the impact point), filled in one pass.
+// Each cell keeps count, sum and sum of squares of the time, for mean and variance, and a
+// sparse histogram of the time in the bins of tbins: only the populated (cell,time bin) pairs,
+// sorted, so that memory follows the data and not cells x bins. The half width of the central
+// 68% interval is interpolated from it. Counts are exact, merging in any order gives the same
+// sketch; the moments are reproducible under a fixed merge order.
+class ResolutionMap2D
+{
+   // Data
+   protected:
+      BatchAxis fX, fY, fT;
+      std::vector<double> fSumw, fSumt, fSumt2;                   // per cell, biny*(nx+2)+binx
+      std::vector<int> fTouched;                                  // cells with entries
+      std::vector<std::pair<Long64_t,double> > fCounts;           // (cell*(nt+2)+tbin, entries), sorted
+      std::vector<int> fBinsX, fBinsY, fBinsT;
+      std::vector<Long64_t> fKeys;
+      std::vector<std::pair<Long64_t,double> > fBatch, fMerged;
+
+   // Methods
+   public:
+      ResolutionMap2D(int nx=1, double xmin=0, double xmax=1, int ny=1, double ymin=0, double ymax=1, int nt=1, double tmin=0, double tmax=1);
+      void FillN(int n, const float* x, const float* y, const float* t);
+      void Merge(const ResolutionMap2D& other);
+      void Reset();
+      bool Identical(const ResolutionMap2D& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+      double GetEntries(int binx, int biny) const {return fSumw[biny*(fX.fN+2)+binx];};
+      double GetMean(int binx, int biny) const;
+      double GetRMS(int binx, int biny) const;
+      double GetWidth68(int binx, int biny) const;
+      void CopyTo(TH2* rms, TH2* width68) const;
+      int GetNCounts() const {return fCounts.size();};
+
+   protected:
+      void MergeCounts(const std::vector<std::pair<Long64_t,double> >& counts);
+};
+
+
+// Means and covariance matrix of n columns (e.g. the times of all the thresholds), filled with
+// the rows of a batch where every column is in [min,max). Each batch is centered on its own
+// means and added with the pairwise update of Chan et al., accurate also for columns with a
+// large offset; the products run along the contiguous rows of the batch.
+class BatchCovariance
+{
+   // Data
+   protected:
+      int fN;
+      double fMin, fMax;
+      double fEntries;
+      std::vector<double> fMean;                       // n
+      std::vector<double> fComoment;                   // n*n, sums of the products of the deviations
+      std::vector<double> fValid, fDev;                // scratch of the batch: rows used, deviations
+      std::vector<double> fBatchMean, fBatchComoment, fDelta;
+
+   // Methods
+   public:
+      BatchCovariance(int n=1, double min=-1e30, double max=1e30);
+      void FillN(int nrows, const float* x, int stride);
+      void Merge(const BatchCovariance& other);
+      void Reset();
+      bool Identical(const BatchCovariance& other) const;
+      void Write(std::ostream& out) const;
+      bool Read(std::istream& in);
+      int GetN() const {return fN;};
+      double GetEntries() const {return fEntries;};
+      double GetMean(int a) const {return fMean[a];};
+      double GetCovariance(int a, int b) const {return fEntries>1 ? fComoment[a*fN+b]/(fEntries-1) : 0;};
+
+   protected:
+      void Add(double n, const double* mean, const double* comoment);
+};
+
+
+// Sum of a sequence of accumulators (anything with Merge and Reset) in a fixed binary tree.
+// Leaves are pushed in sequence order and each one is always merged with the same partners,
+// as in a pairwise sum of the whole sequence: the result is bitwise reproducible whatever
+// the number of threads that filled the leaves.
+template<class T> class OrderedReduction
+{
+   // Data
+   protected:
+      std::vector<T> fNodes;      // the first fSize are the open subtrees, the others are kept
+      std::vector<int> fLevels;   // for reuse; each node sums 2^level leaves
+      int fSize;
+
+   // Methods
+   public:
+      OrderedReduction() : fSize(0) {};
+      void Write(std::ostream& out) const
+      {
+         //the open subtrees: a reduction read back continues exactly as this one
+         WriteRaw(out,fSize);
+         for(int k=0; k<fSize; k++)
+         {
+            WriteRaw(out,fLevels[k]);
+            fNodes[k].Write(out);
+         }
+      };
+      bool Read(std::istream& in, const T& empty)
+      {
+         if(!ReadRaw(in,fSize) || fSize<0)
+            return false;
+         fNodes.assign(fSize,empty);
+         fLevels.assign(fSize,0);
+         for(int k=0; k<fSize; k++)
+            if(!ReadRaw(in,fLevels[k]) || !fNodes[k].Read(in))
+               return false;
+         return true;
+      };
+      void Reserve(Long64_t nleaves, const T& leaf)
+      {
+         //the open subtrees of nleaves leaves are at most the bits of nleaves, plus the node
+         //Take swaps in: made now as reset copies of a filled leaf, with its scratch, merging
+         //those leaves never copies a leaf into a new node and a node swapped into a leaf
+         //fills it without growing
+         int nnodes = 2;
+         while(nleaves>1)
+         {
+            nleaves >>= 1;
+            nnodes++;
+         }
+         while((int)fNodes.size()<nnodes)
+         {
+            fNodes.push_back(leaf);
+            fNodes.back().Reset();
+            fLevels.push_back(0);
+         }
+      };
+      void Push(const T& leaf)
+      {
+         //assigned to a node kept from before when possible: its buffers are reused
+         if(fSize<(int)fNodes.size())
+            fNodes[fSize] = leaf;
+         else
+         {
+            fNodes.push_back(leaf);
+            fLevels.push_back(0);
+         }
+         fLevels[fSize] = 0;
+         fSize++;
+         Close();
+      };
+      void Take(T& leaf)
+      {
+         //as Push, but the leaf is swapped with a node kept from before: leaf is left with
+         //unspecified content and the buffers of both are reused without allocating
+         if(fSize<(int)fNodes.size())
+         {
+            std::swap(fNodes[fSize],leaf);
+            fLevels[fSize] = 0;
+            fSize++;
+            Close();
+         }
+         else
+            Push(leaf);
+      };
+      T Result(const T& empty) const
+      {
+         //the incomplete subtrees are folded from the right
+         if(fSize==0)
+            return empty;
+         T res = fNodes[fSize-1];
+         for(int k=fSize-2; k>=0; k--)
+         {
+            T node = fNodes[k];
+            node.Merge(res);
+            res = node;
+         }
+         return res;
+      };
+
+   protected:
+      void Close()
+      {
+         //close the complete subtrees, as the carries of a binary counter
+         while(fSize>=2 && fLevels[fSize-1]==fLevels[fSize-2])
+         {
+            fNodes[fSize-2].Merge(fNodes[fSize-1]);
+            fSize--;
+            fLevels[fSize-1]++;
+         }
+      };
+};
+
+#endif  // FASTHISTO_H
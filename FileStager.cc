@@ -0,0 +1,232 @@
+#include "FileStager.hh"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "TSystem.h"
+
+using namespace std;
+
+//---------------------------------------------------------------------------------------------------------------
+// name of the local copy: a hash of the path, then size and mtime, then the file name
+static std::string LocalName(const IndexedFile& file)
+{
+   unsigned long long hash = 14695981039346656037ULL;   //FNV-1a, the same in every run
+   for(unsigned k=0; k<file.path.size(); k++)
+      hash = (hash^(unsigned char)file.path[k])*1099511628211ULL;
+   std::ostringstream name;
+   name<<std::hex<<hash<<std::dec<<"_"<<file.size<<"_"<<file.mtime<<"_"<<file.path.substr(file.path.find_last_of('/')+1);
+   return name.str();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+FileStager::FileStager(const std::string& dir, Long64_t budget, int ahead):
+fDir(dir),
+fBudget(budget),
+fAhead(max(ahead,1)),
+fStop(false),
+fHits(0),
+fMisses(0)
+{
+   gSystem->mkdir(fDir.c_str(),true);
+   fWorker = std::thread(&FileStager::Work,this);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+FileStager::~FileStager()
+{
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+   }
+   fCond.notify_all();
+   fWorker.join();
+   if(fHits+fMisses>0)
+      cout<<">> Staging: "<<fHits<<" files read from "<<fDir<<", "<<fMisses<<" from their original location"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void FileStager::Attach(const ChainIndex& index)
+{
+   //the copies left by the previous runs are used as they are
+   std::lock_guard<std::mutex> lock(fMutex);
+   fFiles.clear();
+   fQueue.clear();
+   int staged = 0;
+   for(int f=0; f<index.GetNFiles(); f++)
+   {
+      StagedFile file;
+      file.path = index.GetFile(f).path;
+      file.local = fDir+"/"+LocalName(index.GetFile(f));
+      file.size = index.GetFile(f).size;
+      struct stat st;
+      file.state = (stat(file.local.c_str(),&st)==0 && st.st_size==file.size) ? kStaged : kRemote;
+      staged += (file.state==kStaged);
+      fFiles.push_back(file);
+   }
+   cout<<">> Staging: "<<staged<<" of "<<fFiles.size()<<" files already in "<<fDir<<endl;
+   for(int f=0; f<fAhead; f++)
+      Enqueue(f);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void FileStager::Enqueue(int ifile)
+{
+   //called with the lock held
+   if(ifile<0 || ifile>=(int)fFiles.size() || fFiles[ifile].state!=kRemote)
+      return;
+   fFiles[ifile].state = kQueued;
+   fQueue.push_back(ifile);
+   fCond.notify_all();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+std::string FileStager::Acquire(int ifile)
+{
+   //path to open for file ifile, its local copy if there is one, empty otherwise
+   std::lock_guard<std::mutex> lock(fMutex);
+   for(int f=ifile+1; f<=ifile+fAhead; f++)
+      Enqueue(f);
+   StagedFile& file = fFiles[ifile];
+   //waiting for a copy, started or not, would delay the reading: the file is read where it is
+   //and its copy, completed in the background or queued after the next ones, serves the
+   //following passes and runs
+   Enqueue(ifile);
+   if(file.state!=kStaged)
+   {
+      fMisses++;
+      return "";
+   }
+   //the modification time orders the copies for the eviction
+   utime(file.local.c_str(),0);
+   fHits++;
+   return file.local;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void FileStager::Work()
+{
+   std::unique_lock<std::mutex> lock(fMutex);
+   while(true)
+   {
+      while(!fStop && fQueue.empty())
+         fCond.wait(lock);
+      if(fStop)
+         return;
+      int ifile = fQueue.front();
+      fQueue.pop_front();
+      StagedFile file = fFiles[ifile];
+      if(!MakeRoom(file.size))
+      {
+         fFiles[ifile].state = kFailed;
+         fCond.notify_all();
+         continue;
+      }
+      fFiles[ifile].state = kCopying;
+      lock.unlock();
+      bool ok = Copy(file);
+      lock.lock();
+      fFiles[ifile].state = ok ? kStaged : kFailed;
+      fCond.notify_all();
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool FileStager::MakeRoom(Long64_t bytes)
+{
+   //called with the lock held: evicts the least recently used copies of other runs until
+   //bytes more fit in the budget
+   if(bytes>fBudget)
+      return false;
+   std::vector<std::string> ours;
+   for(unsigned f=0; f<fFiles.size(); f++)
+      if(fFiles[f].state==kStaged || fFiles[f].state==kCopying)
+         ours.push_back(fFiles[f].local);
+   std::sort(ours.begin(),ours.end());
+
+   std::vector<std::pair<time_t,std::pair<std::string,Long64_t> > > others;
+   Long64_t total = 0;
+   DIR* dir = opendir(fDir.c_str());
+   if(!dir)
+      return false;
+   while(struct dirent* entry = readdir(dir))
+   {
+      std::string path = fDir+"/"+entry->d_name;
+      struct stat st;
+      if(stat(path.c_str(),&st)!=0 || !S_ISREG(st.st_mode))
+         continue;
+      total += st.st_size;
+      if(!std::binary_search(ours.begin(),ours.end(),path))
+         others.push_back(std::make_pair(st.st_mtime,std::make_pair(path,(Long64_t)st.st_size)));
+   }
+   closedir(dir);
+   std::sort(others.begin(),others.end());
+   for(unsigned k=0; k<others.size() && total+bytes>fBudget; k++)
+      if(unlink(others[k].second.first.c_str())==0)
+         total -= others[k].second.second;
+   return total+bytes<=fBudget;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool FileStager::Copy(const StagedFile& file)
+{
+   //written under a temporary name and renamed at the end: a copy is complete or absent,
+   //also for the concurrent runs sharing the directory
+   std::string tmpname = file.local+".part"+std::to_string(getpid());
+   int in = open(file.path.c_str(),O_RDONLY);
+   if(in<0)
+   {
+      cerr<<"[WARNING]: cannot stage "<<file.path<<endl;
+      return false;
+   }
+   int out = open(tmpname.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+   if(out<0)
+   {
+      close(in);
+      cerr<<"[WARNING]: cannot write to "<<fDir<<", "<<file.path<<" is not staged"<<endl;
+      return false;
+   }
+   std::vector<char> buffer(4<<20);
+   Long64_t copied = 0;
+   bool ok = true;
+   while(ok)
+   {
+      {
+         std::lock_guard<std::mutex> lock(fMutex);
+         if(fStop)
+         {
+            ok = false;
+            break;
+         }
+      }
+      ssize_t n = read(in,buffer.data(),buffer.size());
+      if(n==0)
+         break;
+      ok = (n>0 && write(out,buffer.data(),n)==n);
+      copied += max(n,(ssize_t)0);
+   }
+   close(in);
+   ok = (close(out)==0) && ok && copied==file.size;
+   if(!ok || rename(tmpname.c_str(),file.local.c_str())!=0)
+   {
+      unlink(tmpname.c_str());
+      return false;
+   }
+   return true;
+}
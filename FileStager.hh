@@ -0,0 +1,59 @@
+#ifndef FILESTAGER_H
+#define FILESTAGER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ChainIndex.hh"
+
+using namespace std;
+
+// Local copies of the input files of a chain, made by a background thread a few files ahead of
+// the one being read. The copies live in a cache directory shared by the runs, named after path,
+// size and mtime of the original, and are evicted least recently used first when the cache
+// exceeds its budget; the files of the current run are never evicted. A file whose copy is
+// not complete is read from its original location, the reading never waits for a copy.
+class FileStager
+{
+   protected:
+      enum State {kRemote, kQueued, kCopying, kStaged, kFailed};
+      struct StagedFile
+      {
+         std::string path;
+         std::string local;
+         Long64_t size;
+         State state;
+      };
+
+   // Data
+   protected:
+      std::string fDir;
+      Long64_t fBudget;              // bytes of the cache directory
+      int fAhead;                    // files copied ahead of the one being read
+      std::vector<StagedFile> fFiles;
+      std::deque<int> fQueue;
+      std::mutex fMutex;
+      std::condition_variable fCond;
+      std::thread fWorker;
+      bool fStop;
+      int fHits, fMisses;
+
+   // Methods
+   public:
+      FileStager(const std::string& dir, Long64_t budget, int ahead=2);
+      ~FileStager();
+      void Attach(const ChainIndex& index);
+      std::string Acquire(int ifile);
+
+   protected:
+      void Enqueue(int ifile);
+      void Work();
+      bool Copy(const StagedFile& file);
+      bool MakeRoom(Long64_t bytes);
+};
+
+#endif  // FILESTAGER_H
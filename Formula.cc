@@ -0,0 +1,569 @@
+#include "Formula.hh"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+using namespace std;
+
+static const int kMaxStack = 64;
+
+static const char* Func1Names[] = {"sqrt","exp","log","log10","sin","cos","tan","asin","acos","atan","abs","floor","ceil","round",0};
+static const char* Func2Names[] = {"atan2","pow","min","max","fmod",0};
+
+static int FindName(const char** names, const std::string& name)
+{
+   for(int i=0; names[i]; i++)
+      if(name==names[i])
+         return i;
+   return -1;
+}
+
+static void SkipSpaces(const char*& p)
+{
+   while(*p && isspace(*p))
+      p++;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+Formula::Formula(const std::string& expr):
+fExpr(expr),
+fMaxDepth(0)
+{
+   const char* p = fExpr.c_str();
+   ParseOr(p);
+   SkipSpaces(p);
+   if(*p)
+      throw parse_error(fExpr,string("unexpected '")+p+"'");
+
+   //stack depth needed by the program
+   int depth = 0;
+   for(unsigned i=0; i<fProgram.size(); i++)
+   {
+      int code = fProgram[i].code;
+      if(code==kConst || code==kVar)
+         depth++;
+      else if(code!=kNeg && code!=kNot && code!=kFunc1)
+         depth--;
+      if(depth>fMaxDepth)
+         fMaxDepth = depth;
+   }
+   if(fMaxDepth>kMaxStack)
+      throw parse_error(fExpr,"expression too deeply nested");
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Formula::Emit(int code, int arg, double value)
+{
+   Op op;
+   op.code = code;
+   op.arg = arg;
+   op.value = value;
+   fProgram.push_back(op);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Formula::ParseOr(const char*& p)
+{
+   ParseAnd(p);
+   SkipSpaces(p);
+   while(p[0]=='|' && p[1]=='|')
+   {
+      p += 2;
+      ParseAnd(p);
+      Emit(kOr);
+      SkipSpaces(p);
+   }
+}
+
+void Formula::ParseAnd(const char*& p)
+{
+   ParseCompare(p);
+   SkipSpaces(p);
+   while(p[0]=='&' && p[1]=='&')
+   {
+      p += 2;
+      ParseCompare(p);
+      Emit(kAnd);
+      SkipSpaces(p);
+   }
+}
+
+void Formula::ParseCompare(const char*& p)
+{
+   ParseSum(p);
+   SkipSpaces(p);
+   while(true)
+   {
+      int code;
+      if(p[0]=='<' && p[1]=='=') {code = kLE; p += 2;}
+      else if(p[0]=='>' && p[1]=='=') {code = kGE; p += 2;}
+      else if(p[0]=='=' && p[1]=='=') {code = kEQ; p += 2;}
+      else if(p[0]=='!' && p[1]=='=') {code = kNE; p += 2;}
+      else if(p[0]=='<') {code = kLT; p++;}
+      else if(p[0]=='>') {code = kGT; p++;}
+      else break;
+      ParseSum(p);
+      Emit(code);
+      SkipSpaces(p);
+   }
+}
+
+void Formula::ParseSum(const char*& p)
+{
+   ParseProduct(p);
+   SkipSpaces(p);
+   while(*p=='+' || *p=='-')
+   {
+      int code = (*p=='+') ? kAdd : kSub;
+      p++;
+      ParseProduct(p);
+      Emit(code);
+      SkipSpaces(p);
+   }
+}
+
+void Formula::ParseProduct(const char*& p)
+{
+   ParseUnary(p);
+   SkipSpaces(p);
+   while((*p=='*' && p[1]!='*') || *p=='/')
+   {
+      int code = (*p=='*') ? kMul : kDiv;
+      p++;
+      ParseUnary(p);
+      Emit(code);
+      SkipSpaces(p);
+   }
+}
+
+void Formula::ParseUnary(const char*& p)
+{
+   SkipSpaces(p);
+   if(*p=='-')
+   {
+      p++;
+      ParseUnary(p);
+      Emit(kNeg);
+   }
+   else if(*p=='+')
+   {
+      p++;
+      ParseUnary(p);
+   }
+   else if(*p=='!' && p[1]!='=')
+   {
+      p++;
+      ParseUnary(p);
+      Emit(kNot);
+   }
+   else
+      ParsePower(p);
+}
+
+void Formula::ParsePower(const char*& p)
+{
+   ParsePrimary(p);
+   SkipSpaces(p);
+   if(*p=='^' || (p[0]=='*' && p[1]=='*'))
+   {
+      p += (*p=='^') ? 1 : 2;
+      ParseUnary(p);   //right associative, allows 2^-1
+      Emit(kPow);
+   }
+}
+
+void Formula::ParsePrimary(const char*& p)
+{
+   SkipSpaces(p);
+   if(*p=='(')
+   {
+      p++;
+      ParseOr(p);
+      SkipSpaces(p);
+      if(*p!=')')
+         throw parse_error(fExpr,"missing ')'");
+      p++;
+      return;
+   }
+
+   if(isdigit(*p) || *p=='.')
+   {
+      char* end;
+      double value = strtod(p,&end);
+      if(end==p)
+         throw parse_error(fExpr,string("bad number at '")+p+"'");
+      p = end;
+      Emit(kConst,0,value);
+      return;
+   }
+
+   if(*p=='$')
+      p++;
+   if(!(isalpha(*p) || *p=='_'))
+      throw parse_error(fExpr,*p ? string("unexpected '")+p+"'" : string("unexpected end of expression"));
+   const char* begin = p;
+   while(isalnum(*p) || *p=='_')
+      p++;
+   std::string name(begin,p-begin);
+   SkipSpaces(p);
+
+   if(*p=='(')
+   {
+      p++;
+      int f1 = FindName(Func1Names,name);
+      int f2 = FindName(Func2Names,name);
+      if(f1<0 && f2<0)
+         throw parse_error(fExpr,"unknown function "+name);
+      ParseOr(p);
+      SkipSpaces(p);
+      if(f2>=0)
+      {
+         if(*p!=',')
+            throw parse_error(fExpr,name+" needs two arguments");
+         p++;
+         ParseOr(p);
+         SkipSpaces(p);
+      }
+      if(*p!=')')
+         throw parse_error(fExpr,"missing ')' after arguments of "+name);
+      p++;
+      if(f2>=0)
+         Emit(kFunc2,f2);
+      else
+         Emit(kFunc1,f1);
+      return;
+   }
+
+   if(name=="pi")
+   {
+      Emit(kConst,0,M_PI);
+      return;
+   }
+   int ivar = -1;
+   for(unsigned i=0; i<fVars.size(); i++)
+      if(fVars[i]==name)
+         ivar = i;
+   if(ivar<0)
+   {
+      fVars.push_back(name);
+      ivar = fVars.size()-1;
+   }
+   Emit(kVar,ivar);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+double Formula::Apply1(int func, double x)
+{
+   switch(func)
+   {
+      case 0: return sqrt(x);
+      case 1: return exp(x);
+      case 2: return log(x);
+      case 3: return log10(x);
+      case 4: return sin(x);
+      case 5: return cos(x);
+      case 6: return tan(x);
+      case 7: return asin(x);
+      case 8: return acos(x);
+      case 9: return atan(x);
+      case 10: return fabs(x);
+      case 11: return floor(x);
+      case 12: return ceil(x);
+      case 13: return round(x);
+   }
+   return 0;
+}
+
+double Formula::Apply2(int func, double x, double y)
+{
+   switch(func)
+   {
+      case 0: return atan2(x,y);
+      case 1: return pow(x,y);
+      case 2: return x<y ? x : y;
+      case 3: return x>y ? x : y;
+      case 4: return fmod(x,y);
+   }
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+double Formula::Eval(const double* vars) const
+{
+   double stack[kMaxStack];
+   int top = -1;
+   for(unsigned i=0; i<fProgram.size(); i++)
+   {
+      const Op& op = fProgram[i];
+      switch(op.code)
+      {
+         case kConst: stack[++top] = op.value; break;
+         case kVar: stack[++top] = vars[op.arg]; break;
+         case kNeg: stack[top] = -stack[top]; break;
+         case kNot: stack[top] = !stack[top]; break;
+         case kFunc1: stack[top] = Apply1(op.arg,stack[top]); break;
+         case kFunc2: top--; stack[top] = Apply2(op.arg,stack[top],stack[top+1]); break;
+         default:
+         {
+            top--;
+            double& a = stack[top];
+            double b = stack[top+1];
+            switch(op.code)
+            {
+               case kAdd: a = a+b; break;
+               case kSub: a = a-b; break;
+               case kMul: a = a*b; break;
+               case kDiv: a = a/b; break;
+               case kPow: a = pow(a,b); break;
+               case kLT: a = a<b; break;
+               case kLE: a = a<=b; break;
+               case kGT: a = a>b; break;
+               case kGE: a = a>=b; break;
+               case kEQ: a = a==b; break;
+               case kNE: a = a!=b; break;
+               case kAnd: a = (a && b); break;
+               case kOr: a = (a || b); break;
+            }
+         }
+      }
+   }
+   return stack[0];
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void Formula::EvalN(int n, const float* const* vars, float* out, std::vector<double>& columns) const
+{
+   //same program as Eval, each instruction applied to whole columns of n values
+   if((int)columns.size()<fMaxDepth*n)
+      columns.resize(fMaxDepth*n);
+   double* stack = columns.empty() ? 0 : &columns[0];
+   int top = -1;
+   for(unsigned i=0; i<fProgram.size(); i++)
+   {
+      const Op& op = fProgram[i];
+      if(op.code==kConst || op.code==kVar)
+         top++;
+      double* a = stack + top*n;
+      switch(op.code)
+      {
+         case kConst: for(int j=0; j<n; j++) a[j] = op.value; break;
+         case kVar:
+         {
+            const float* v = vars[op.arg];
+            for(int j=0; j<n; j++) a[j] = v[j];
+            break;
+         }
+         case kNeg: for(int j=0; j<n; j++) a[j] = -a[j]; break;
+         case kNot: for(int j=0; j<n; j++) a[j] = !a[j]; break;
+         case kFunc1: for(int j=0; j<n; j++) a[j] = Apply1(op.arg,a[j]); break;
+         default:
+         {
+            top--;
+            a = stack + top*n;
+            const double* b = a + n;
+            switch(op.code)
+            {
+               case kFunc2: for(int j=0; j<n; j++) a[j] = Apply2(op.arg,a[j],b[j]); break;
+               case kAdd: for(int j=0; j<n; j++) a[j] = a[j]+b[j]; break;
+               case kSub: for(int j=0; j<n; j++) a[j] = a[j]-b[j]; break;
+               case kMul: for(int j=0; j<n; j++) a[j] = a[j]*b[j]; break;
+               case kDiv: for(int j=0; j<n; j++) a[j] = a[j]/b[j]; break;
+               case kPow: for(int j=0; j<n; j++) a[j] = pow(a[j],b[j]); break;
+               case kLT: for(int j=0; j<n; j++) a[j] = a[j]<b[j]; break;
+               case kLE: for(int j=0; j<n; j++) a[j] = a[j]<=b[j]; break;
+               case kGT: for(int j=0; j<n; j++) a[j] = a[j]>b[j]; break;
+               case kGE: for(int j=0; j<n; j++) a[j] = a[j]>=b[j]; break;
+               case kEQ: for(int j=0; j<n; j++) a[j] = a[j]==b[j]; break;
+               case kNE: for(int j=0; j<n; j++) a[j] = a[j]!=b[j]; break;
+               case kAnd: for(int j=0; j<n; j++) a[j] = (a[j] && b[j]); break;
+               case kOr: for(int j=0; j<n; j++) a[j] = (a[j] || b[j]); break;
+            }
+         }
+      }
+   }
+   for(int j=0; j<n; j++)
+      out[j] = stack[j];
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+// interval [lo,hi]; anything not representable (NaN) becomes the whole real line
+static void Widen(double& lo, double& hi)
+{
+   if(lo!=lo || hi!=hi)
+   {
+      lo = -HUGE_VAL;
+      hi = HUGE_VAL;
+   }
+}
+
+// truth value of an interval: 1 if it excludes 0, 0 if it is exactly 0, -1 if unknown
+static int Truth(double lo, double hi)
+{
+   if(lo==0 && hi==0)
+      return 0;
+   if(lo>0 || hi<0)
+      return 1;
+   return -1;
+}
+
+static void SetTruth(int truth, double& lo, double& hi)
+{
+   lo = truth==1 ? 1 : 0;
+   hi = truth==0 ? 0 : 1;
+}
+
+// x^k over [lo,hi] for a constant k: exact for an integer k or for x>=0, unbounded otherwise
+// or if a negative power has a pole in the interval
+static void PowRange(double k, double& lo, double& hi)
+{
+   bool zero = lo<=0 && hi>=0;
+   if((k!=floor(k) && lo<0) || (k<0 && zero))
+   {
+      lo = -HUGE_VAL;
+      hi = HUGE_VAL;
+      return;
+   }
+   //monotone on each side of 0: the bounds are at the ends, or 0 for an even power across it
+   double a = pow(lo,k), b = pow(hi,k);
+   lo = min(a,b);
+   hi = max(a,b);
+   if(zero && k>0 && fmod(k,2)==0)
+      lo = 0;
+}
+
+// function func of Apply1 over [lo,hi]: bounded where it is monotone, unbounded otherwise or
+// where some points have no value (e.g. sqrt of a negative number)
+static void Func1Range(int func, double& lo, double& hi)
+{
+   switch(func)
+   {
+      case 0: case 2: case 3:    //sqrt log log10, increasing for x>=0
+         if(lo>=0)
+         {
+            lo = Formula::Apply1(func,lo);
+            hi = Formula::Apply1(func,hi);
+            return;
+         }
+         break;
+      case 1: case 9: case 11: case 12: case 13:   //exp atan floor ceil round, increasing
+         lo = Formula::Apply1(func,lo);
+         hi = Formula::Apply1(func,hi);
+         return;
+      case 10:                   //abs, decreasing then increasing
+      {
+         double a = fabs(lo), b = fabs(hi);
+         bool zero = lo<=0 && hi>=0;
+         lo = zero ? 0 : min(a,b);
+         hi = max(a,b);
+         return;
+      }
+   }
+   lo = -HUGE_VAL;
+   hi = HUGE_VAL;
+}
+
+void Formula::EvalRange(const double* lo, const double* hi, double& outlo, double& outhi) const
+{
+   //same program as Eval on intervals: the result contains the value of every point of the box;
+   //monotone functions, min, max and integer powers are bounded, the others left unbounded
+   double stlo[kMaxStack], sthi[kMaxStack];
+   int top = -1;
+   for(unsigned i=0; i<fProgram.size(); i++)
+   {
+      const Op& op = fProgram[i];
+      switch(op.code)
+      {
+         case kConst: top++; stlo[top] = sthi[top] = op.value; break;
+         case kVar: top++; stlo[top] = lo[op.arg]; sthi[top] = hi[op.arg]; break;
+         case kNeg: {double l = stlo[top]; stlo[top] = -sthi[top]; sthi[top] = -l; break;}
+         case kNot: {int t = Truth(stlo[top],sthi[top]); SetTruth(t<0 ? -1 : !t,stlo[top],sthi[top]); break;}
+         case kFunc1:
+            if(stlo[top]==sthi[top])
+               stlo[top] = sthi[top] = Apply1(op.arg,stlo[top]);
+            else
+               Func1Range(op.arg,stlo[top],sthi[top]);
+            break;
+         default:
+         {
+            top--;
+            double& alo = stlo[top];
+            double& ahi = sthi[top];
+            double blo = stlo[top+1], bhi = sthi[top+1];
+            bool points = (alo==ahi && blo==bhi);
+            switch(op.code)
+            {
+               case kAdd: alo += blo; ahi += bhi; break;
+               case kSub: alo -= bhi; ahi -= blo; break;
+               case kMul:
+               {
+                  double p[4] = {alo*blo, alo*bhi, ahi*blo, ahi*bhi};
+                  alo = *std::min_element(p,p+4);
+                  ahi = *std::max_element(p,p+4);
+                  break;
+               }
+               case kDiv:
+                  if(blo<=0 && bhi>=0)
+                  {
+                     alo = -HUGE_VAL;
+                     ahi = HUGE_VAL;
+                  }
+                  else
+                  {
+                     double p[4] = {alo/blo, alo/bhi, ahi/blo, ahi/bhi};
+                     alo = *std::min_element(p,p+4);
+                     ahi = *std::max_element(p,p+4);
+                  }
+                  break;
+               case kPow: case kFunc2:
+                  if(points)
+                     alo = ahi = (op.code==kPow ? pow(alo,blo) : Apply2(op.arg,alo,blo));
+                  else if((op.code==kPow || op.arg==1) && blo==bhi)
+                     PowRange(blo,alo,ahi);
+                  else if(op.code==kFunc2 && (op.arg==2 || op.arg==3))
+                  {
+                     //min and max are increasing in both arguments
+                     alo = op.arg==2 ? min(alo,blo) : max(alo,blo);
+                     ahi = op.arg==2 ? min(ahi,bhi) : max(ahi,bhi);
+                  }
+                  else
+                  {
+                     alo = -HUGE_VAL;
+                     ahi = HUGE_VAL;
+                  }
+                  break;
+               case kLT: SetTruth(ahi<blo ? 1 : (alo>=bhi ? 0 : -1),alo,ahi); break;
+               case kLE: SetTruth(ahi<=blo ? 1 : (alo>bhi ? 0 : -1),alo,ahi); break;
+               case kGT: SetTruth(alo>bhi ? 1 : (ahi<=blo ? 0 : -1),alo,ahi); break;
+               case kGE: SetTruth(alo>=bhi ? 1 : (ahi<blo ? 0 : -1),alo,ahi); break;
+               case kEQ: SetTruth(points && alo==blo ? 1 : (ahi<blo || alo>bhi ? 0 : -1),alo,ahi); break;
+               case kNE: SetTruth(points && alo==blo ? 0 : (ahi<blo || alo>bhi ? 1 : -1),alo,ahi); break;
+               case kAnd:
+               {
+                  int ta = Truth(alo,ahi), tb = Truth(blo,bhi);
+                  SetTruth(ta==0 || tb==0 ? 0 : (ta==1 && tb==1 ? 1 : -1),alo,ahi);
+                  break;
+               }
+               case kOr:
+               {
+                  int ta = Truth(alo,ahi), tb = Truth(blo,bhi);
+                  SetTruth(ta==1 || tb==1 ? 1 : (ta==0 && tb==0 ? 0 : -1),alo,ahi);
+                  break;
+               }
+            }
+         }
+      }
+      Widen(stlo[top],sthi[top]);
+   }
+   outlo = stlo[0];
+   outhi = sthi[0];
+}
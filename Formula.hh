@@ -0,0 +1,67 @@
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Arithmetic expression compiled once into a small stack program.
+// Supports + - * / ^ (or **), comparisons, && || !, parentheses, numbers and the usual
+// math functions (sqrt exp log log10 sin cos tan asin acos atan atan2 abs pow min max floor ceil).
+// Identifiers, optionally prefixed by '$', are variables: they are numbered in order of first
+// appearance and their values are passed to Eval in that order. EvalN evaluates the program
+// on whole columns at once, one instruction at a time, in a stack given by the caller: the
+// threads sharing a formula each pass their own. EvalRange bounds the value over a box of
+// variables (interval arithmetic, with monotone functions and integer powers bounded exactly),
+// e.g. to tell that a cut fails for all the events of a block.
+class Formula
+{
+   public:
+      enum OpCode {kConst, kVar, kNeg, kNot, kAdd, kSub, kMul, kDiv, kPow,
+                   kLT, kLE, kGT, kGE, kEQ, kNE, kAnd, kOr, kFunc1, kFunc2};
+      struct Op
+      {
+         int code;
+         int arg;         // variable index or function id
+         double value;    // constant
+      };
+
+   // Data
+   protected:
+      std::string fExpr;
+      std::vector<Op> fProgram;
+      std::vector<std::string> fVars;
+      int fMaxDepth;
+
+   // Methods
+   public:
+      Formula(const std::string& expr);
+      double Eval(const double* vars) const;
+      void EvalN(int n, const float* const* vars, float* out, std::vector<double>& stack) const;
+      void EvalRange(const double* lo, const double* hi, double& outlo, double& outhi) const;
+      const std::vector<std::string>& GetVariables() const {return fVars;};
+      static double Apply1(int func, double x);
+      static double Apply2(int func, double x, double y);
+
+   protected:
+      void ParseOr(const char*& p);
+      void ParseAnd(const char*& p);
+      void ParseCompare(const char*& p);
+      void ParseSum(const char*& p);
+      void ParseProduct(const char*& p);
+      void ParseUnary(const char*& p);
+      void ParsePower(const char*& p);
+      void ParsePrimary(const char*& p);
+      void Emit(int code, int arg=0, double value=0);
+
+   // Exception types
+   public:
+      struct parse_error {
+         string expr;
+         string msg;
+         parse_error( const string& expr_, const string& msg_ )
+            : expr(expr_), msg(msg_) {} };
+};
+
+#endif  // FORMULA_H
@@ -0,0 +1,228 @@
+#include "GausFit.hh"
+
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+static const int kLanes = 8;
+
+
+//---------------------------------------------------------------------------------------------------------------
+// count, sum and sum of squares of (x-shift) over the values in [lo,hi)
+static void GausMoments(const float* x, Long64_t n, float lo, float hi, float shift, double* mom)
+{
+   double s0[kLanes], s1[kLanes], s2[kLanes];
+   for(int l=0; l<kLanes; l++)
+      s0[l] = s1[l] = s2[l] = 0;
+
+   Long64_t nbatch = n - n%kLanes;
+   for(Long64_t i=0; i<nbatch; i+=kLanes)
+      for(int l=0; l<kLanes; l++)
+      {
+         float v = x[i+l];
+         double in = (v>=lo && v<hi) ? 1. : 0.;
+         double d = in>0 ? v-shift : 0.;
+         s0[l] += in;
+         s1[l] += d;
+         s2[l] += d*d;
+      }
+   for(Long64_t i=nbatch; i<n; i++)
+      if(x[i]>=lo && x[i]<hi)
+      {
+         double d = x[i]-shift;
+         s0[0] += 1;
+         s1[0] += d;
+         s2[0] += d*d;
+      }
+
+   mom[0] = mom[1] = mom[2] = 0;
+   for(int l=0; l<kLanes; l++)
+   {
+      mom[0] += s0[l];
+      mom[1] += s1[l];
+      mom[2] += s2[l];
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+static double StdNormPdf(double z)
+{
+   if(std::isinf(z)) return 0.;
+   return exp(-0.5*z*z)/sqrt(2*M_PI);
+}
+
+static double StdNormCdf(double z)
+{
+   return 0.5*erfc(-z/sqrt(2.));
+}
+
+// z*pdf(z), which vanishes at infinity
+static double ZStdNormPdf(double z)
+{
+   if(std::isinf(z)) return 0.;
+   return z*StdNormPdf(z);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+// negative log-likelihood (up to a constant) of a gaussian truncated to [a,b) and its gradient,
+// computed from the sufficient statistics mom = (N, sum(x), sum(x^2))
+static double TruncGausNLL(const double* mom, double a, double b, double mu, double sigma, double* grad)
+{
+   double N = mom[0];
+   double alpha = (a-mu)/sigma;
+   double beta = (b-mu)/sigma;
+   double Z = StdNormCdf(beta) - StdNormCdf(alpha);
+   if(Z<=0) Z = std::numeric_limits<double>::min();
+   double chi2 = mom[2] - 2*mu*mom[1] + N*mu*mu;
+
+   double nll = chi2/(2*sigma*sigma) + N*log(sigma) + N*log(Z);
+   if(grad)
+   {
+      double dZdmu = -(StdNormPdf(beta)-StdNormPdf(alpha))/sigma;
+      double dZdsigma = -(ZStdNormPdf(beta)-ZStdNormPdf(alpha))/sigma;
+      grad[0] = (N*mu-mom[1])/(sigma*sigma) + N*dZdmu/Z;
+      grad[1] = -chi2/(sigma*sigma*sigma) + N/sigma + N*dZdsigma/Z;
+   }
+   return nll;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+UnbinnedGausFitter::UnbinnedGausFitter(double xmin, double xmax):
+fMin(xmin),
+fMax(xmax),
+fShift(0)
+{
+   fMom[0] = fMom[1] = fMom[2] = 0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void UnbinnedGausFitter::SetMoments(const double* mom, float shift)
+{
+   for(int j=0; j<3; j++)
+      fMom[j] = mom[j];
+   fShift = shift;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void AddGausMoments(const float* x, Long64_t n, double xmin, double xmax, float shift, double* mom)
+{
+   bool truncated = xmin<xmax;
+   float lo = truncated ? xmin : -std::numeric_limits<float>::infinity();
+   float hi = truncated ? xmax : std::numeric_limits<float>::infinity();
+   double piece[3];
+   GausMoments(x, n, lo, hi, shift, piece);
+   for(int j=0; j<3; j++)
+      mom[j] += piece[j];
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+GausFitResult UnbinnedGausFitter::Fit() const
+{
+   GausFitResult res;
+   res.mean = res.mean_err = res.sigma = res.sigma_err = 0;
+   res.n = 0;
+   res.converged = false;
+
+   const double xmin = fMin, xmax = fMax;
+   bool truncated = xmin<xmax;
+   const double* mom = fMom;
+   const float shift = fShift;
+   res.n = mom[0];
+   if(res.n<2)
+      return res;
+
+   //the untruncated gaussian has a closed form maximum
+   double mu = mom[1]/mom[0];
+   double sigma = sqrt(mom[2]/mom[0] - mu*mu);
+   if(!truncated || sigma<=0)
+   {
+      res.mean = mu+shift;
+      res.mean_err = sigma/sqrt(mom[0]);
+      res.sigma = sigma;
+      res.sigma_err = sigma/sqrt(2*mom[0]);
+      res.converged = sigma>0;
+      return res;
+   }
+
+   //truncated gaussian: Newton iterations on (mu,sigma), hessian from the analytic gradient
+   double a = xmin-shift;
+   double b = xmax-shift;
+   double grad[2], gp[2], gm[2];
+   double H[3];
+   for(int iter=0; iter<100; iter++)
+   {
+      double nll = TruncGausNLL(mom, a, b, mu, sigma, grad);
+      double h = 1e-5*sigma;
+      TruncGausNLL(mom, a, b, mu+h, sigma, gp);
+      TruncGausNLL(mom, a, b, mu-h, sigma, gm);
+      H[0] = (gp[0]-gm[0])/(2*h);
+      H[1] = (gp[1]-gm[1])/(2*h);
+      TruncGausNLL(mom, a, b, mu, sigma+h, gp);
+      TruncGausNLL(mom, a, b, mu, sigma-h, gm);
+      H[1] = 0.5*(H[1] + (gp[0]-gm[0])/(2*h));
+      H[2] = (gp[1]-gm[1])/(2*h);
+
+      double det = H[0]*H[2]-H[1]*H[1];
+      double dmu, dsigma;
+      if(det>0 && H[0]>0)
+      {
+         dmu = -( H[2]*grad[0]-H[1]*grad[1])/det;
+         dsigma = -(-H[1]*grad[0]+H[0]*grad[1])/det;
+      }
+      else
+      {
+         //not convex here: fall back to a gradient step
+         dmu = -grad[0]*sigma*sigma/mom[0];
+         dsigma = -grad[1]*sigma*sigma/mom[0];
+      }
+
+      //damped step, sigma must stay positive and the likelihood must not get worse
+      double step = 1;
+      while(step>1e-6)
+      {
+         double newsigma = sigma+step*dsigma;
+         if(newsigma>0 && TruncGausNLL(mom, a, b, mu+step*dmu, newsigma, 0)<=nll)
+            break;
+         step *= 0.5;
+      }
+      if(step<=1e-6)
+      {
+         res.converged = fabs(grad[0])*sigma<1e-6*mom[0] && fabs(grad[1])*sigma<1e-6*mom[0];
+         break;
+      }
+      mu += step*dmu;
+      sigma += step*dsigma;
+      if(fabs(step*dmu)<1e-9*sigma && fabs(step*dsigma)<1e-9*sigma)
+      {
+         res.converged = true;
+         break;
+      }
+   }
+
+   //errors from the inverse of the hessian at the minimum
+   double h = 1e-5*sigma;
+   TruncGausNLL(mom, a, b, mu+h, sigma, gp);
+   TruncGausNLL(mom, a, b, mu-h, sigma, gm);
+   H[0] = (gp[0]-gm[0])/(2*h);
+   H[1] = (gp[1]-gm[1])/(2*h);
+   TruncGausNLL(mom, a, b, mu, sigma+h, gp);
+   TruncGausNLL(mom, a, b, mu, sigma-h, gm);
+   H[2] = (gp[1]-gm[1])/(2*h);
+   double det = H[0]*H[2]-H[1]*H[1];
+
+   res.mean = mu+shift;
+   res.sigma = sigma;
+   if(det>0)
+   {
+      res.mean_err = sqrt(H[2]/det);
+      res.sigma_err = sqrt(H[0]/det);
+   }
+   return res;
+}
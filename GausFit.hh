@@ -0,0 +1,40 @@
+#ifndef GAUSFIT_H
+#define GAUSFIT_H
+
+#include "Rtypes.h"
+
+struct GausFitResult
+{
+   double mean, mean_err;
+   double sigma, sigma_err;
+   Long64_t n;          // events inside the fit range
+   bool converged;
+};
+
+// Unbinned maximum-likelihood fit of a gaussian from its sufficient statistics (count, sum and
+// sum of squares): the likelihood and its gradient are exact functions of those sums, so the
+// minimization never touches the events.
+
+// Adds to mom the sufficient statistics of the n values in x: count, sum and sum of squares of
+// x-shift over the values in [xmin,xmax), or over all of them if xmin>=xmax, in SIMD-friendly
+// lane batches. Sums of pieces added in a fixed order can be fitted with SetMoments.
+void AddGausMoments(const float* x, Long64_t n, double xmin, double xmax, float shift, double* mom);
+
+// Fit on the moments given by SetMoments. If xmin<xmax the gaussian is truncated to [xmin,xmax),
+// the range the moments were taken over.
+class UnbinnedGausFitter
+{
+   // Data
+   protected:
+      double fMin, fMax;
+      float fShift;
+      double fMom[3];
+
+   // Methods
+   public:
+      UnbinnedGausFitter(double xmin, double xmax);
+      void SetMoments(const double* mom, float shift);
+      GausFitResult Fit() const;
+};
+
+#endif  // GAUSFIT_H
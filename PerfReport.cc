@@ -0,0 +1,175 @@
+#include "PerfReport.hh"
+
+#include <iostream>
+#include <fstream>
+#include <ctime>
+#include <cstdlib>
+#include <cstdio>
+#include <new>
+
+#include "TFile.h"
+
+using namespace std;
+
+// every operator new of the program is counted in the thread making it; new[] and the
+// nothrow versions go through this one. Only in a build with -DCOUNT_ALLOCATIONS: the
+// replacement is global and a regular build keeps the allocator of the library.
+static thread_local Long64_t gThreadAllocations = 0;
+
+#ifdef COUNT_ALLOCATIONS
+void* operator new(std::size_t size)
+{
+   gThreadAllocations++;
+   void* p = malloc(size ? size : 1);
+   if(!p)
+      throw std::bad_alloc();
+   return p;
+}
+
+void operator delete(void* p) noexcept
+{
+   free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+   free(p);
+}
+#endif
+
+//---------------------------------------------------------------------------------------------------------------
+Long64_t PerfReport::ThreadAllocations()
+{
+   return gThreadAllocations;
+}
+
+bool PerfReport::CountsAllocations()
+{
+#ifdef COUNT_ALLOCATIONS
+   return true;
+#else
+   return false;
+#endif
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+PerfReport& PerfReport::Instance()
+{
+   static PerfReport report;
+   return report;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int PerfReport::Begin(const std::string& name, const std::string& label)
+{
+   PerfStage stage;
+   stage.name = name;
+   stage.label = label;
+   stage.depth = fOpen.size();
+   stage.wall = 0;
+   stage.cpu = 0;
+   stage.entries = 0;
+   stage.getentry = 0;
+   stage.bytes = 0;
+   stage.iobytes = 0;
+   fStages.push_back(stage);
+
+   int id = fStages.size()-1;
+   fOpen.push_back(id);
+   fWatch.push_back(TStopwatch());
+   fWatch.back().Start(true);
+   fIOStart.push_back(TFile::GetFileBytesRead());
+   return id;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void PerfReport::End(int id)
+{
+   //stages are closed in reverse order of opening, the innermost is always the last one
+   if(fOpen.empty() || fOpen.back()!=id)
+   {
+      cerr<<"[WARNING]: closing perf stage "<<id<<" out of order"<<endl;
+      return;
+   }
+   TStopwatch& watch = fWatch.back();
+   watch.Stop();
+   fStages[id].wall = watch.RealTime();
+   fStages[id].cpu = watch.CpuTime();
+   fStages[id].iobytes = TFile::GetFileBytesRead() - fIOStart.back();
+   fOpen.pop_back();
+   fWatch.pop_back();
+   fIOStart.pop_back();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void PerfReport::CountRead(Long64_t nbytes)
+{
+   for(unsigned i=0; i<fOpen.size(); i++)
+   {
+      fStages[fOpen[i]].getentry++;
+      fStages[fOpen[i]].bytes += nbytes;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void PerfReport::CountEntries(Long64_t nentries)
+{
+   for(unsigned i=0; i<fOpen.size(); i++)
+      fStages[fOpen[i]].entries += nentries;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+// s as a JSON string: labels come from the configuration and from file paths
+static std::string JSONString(const std::string& s)
+{
+   std::string out = "\"";
+   for(unsigned k=0; k<s.size(); k++)
+   {
+      unsigned char c = s[k];
+      if(c=='"' || c=='\\')
+         out += '\\';
+      if(c<0x20)
+      {
+         char code[8];
+         snprintf(code,sizeof(code),"\\u%04x",c);
+         out += code;
+      }
+      else
+         out += c;
+   }
+   return out+"\"";
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool PerfReport::WriteJSON(const std::string& filename) const
+{
+   std::ofstream out(filename.c_str());
+   if(!out)
+   {
+      cerr<<"[ERROR]: cannot open perf report "<<filename<<endl;
+      return false;
+   }
+   cout<<"> Writing perf report to "<<filename<<endl;
+   out<<"{\n";
+   out<<"  \"date\": "<<(long)time(0)<<",\n";
+   out<<"  \"stages\": [\n";
+   for(unsigned i=0; i<fStages.size(); i++)
+   {
+      const PerfStage& s = fStages[i];
+      out<<"    {\"name\": "<<JSONString(s.name)<<", \"label\": "<<JSONString(s.label)<<", \"depth\": "<<s.depth
+         <<", \"wall_s\": "<<s.wall<<", \"cpu_s\": "<<s.cpu
+         <<", \"entries\": "<<s.entries<<", \"getentry_calls\": "<<s.getentry
+         <<", \"bytes_read\": "<<s.bytes<<", \"io_bytes\": "<<s.iobytes<<"}";
+      out<<(i+1<fStages.size() ? ",\n" : "\n");
+   }
+   out<<"  ]\n";
+   out<<"}\n";
+   return true;
+}
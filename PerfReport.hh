@@ -0,0 +1,64 @@
+#ifndef PERFREPORT_H
+#define PERFREPORT_H
+
+#include <string>
+#include <vector>
+
+#include "TStopwatch.h"
+
+using namespace std;
+
+// Timing and I/O counters of one instrumented stage of the run
+struct PerfStage
+{
+   std::string name;      // stage name, e.g. "FillProfile"
+   std::string label;     // data label the stage ran on
+   int depth;             // nesting level (0 = outermost)
+   double wall;           // wall time (s)
+   double cpu;            // cpu time (s)
+   Long64_t entries;      // entries processed
+   Long64_t getentry;     // number of GetEntry calls
+   Long64_t bytes;        // uncompressed bytes returned by GetEntry
+   Long64_t iobytes;      // bytes read from disk/network by TFile
+};
+
+// Collects the PerfStage records of the whole run and writes them as JSON.
+// Stages nest: counters are attributed to every stage open at the time.
+// ThreadAllocations counts the operator new calls of the calling thread since it started,
+// in a build with -DCOUNT_ALLOCATIONS (CountsAllocations); it stays 0 otherwise.
+class PerfReport
+{
+   // Data
+   protected:
+      std::vector<PerfStage> fStages;
+      std::vector<int> fOpen;               // indices of the open stages, innermost last
+      std::vector<TStopwatch> fWatch;       // one stopwatch per open stage
+      std::vector<Long64_t> fIOStart;       // TFile bytes read when the stage was opened
+
+   // Methods
+   public:
+      static PerfReport& Instance();
+      int Begin(const std::string& name, const std::string& label="");
+      void End(int id);
+      void CountRead(Long64_t nbytes);
+      void CountEntries(Long64_t nentries);
+      const std::vector<PerfStage>& GetStages() const {return fStages;};
+      bool WriteJSON(const std::string& filename) const;
+      static Long64_t ThreadAllocations();
+      static bool CountsAllocations();
+
+   protected:
+      PerfReport() {};
+};
+
+// Scoped stage: opened on construction, closed when it goes out of scope
+class PerfScope
+{
+   protected:
+      int fId;
+   public:
+      PerfScope(const std::string& name, const std::string& label="") : fId(PerfReport::Instance().Begin(name,label)) {};
+      ~PerfScope() {PerfReport::Instance().End(fId);};
+};
+
+#endif  // PERFREPORT_H
@@ -0,0 +1,231 @@
+#include "Pipeline.hh"
+
+#include <iostream>
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+typedef std::chrono::steady_clock PipelineClock;
+
+
+//---------------------------------------------------------------------------------------------------------------
+static double Seconds(PipelineClock::time_point start)
+{
+   return std::chrono::duration<double>(PipelineClock::now()-start).count();
+}
+
+// spins for a while, then sleeps: waiting threads must not steal the cores of the busy ones
+static void Backoff(int& tries)
+{
+   if(++tries<64)
+      std::this_thread::yield();
+   else
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+// false once the queue is closed and empty
+static bool WaitPop(BoundedQueue<int>& q, int& value, double& waited)
+{
+   if(q.TryPop(value))
+      return true;
+   PipelineClock::time_point start = PipelineClock::now();
+   bool ok = false;
+   int tries = 0;
+   while(true)
+   {
+      if(q.TryPop(value))
+      {
+         ok = true;
+         break;
+      }
+      //the last push happens before the close: one more try after seeing it
+      if(q.IsClosed())
+      {
+         ok = q.TryPop(value);
+         break;
+      }
+      Backoff(tries);
+   }
+   waited += Seconds(start);
+   return ok;
+}
+
+static void WaitPush(BoundedQueue<int>& q, int value, double& waited)
+{
+   if(q.TryPush(value))
+      return;
+   PipelineClock::time_point start = PipelineClock::now();
+   int tries = 0;
+   while(!q.TryPush(value))
+      Backoff(tries);
+   waited += Seconds(start);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+BatchPipeline::BatchPipeline(int nslots, int nderive, int nkernel, const EventBatch& prototype):
+fSlots(max(nslots,1),prototype),
+fSeq(max(nslots,1),0),
+fNderive(max(nderive,1)),
+fNkernel(max(nkernel,1)),
+fWall(0)
+{}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchPipeline::Run(const ReadFunc& read, const StageFunc& derive, const StageFunc& kernel, const CommitFunc& commit)
+{
+   PipelineClock::time_point start = PipelineClock::now();
+   int nslots = fSlots.size();
+
+   //stages between the reader and the commit, the empty ones are skipped
+   std::vector<const StageFunc*> funcs;
+   fStats.clear();
+   fStats.push_back(PipelineStageStats("read",1));
+   if(derive)
+   {
+      funcs.push_back(&derive);
+      fStats.push_back(PipelineStageStats("derive",fNderive));
+   }
+   if(kernel)
+   {
+      funcs.push_back(&kernel);
+      fStats.push_back(PipelineStageStats("kernel",fNkernel));
+   }
+   fStats.push_back(PipelineStageStats("commit",1));
+   int nmiddle = funcs.size();
+
+   //queue k feeds stage k+1; a short queue makes a slow consumer block its producer
+   BoundedQueue<int> freeslots(nslots);
+   for(int s=0; s<nslots; s++)
+      freeslots.TryPush(s);
+   std::vector<std::unique_ptr<BoundedQueue<int> > > queues;
+   for(int k=0; k<=nmiddle; k++)
+      queues.emplace_back(new BoundedQueue<int>(k<nmiddle ? 2*fStats[k+1].nthreads : nslots));
+   std::atomic<bool> cancel(false);
+
+   //each thread keeps its own counters, summed at the end
+   std::vector<PipelineStageStats> threadstats;
+   std::vector<int> threadstage;
+   std::vector<std::thread> threads;
+   for(int k=0; k<=nmiddle; k++)
+      for(int t=0; t<fStats[k].nthreads; t++)
+      {
+         threadstats.push_back(PipelineStageStats());
+         threadstage.push_back(k);
+      }
+   std::vector<std::atomic<int> > running(nmiddle+1);
+   for(int k=0; k<=nmiddle; k++)
+      running[k] = fStats[k].nthreads;
+
+   int ithread = 0;
+   threads.push_back(std::thread([&,ithread]()
+   {
+      PipelineStageStats& st = threadstats[ithread];
+      Long64_t seq = 0;
+      while(true)
+      {
+         int slot;
+         WaitPop(freeslots,slot,st.blocked);
+         if(cancel.load(std::memory_order_acquire))
+            break;
+         PipelineClock::time_point t0 = PipelineClock::now();
+         bool ok = read(slot,fSlots[slot]);
+         st.busy += Seconds(t0);
+         if(!ok)
+            break;
+         fSeq[slot] = seq++;
+         st.items++;
+         WaitPush(*queues[0],slot,st.blocked);
+      }
+      queues[0]->Close();
+   }));
+   ithread++;
+
+   for(int k=0; k<nmiddle; k++)
+      for(int t=0; t<fStats[k+1].nthreads; t++, ithread++)
+         threads.push_back(std::thread([&,k,ithread]()
+         {
+            PipelineStageStats& st = threadstats[ithread];
+            int slot;
+            while(WaitPop(*queues[k],slot,st.starved))
+            {
+               PipelineClock::time_point t0 = PipelineClock::now();
+               (*funcs[k])(slot,fSlots[slot]);
+               st.busy += Seconds(t0);
+               st.items++;
+               WaitPush(*queues[k+1],slot,st.blocked);
+            }
+            if(--running[k+1]==0)
+               queues[k+1]->Close();
+         }));
+
+   //commit in read order on the calling thread, then give the slot back to the reader;
+   //the batches in flight are within nslots of the next one, a ring reorders them
+   PipelineStageStats& cst = fStats.back();
+   std::vector<int> pending(nslots,-1);
+   Long64_t next = 0;
+   bool stopped = false;
+   int slot;
+   while(WaitPop(*queues[nmiddle],slot,cst.starved))
+   {
+      pending[fSeq[slot]%nslots] = slot;
+      while(pending[next%nslots]>=0)
+      {
+         int s = pending[next%nslots];
+         pending[next%nslots] = -1;
+         next++;
+         if(!stopped)
+         {
+            PipelineClock::time_point t0 = PipelineClock::now();
+            if(!commit(s,fSlots[s]))
+            {
+               stopped = true;
+               cancel.store(true,std::memory_order_release);
+            }
+            cst.busy += Seconds(t0);
+            cst.items++;
+         }
+         freeslots.TryPush(s);
+      }
+   }
+   for(unsigned t=0; t<threads.size(); t++)
+      threads[t].join();
+
+   for(unsigned t=0; t<threadstats.size(); t++)
+   {
+      PipelineStageStats& st = fStats[threadstage[t]];
+      st.items += threadstats[t].items;
+      st.busy += threadstats[t].busy;
+      st.starved += threadstats[t].starved;
+      st.blocked += threadstats[t].blocked;
+   }
+   fWall = Seconds(start);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void BatchPipeline::PrintStats(const std::string& label) const
+{
+   //fractions of the wall time of the threads of each stage; the busiest stage limits the throughput
+   if(fWall<=0)
+      return;
+   int bottleneck = 0;
+   double maxbusy = -1;
+   cout<<">> Pipeline of "<<label<<" ("<<fWall<<" s):";
+   for(unsigned k=0; k<fStats.size(); k++)
+   {
+      const PipelineStageStats& st = fStats[k];
+      double norm = 100./(fWall*st.nthreads);
+      cout<<" "<<st.name<<" x"<<st.nthreads<<" busy "<<(int)(st.busy*norm)<<"% starved "<<(int)(st.starved*norm)
+          <<"% blocked "<<(int)(st.blocked*norm)<<"%"<<(k+1<fStats.size() ? "," : "");
+      if(st.busy/st.nthreads>maxbusy)
+      {
+         maxbusy = st.busy/st.nthreads;
+         bottleneck = k;
+      }
+   }
+   cout<<endl;
+   cout<<">> "<<(fStats[bottleneck].name=="read" ? "I/O-bound" : "compute-bound")<<", limited by the "<<fStats[bottleneck].name<<" stage"<<endl;
+}
@@ -0,0 +1,134 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+#include "EventBatch.hh"
+
+using namespace std;
+
+// Bounded multi-producer multi-consumer queue without locks (Vyukov's ring buffer): each cell
+// carries a sequence number telling whether it is free for the next push or full for the next pop.
+// Close() marks the end of the input, Pop then fails once the queue is empty.
+template<class T> class BoundedQueue
+{
+   protected:
+      struct Cell
+      {
+         std::atomic<size_t> seq;
+         T data;
+      };
+
+   // Data
+   protected:
+      std::unique_ptr<Cell[]> fCells;
+      size_t fMask;
+      alignas(64) std::atomic<size_t> fHead;
+      alignas(64) std::atomic<size_t> fTail;
+      std::atomic<bool> fClosed;
+
+   // Methods
+   public:
+      BoundedQueue(size_t capacity) : fHead(0), fTail(0), fClosed(false)
+      {
+         size_t size = 2;
+         while(size<capacity)
+            size *= 2;
+         fCells.reset(new Cell[size]);
+         fMask = size-1;
+         for(size_t i=0; i<size; i++)
+            fCells[i].seq.store(i,std::memory_order_relaxed);
+      };
+      bool TryPush(const T& value)
+      {
+         size_t pos = fTail.load(std::memory_order_relaxed);
+         Cell* cell;
+         while(true)
+         {
+            cell = &fCells[pos&fMask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            long diff = (long)seq-(long)pos;
+            if(diff==0 && fTail.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+               break;
+            if(diff<0)
+               return false;   //full
+            if(diff>0)
+               pos = fTail.load(std::memory_order_relaxed);
+         }
+         cell->data = value;
+         cell->seq.store(pos+1,std::memory_order_release);
+         return true;
+      };
+      bool TryPop(T& value)
+      {
+         size_t pos = fHead.load(std::memory_order_relaxed);
+         Cell* cell;
+         while(true)
+         {
+            cell = &fCells[pos&fMask];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            long diff = (long)seq-(long)(pos+1);
+            if(diff==0 && fHead.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+               break;
+            if(diff<0)
+               return false;   //empty
+            if(diff>0)
+               pos = fHead.load(std::memory_order_relaxed);
+         }
+         value = cell->data;
+         cell->seq.store(pos+fMask+1,std::memory_order_release);
+         return true;
+      };
+      void Close() {fClosed.store(true,std::memory_order_release);};
+      bool IsClosed() const {return fClosed.load(std::memory_order_acquire);};
+};
+
+
+// Time spent by the threads of one stage of a BatchPipeline
+struct PipelineStageStats
+{
+   std::string name;
+   int nthreads;
+   Long64_t items;
+   double busy;        // s inside the stage function, summed over the threads
+   double starved;     // s waiting for input
+   double blocked;     // s waiting for room in the output queue
+
+   PipelineStageStats(const std::string& name_="", int nthreads_=1) : name(name_), nthreads(nthreads_), items(0), busy(0), starved(0), blocked(0) {};
+};
+
+
+// Read, derive, kernel and commit stages connected by bounded queues of batch slots.
+// A fixed pool of batches circulates: the reader (one thread, the chain is not thread safe)
+// fills a free slot, the derive and kernel stages work on it with their own number of threads,
+// in any order, and the calling thread commits the slots in read order before freeing them.
+// Commit returning false stops the reading; the batches already read are dropped.
+class BatchPipeline
+{
+   public:
+      typedef std::function<bool(int,EventBatch&)> ReadFunc;     // false at the end of the input
+      typedef std::function<void(int,EventBatch&)> StageFunc;
+      typedef std::function<bool(int,EventBatch&)> CommitFunc;   // false to stop
+
+   // Data
+   protected:
+      std::vector<EventBatch> fSlots;
+      std::vector<Long64_t> fSeq;             // read order of the batch in each slot
+      int fNderive, fNkernel;
+      std::vector<PipelineStageStats> fStats;
+      double fWall;
+
+   // Methods
+   public:
+      BatchPipeline(int nslots, int nderive, int nkernel, const EventBatch& prototype);
+      int GetNSlots() const {return fSlots.size();};
+      void Run(const ReadFunc& read, const StageFunc& derive, const StageFunc& kernel, const CommitFunc& commit);
+      const std::vector<PipelineStageStats>& GetStats() const {return fStats;};
+      void PrintStats(const std::string& label) const;
+};
+
+#endif  // PIPELINE_H
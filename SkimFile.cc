@@ -0,0 +1,390 @@
+#include "SkimFile.hh"
+
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static const char kMagic[8] = {'E','V','S','K','I','M','0','1'};
+static const char kFooterMagic[8] = {'E','V','S','K','I','M','F','T'};
+static const Long64_t kMaxQ = 1LL<<50;       // quantized values are clamped to +-kMaxQ
+static const Long64_t kNaN = -kMaxQ-1;       // code of NaN
+enum BlockMode {kFrameOfReference=0, kDelta=1};
+
+
+//---------------------------------------------------------------------------------------------------------------
+static int BitWidth(ULong64_t range)
+{
+   int width = 0;
+   while(width<64 && (range>>width))
+      width++;
+   return width;
+}
+
+// appends n values of width bits, plus 8 bytes of padding for the unaligned reads of Unpack
+static void Pack(const ULong64_t* v, int n, int width, std::vector<unsigned char>& out)
+{
+   ULong64_t acc = 0;
+   int nbits = 0;
+   for(int i=0; i<n; i++)
+   {
+      acc |= v[i]<<nbits;
+      nbits += width;
+      while(nbits>=8)
+      {
+         out.push_back(acc&0xff);
+         acc >>= 8;
+         nbits -= 8;
+      }
+   }
+   if(nbits>0)
+      out.push_back(acc&0xff);
+   for(int i=0; i<8; i++)
+      out.push_back(0);
+}
+
+// one unaligned 64 bit load per value (little endian)
+static void Unpack(const unsigned char* in, int n, int width, ULong64_t* v)
+{
+   const ULong64_t mask = (width>=64) ? ~0ULL : ((1ULL<<width)-1);
+   for(int i=0; i<n; i++)
+   {
+      ULong64_t bit = (ULong64_t)i*width;
+      ULong64_t word;
+      memcpy(&word,in+(bit>>3),8);
+      v[i] = (word>>(bit&7)) & mask;
+   }
+}
+
+static Long64_t Quantize(float v, const SkimColumn& col)
+{
+   if(std::isnan(v))
+      return kNaN;
+   double q = (v-col.offset)/col.lsb;
+   if(q>kMaxQ) q = kMaxQ;
+   if(q<-kMaxQ) q = -kMaxQ;
+   return llround(q);
+}
+
+template<class T> static bool ReadValue(FILE* f, T& value)
+{
+   return fread(&value,sizeof(T),1,f)==1;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+SkimWriter::SkimWriter(const std::string& filename, const std::vector<SkimColumn>& columns, int blocksize):
+fFileName(filename),
+fColumns(columns),
+fBlockSize(blocksize),
+fPending(columns.size()),
+fEntries(0),
+fBytes(0)
+{
+   fFile = fopen(filename.c_str(),"wb");
+   if(!fFile)
+   {
+      cerr<<"[ERROR]: cannot create skim "<<filename<<endl;
+      exit(EXIT_FAILURE);
+   }
+   Write(kMagic,8);
+   WriteValue((UInt_t)fBlockSize);
+   WriteValue((UInt_t)fColumns.size());
+   for(unsigned c=0; c<fColumns.size(); c++)
+   {
+      WriteValue((UInt_t)fColumns[c].name.size());
+      Write(fColumns[c].name.c_str(),fColumns[c].name.size());
+      WriteValue(fColumns[c].lsb);
+      WriteValue(fColumns[c].offset);
+   }
+   for(unsigned c=0; c<fColumns.size(); c++)
+      fPending[c].reserve(fBlockSize);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimWriter::Write(const void* data, size_t n)
+{
+   //a skim cut short (e.g. a full disk) is removed rather than left for the next job to read
+   if(n>0 && fwrite(data,1,n,fFile)!=n)
+   {
+      cerr<<"[ERROR]: error while writing skim "<<fFileName<<endl;
+      fclose(fFile);
+      unlink(fFileName.c_str());
+      exit(EXIT_FAILURE);
+   }
+   fBytes += n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+SkimWriter::~SkimWriter()
+{
+   Close();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimWriter::Fill(int n, const float* const* columns)
+{
+   int done = 0;
+   while(done<n)
+   {
+      int nrows = min(n-done,fBlockSize-(int)fPending[0].size());
+      for(unsigned c=0; c<fColumns.size(); c++)
+         for(int i=done; i<done+nrows; i++)
+            fPending[c].push_back(Quantize(columns[c][i],fColumns[c]));
+      done += nrows;
+      if((int)fPending[0].size()==fBlockSize)
+         FlushBlock();
+   }
+   fEntries += n;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimWriter::FlushBlock()
+{
+   int n = fPending[0].size();
+   if(n==0)
+      return;
+   fBlockOffsets.push_back(fBytes);
+   std::vector<ULong64_t> packed(n);
+   for(unsigned c=0; c<fColumns.size(); c++)
+   {
+      const std::vector<Long64_t>& q = fPending[c];
+
+      //frame of reference: values relative to the block minimum
+      Long64_t qmin = q[0], qmax = q[0];
+      for(int i=1; i<n; i++)
+      {
+         if(q[i]<qmin) qmin = q[i];
+         if(q[i]>qmax) qmax = q[i];
+      }
+      int forwidth = BitWidth(qmax-qmin);
+
+      //delta coding: differences between consecutive rows relative to their minimum
+      Long64_t dmin = 0, dmax = 0;
+      for(int i=1; i<n; i++)
+      {
+         Long64_t d = q[i]-q[i-1];
+         if(i==1 || d<dmin) dmin = d;
+         if(i==1 || d>dmax) dmax = d;
+      }
+      int deltawidth = BitWidth(dmax-dmin);
+
+      unsigned char mode, width;
+      Long64_t base, ref;
+      if(n>1 && deltawidth<forwidth)
+      {
+         mode = kDelta;
+         width = deltawidth;
+         base = q[0];
+         ref = dmin;
+         for(int i=1; i<n; i++)
+            packed[i-1] = q[i]-q[i-1]-dmin;
+      }
+      else
+      {
+         mode = kFrameOfReference;
+         width = forwidth;
+         base = qmin;
+         ref = 0;
+         for(int i=0; i<n; i++)
+            packed[i] = q[i]-qmin;
+      }
+      fBuffer.clear();
+      Pack(&packed[0],mode==kDelta ? n-1 : n,width,fBuffer);
+
+      WriteValue(mode);
+      WriteValue(width);
+      WriteValue(base);
+      WriteValue(ref);
+      WriteValue((UInt_t)fBuffer.size());
+      Write(&fBuffer[0],fBuffer.size());
+      fPending[c].clear();
+   }
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimWriter::Close()
+{
+   if(!fFile)
+      return;
+   FlushBlock();
+   ULong64_t footer = fBytes;
+   WriteValue((ULong64_t)fEntries);
+   WriteValue((ULong64_t)fBlockOffsets.size());
+   for(unsigned b=0; b<fBlockOffsets.size(); b++)
+      WriteValue(fBlockOffsets[b]);
+   WriteValue(footer);
+   Write(kFooterMagic,8);
+   if(fclose(fFile)!=0)
+   {
+      cerr<<"[ERROR]: error while writing skim "<<fFileName<<endl;
+      unlink(fFileName.c_str());
+      exit(EXIT_FAILURE);
+   }
+   fFile = 0;
+   cout<<">> "<<fEntries<<" entries written to "<<fFileName<<" ("<<fBytes<<" bytes)"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+SkimReader::SkimReader(const std::string& filename):
+fFileName(filename),
+fBlockSize(0),
+fEntries(0),
+fCachedBlock(-1),
+fBytesRead(0)
+{
+   fFile = fopen(filename.c_str(),"rb");
+   char magic[8];
+   if(!fFile || fread(magic,1,8,fFile)!=8 || memcmp(magic,kMagic,8)!=0)
+   {
+      cerr<<"[ERROR]: "<<filename<<" is not a skim file"<<endl;
+      exit(EXIT_FAILURE);
+   }
+   UInt_t blocksize, ncols;
+   ReadValue(fFile,blocksize);
+   ReadValue(fFile,ncols);
+   fBlockSize = blocksize;
+   for(UInt_t c=0; c<ncols; c++)
+   {
+      UInt_t len;
+      ReadValue(fFile,len);
+      SkimColumn col;
+      col.name.resize(len);
+      if(len>0 && fread(&col.name[0],1,len,fFile)!=len)
+         break;
+      ReadValue(fFile,col.lsb);
+      ReadValue(fFile,col.offset);
+      fColumns.push_back(col);
+   }
+
+   //footer: entries, number of blocks, block offsets, footer position, magic
+   ULong64_t footer, nentries, nblocks;
+   fseek(fFile,-16,SEEK_END);
+   if(!ReadValue(fFile,footer) || fread(magic,1,8,fFile)!=8 || memcmp(magic,kFooterMagic,8)!=0 || fColumns.size()!=ncols)
+   {
+      cerr<<"[ERROR]: skim "<<filename<<" is truncated"<<endl;
+      exit(EXIT_FAILURE);
+   }
+   fseek(fFile,footer,SEEK_SET);
+   ReadValue(fFile,nentries);
+   ReadValue(fFile,nblocks);
+   fEntries = nentries;
+   fBlockOffsets.resize(nblocks);
+   for(ULong64_t b=0; b<nblocks; b++)
+      ReadValue(fFile,fBlockOffsets[b]);
+
+   fCache.resize(fColumns.size());
+   for(unsigned c=0; c<fColumns.size(); c++)
+      fCache[c].resize(fBlockSize);
+   fValues.resize(fBlockSize);
+   fSelected.assign(fColumns.size(),1);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+SkimReader::~SkimReader()
+{
+   if(fFile)
+      fclose(fFile);
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int SkimReader::FindColumn(const std::string& name) const
+{
+   for(unsigned c=0; c<fColumns.size(); c++)
+      if(fColumns[c].name==name)
+         return c;
+   return -1;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimReader::Select(const std::vector<char>& selected)
+{
+   //a column selected now is not in the cached block
+   for(unsigned c=0; c<fSelected.size(); c++)
+      if(selected[c] && !fSelected[c])
+         fCachedBlock = -1;
+   fSelected = selected;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimReader::LoadBlock(Long64_t iblock)
+{
+   int n = min((Long64_t)fBlockSize,fEntries-iblock*fBlockSize);
+   fseek(fFile,fBlockOffsets[iblock],SEEK_SET);
+   for(unsigned c=0; c<fColumns.size(); c++)
+   {
+      unsigned char mode, width;
+      Long64_t base, ref;
+      UInt_t nbytes;
+      ReadValue(fFile,mode);
+      ReadValue(fFile,width);
+      ReadValue(fFile,base);
+      ReadValue(fFile,ref);
+      ReadValue(fFile,nbytes);
+      if(!fSelected[c])
+      {
+         fseek(fFile,nbytes,SEEK_CUR);
+         continue;
+      }
+      fBuffer.resize(nbytes);
+      if(fread(&fBuffer[0],1,nbytes,fFile)!=nbytes)
+      {
+         cerr<<"[ERROR]: error while reading skim "<<fFileName<<endl;
+         exit(EXIT_FAILURE);
+      }
+      fBytesRead += nbytes+22;
+
+      //rebuild the quantized values in place, then convert
+      Long64_t* q = (Long64_t*)&fValues[0];
+      if(mode==kDelta)
+      {
+         Unpack(&fBuffer[0],n-1,width,&fValues[1]);
+         q[0] = base;
+         for(int i=1; i<n; i++)
+            q[i] = q[i-1] + (Long64_t)fValues[i] + ref;
+      }
+      else
+      {
+         Unpack(&fBuffer[0],n,width,&fValues[0]);
+         for(int i=0; i<n; i++)
+            q[i] = (Long64_t)fValues[i] + base;
+      }
+      const double lsb = fColumns[c].lsb;
+      const double offset = fColumns[c].offset;
+      float* out = &fCache[c][0];
+      for(int i=0; i<n; i++)
+         out[i] = (q[i]==kNaN) ? NAN : offset + q[i]*lsb;
+   }
+   fCachedBlock = iblock;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void SkimReader::Read(int icol, Long64_t first, int n, float* out)
+{
+   while(n>0)
+   {
+      Long64_t iblock = first/fBlockSize;
+      if(iblock!=fCachedBlock)
+         LoadBlock(iblock);
+      int start = first - iblock*fBlockSize;
+      int nrows = min(n,fBlockSize-start);
+      memcpy(out,&fCache[icol][start],nrows*sizeof(float));
+      out += nrows;
+      first += nrows;
+      n -= nrows;
+   }
+}
@@ -0,0 +1,91 @@
+#ifndef SKIMFILE_H
+#define SKIMFILE_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "Rtypes.h"
+
+using namespace std;
+
+// Compact skim of event columns.
+// Each value is stored as the integer round((value-offset)/lsb), so times are fixed point
+// relative to the time offset and positions/amplitudes have a configurable precision.
+// Rows are grouped in blocks; inside a block each column is either delta coded or stored
+// relative to its minimum (whichever needs fewer bits) and bit-packed at the minimal width.
+// A footer with the block offsets allows random access to any block.
+
+struct SkimColumn
+{
+   std::string name;
+   double lsb;
+   double offset;
+   SkimColumn(const std::string& name_="", double lsb_=1, double offset_=0) : name(name_), lsb(lsb_), offset(offset_) {};
+};
+
+
+class SkimWriter
+{
+   // Data
+   protected:
+      FILE* fFile;
+      std::string fFileName;
+      std::vector<SkimColumn> fColumns;
+      int fBlockSize;
+      std::vector<std::vector<Long64_t> > fPending;   // quantized rows of the current block
+      std::vector<unsigned char> fBuffer;
+      std::vector<ULong64_t> fBlockOffsets;
+      Long64_t fEntries;
+      Long64_t fBytes;
+
+   // Methods
+   public:
+      SkimWriter(const std::string& filename, const std::vector<SkimColumn>& columns, int blocksize=4096);
+      ~SkimWriter();
+      void Fill(int n, const float* const* columns);
+      void Close();
+      Long64_t GetEntries() const {return fEntries;};
+
+   protected:
+      void FlushBlock();
+      void Write(const void* data, size_t n);
+      template<class T> void WriteValue(const T& value) {Write(&value,sizeof(T));};
+};
+
+
+class SkimReader
+{
+   // Data
+   protected:
+      FILE* fFile;
+      std::string fFileName;
+      std::vector<SkimColumn> fColumns;
+      int fBlockSize;
+      Long64_t fEntries;
+      std::vector<ULong64_t> fBlockOffsets;
+      Long64_t fCachedBlock;
+      std::vector<std::vector<float> > fCache;        // decoded columns of the cached block
+      std::vector<char> fSelected;                    // columns decoded, the others are skipped
+      std::vector<unsigned char> fBuffer;
+      std::vector<ULong64_t> fValues;
+      Long64_t fBytesRead;
+
+   // Methods
+   public:
+      SkimReader(const std::string& filename);
+      ~SkimReader();
+      Long64_t GetEntries() const {return fEntries;};
+      const std::string& GetFileName() const {return fFileName;};
+      int GetNColumns() const {return fColumns.size();};
+      const SkimColumn& GetColumn(int i) const {return fColumns[i];};
+      int FindColumn(const std::string& name) const;
+      void Select(const std::vector<char>& selected);
+      void Read(int icol, Long64_t first, int n, float* out);
+      Long64_t GetBytesRead() const {return fBytesRead;};
+
+   protected:
+      void LoadBlock(Long64_t iblock);
+};
+
+#endif  // SKIMFILE_H
@@ -0,0 +1,296 @@
+#include "ZoneMap.hh"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include "TSystem.h"
+
+using namespace std;
+
+//---------------------------------------------------------------------------------------------------------------
+ZoneMap::ZoneMap(const std::string& indexfile, const std::vector<std::string>& columns):
+fIndexFile(indexfile),
+fColumns(columns),
+fDirty(false),
+fCurrent(-1),
+fCurFirst(0),
+fCurLast(0)
+{
+   if(fIndexFile!="")
+      Load();
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool ZoneMap::Load()
+{
+   //per file: "file size mtime entries nzones path", "columns names...", the nzones+1 bounds,
+   //then one line per cluster with min and max of each column; floats in hex, inf included
+   std::ifstream in(fIndexFile.c_str());
+   if(!in)
+      return false;
+   string line, word;
+   while(std::getline(in,line))
+   {
+      std::istringstream ist(line);
+      FileZones file;
+      int nzones;
+      string path;
+      if(!(ist>>word>>file.size>>file.mtime>>file.entries>>nzones) || word!="file")
+         continue;
+      std::getline(ist>>std::ws,path);
+
+      bool ok = !!std::getline(in,line);
+      std::istringstream cols(line);
+      ok = ok && (cols>>word) && word=="columns";
+      while(ok && cols>>word)
+         file.columns.push_back(word);
+      ok = ok && std::getline(in,line);
+      std::istringstream bounds(line);
+      Long64_t bound;
+      while(ok && bounds>>bound)
+         file.bounds.push_back(bound);
+      ok = ok && (int)file.bounds.size()==nzones+1;
+      for(int z=0; ok && z<nzones; z++)
+      {
+         ok = !!std::getline(in,line);
+         std::istringstream values(line);
+         for(unsigned c=0; ok && c<file.columns.size(); c++)
+         {
+            string lo, hi;
+            ok = !!(values>>lo>>hi);
+            file.min.push_back(strtof(lo.c_str(),0));
+            file.max.push_back(strtof(hi.c_str(),0));
+         }
+      }
+      if(ok)
+         fCache[path] = file;
+      else
+         cerr<<"[WARNING]: skipping the corrupted zones of "<<path<<" in "<<fIndexFile<<endl;
+   }
+   cout<<">> Zones of "<<fCache.size()<<" files known from "<<fIndexFile<<endl;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+bool ZoneMap::Save()
+{
+   if(fIndexFile=="" || !fDirty)
+      return true;
+   //a temporary file named after the process: two jobs completing zones of the same files
+   //at once never write into the same file, and readers only ever open a finished map
+   string tmpname = fIndexFile+".tmp"+std::to_string(gSystem->GetPid());
+   FILE* out = fopen(tmpname.c_str(),"w");
+   if(!out)
+   {
+      cerr<<"[WARNING]: cannot write zone map "<<fIndexFile<<endl;
+      return false;
+   }
+   for(std::map<string,FileZones>::const_iterator it=fCache.begin(); it!=fCache.end(); ++it)
+   {
+      const FileZones& file = it->second;
+      int nzones = file.bounds.size()-1;
+      fprintf(out,"file %lld %ld %lld %d %s\ncolumns",(long long)file.size,(long)file.mtime,(long long)file.entries,nzones,it->first.c_str());
+      for(unsigned c=0; c<file.columns.size(); c++)
+         fprintf(out," %s",file.columns[c].c_str());
+      fprintf(out,"\n");
+      for(unsigned z=0; z<file.bounds.size(); z++)
+         fprintf(out,"%lld%s",(long long)file.bounds[z],z+1<file.bounds.size() ? " " : "\n");
+      for(int z=0; z<nzones; z++)
+         for(unsigned c=0; c<file.columns.size(); c++)
+            fprintf(out,"%a %a%s",file.min[z*file.columns.size()+c],file.max[z*file.columns.size()+c],c+1<file.columns.size() ? " " : "\n");
+   }
+   bool ok = !ferror(out);
+   if(fclose(out)!=0 || !ok || gSystem->Rename(tmpname.c_str(),fIndexFile.c_str())!=0)
+   {
+      cerr<<"[WARNING]: cannot write zone map "<<fIndexFile<<endl;
+      gSystem->Unlink(tmpname.c_str());
+      return false;
+   }
+   fDirty = false;
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ZoneMap::Attach(const ChainIndex& index)
+{
+   //zones of the files known and unchanged, with the columns in the order of this job
+   int ncols = fColumns.size();
+   fFirst.clear();
+   fLast.clear();
+   fMin.clear();
+   fMax.clear();
+   fBuild.clear();
+   fCurrent = -1;
+   fCurFirst = fCurLast = 0;
+   for(int f=0; f<index.GetNFiles(); f++)
+   {
+      const IndexedFile& file = index.GetFile(f);
+      std::map<string,FileZones>::const_iterator it = fCache.find(file.path);
+      std::vector<int> col(ncols,-1);
+      bool known = (it!=fCache.end() && it->second.size==file.size && it->second.mtime==file.mtime && it->second.entries==file.entries);
+      for(int c=0; known && c<ncols; c++)
+      {
+         col[c] = std::find(it->second.columns.begin(),it->second.columns.end(),fColumns[c])-it->second.columns.begin();
+         known = col[c]<(int)it->second.columns.size();
+      }
+      if(!known)
+      {
+         Build build;
+         build.path = file.path;
+         build.offset = file.offset;
+         build.next = 0;
+         build.zone = 0;
+         build.zones.size = file.size;
+         build.zones.mtime = file.mtime;
+         build.zones.entries = file.entries;
+         build.zones.columns = fColumns;
+         fBuild.push_back(build);
+         continue;
+      }
+      const FileZones& zones = it->second;
+      int nfilecols = zones.columns.size();
+      for(unsigned z=0; z+1<zones.bounds.size(); z++)
+      {
+         fFirst.push_back(file.offset+zones.bounds[z]);
+         fLast.push_back(file.offset+zones.bounds[z+1]);
+         for(int c=0; c<ncols; c++)
+         {
+            fMin.push_back(zones.min[z*nfilecols+col[c]]);
+            fMax.push_back(zones.max[z*nfilecols+col[c]]);
+         }
+      }
+   }
+   if(!fBuild.empty())
+      cout<<">> Zone map: "<<fBuild.size()<<" files without zones, built while they are read"<<endl;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ZoneMap::KeepBuilding(std::vector<std::pair<Long64_t,Long64_t> > ranges)
+{
+   //ranges [first,last) of chain entries read; contiguous ones are joined, a file is kept if
+   //one of them contains all of its entries
+   std::sort(ranges.begin(),ranges.end());
+   std::vector<std::pair<Long64_t,Long64_t> > joined;
+   for(unsigned r=0; r<ranges.size(); r++)
+      if(!joined.empty() && ranges[r].first<=joined.back().second)
+         joined.back().second = max(joined.back().second,ranges[r].second);
+      else
+         joined.push_back(ranges[r]);
+   std::vector<Build> kept;
+   for(unsigned f=0; f<fBuild.size(); f++)
+   {
+      Long64_t first = fBuild[f].offset;
+      Long64_t last = first+fBuild[f].zones.entries;
+      int r = std::upper_bound(joined.begin(),joined.end(),std::make_pair(first,(Long64_t)1<<62))-joined.begin()-1;
+      if(r>=0 && joined[r].second>=last)
+         kept.push_back(fBuild[f]);
+   }
+   if(kept.size()==fBuild.size())
+      return;
+   fBuild.swap(kept);
+   fCurrent = -1;
+   fCurFirst = fCurLast = 0;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+int ZoneMap::FindZone(Long64_t entry, Long64_t& end) const
+{
+   //zone containing entry, or -1 with end at the first known zone after it
+   int z = std::upper_bound(fFirst.begin(),fFirst.end(),entry)-fFirst.begin()-1;
+   if(z>=0 && entry<fLast[z])
+   {
+      end = fLast[z];
+      return z;
+   }
+   end = z+1<(int)fFirst.size() ? fFirst[z+1] : (Long64_t)1<<62;
+   return -1;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ZoneMap::Locate(Long64_t entry)
+{
+   //file being built containing entry, or the gap between two of them
+   int f = fBuild.size()-1;
+   while(f>=0 && fBuild[f].offset>entry)
+      f--;
+   if(f>=0 && entry<fBuild[f].offset+fBuild[f].zones.entries)
+   {
+      fCurrent = f;
+      fCurFirst = fBuild[f].offset;
+      fCurLast = fCurFirst+fBuild[f].zones.entries;
+      return;
+   }
+   fCurrent = -1;
+   fCurFirst = f>=0 ? fBuild[f].offset+fBuild[f].zones.entries : 0;
+   fCurLast = f+1<(int)fBuild.size() ? fBuild[f+1].offset : (Long64_t)1<<62;
+}
+
+
+//---------------------------------------------------------------------------------------------------------------
+void ZoneMap::Fill(Long64_t entry, TTree* tree, const float* values)
+{
+   //values of the columns at entry; tree is the tree of the file being read, for its clusters
+   if(fBuild.empty())
+      return;
+   if(entry<fCurFirst || entry>=fCurLast)
+      Locate(entry);
+   if(fCurrent<0)
+      return;
+   Build& build = fBuild[fCurrent];
+   FileZones& zones = build.zones;
+   //only a read of the whole file in order gives complete zones
+   if(entry!=build.offset+build.next || build.next==zones.entries)
+      return;
+   int ncols = fColumns.size();
+   if(build.next==0)
+   {
+      zones.bounds.clear();
+      Long64_t start;
+      if(tree && tree->GetEntries()==zones.entries)
+      {
+         TTree::TClusterIterator clusters = tree->GetClusterIterator(0);
+         while((start=clusters.Next())<zones.entries)
+            zones.bounds.push_back(start);
+      }
+      if(zones.bounds.empty() || zones.bounds[0]!=0)
+         zones.bounds.assign(1,0);
+      zones.bounds.push_back(zones.entries);
+      int nzones = zones.bounds.size()-1;
+      zones.min.assign((size_t)nzones*ncols,HUGE_VALF);
+      zones.max.assign((size_t)nzones*ncols,-HUGE_VALF);
+      build.zone = 0;
+   }
+   Long64_t local = build.next;
+   while(local>=zones.bounds[build.zone+1])
+      build.zone++;
+   float* lo = &zones.min[(size_t)build.zone*ncols];
+   float* hi = &zones.max[(size_t)build.zone*ncols];
+   for(int c=0; c<ncols; c++)
+   {
+      //a NaN could pass a cut like !(x>0): the zone is left unbounded
+      if(values[c]!=values[c])
+      {
+         lo[c] = -HUGE_VALF;
+         hi[c] = HUGE_VALF;
+         continue;
+      }
+      lo[c] = min(lo[c],values[c]);
+      hi[c] = max(hi[c],values[c]);
+   }
+   if(++build.next==zones.entries)
+   {
+      fCache[build.path] = zones;
+      fDirty = true;
+   }
+}
@@ -0,0 +1,73 @@
+#ifndef ZONEMAP_H
+#define ZONEMAP_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "TTree.h"
+#include "ChainIndex.hh"
+
+using namespace std;
+
+// Min and max of a few columns in each cluster of each file of a chain, persisted in a sidecar
+// text file next to the chain index. A pass can skip the clusters where the event selection
+// fails for every value in the ranges, without reading or decompressing them.
+// The zones of a file not in the sidecar (or changed since) are built while the file is read
+// from the first to the last entry, and are used from the next Attach on; KeepBuilding drops
+// the files that the entries read do not cover whole.
+class ZoneMap
+{
+   protected:
+      struct FileZones
+      {
+         Long64_t size;
+         Long_t mtime;
+         Long64_t entries;
+         std::vector<std::string> columns;
+         std::vector<Long64_t> bounds;      // first entry of each cluster in the file, then the entries
+         std::vector<float> min, max;       // cluster z, column c at z*ncolumns+c
+      };
+      struct Build
+      {
+         std::string path;
+         Long64_t offset;                   // first entry of the file in the chain
+         Long64_t next;                     // entries read in order from the start of the file
+         int zone;
+         FileZones zones;
+      };
+
+   // Data
+   protected:
+      std::string fIndexFile;
+      std::vector<std::string> fColumns;
+      std::map<std::string,FileZones> fCache;   // content of the sidecar
+      bool fDirty;
+      std::vector<Long64_t> fFirst, fLast;      // chain entries of the known zones, in order
+      std::vector<float> fMin, fMax;            // zone z, column c at z*ncolumns+c
+      std::vector<Build> fBuild;                // files without zones, in order
+      int fCurrent;                             // file of fBuild being read, -1 in a gap
+      Long64_t fCurFirst, fCurLast;             // entries of the current file or gap
+
+   // Methods
+   public:
+      ZoneMap(const std::string& indexfile, const std::vector<std::string>& columns);
+      void Attach(const ChainIndex& index);
+      int GetNZones() const {return fFirst.size();};
+      int GetNColumns() const {return fColumns.size();};
+      Long64_t GetFirst(int z) const {return fFirst[z];};
+      Long64_t GetLast(int z) const {return fLast[z];};
+      const float* GetMin(int z) const {return &fMin[(size_t)z*fColumns.size()];};
+      const float* GetMax(int z) const {return &fMax[(size_t)z*fColumns.size()];};
+      int FindZone(Long64_t entry, Long64_t& end) const;
+      bool IsBuilding() const {return !fBuild.empty();};
+      void KeepBuilding(std::vector<std::pair<Long64_t,Long64_t> > ranges);
+      void Fill(Long64_t entry, TTree* tree, const float* values);
+      bool Save();
+
+   protected:
+      bool Load();
+      void Locate(Long64_t entry);
+};
+
+#endif  // ZONEMAP_H
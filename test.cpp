@@ -1,11 +1,13 @@
 #include <iostream>
 #include "ConfigFile.hh"
 #include "EvAnalyz.hh"
+#include "AnalysisManager.hh"
 #include "TGraphErrors.h"
 #include "TMultiGraph.h"
 #include "TCanvas.h"
 #include "TApplication.h"
 #include "TSystem.h"
+#include "TROOT.h"
 
 int main (int argc, char **argv)
 {
@@ -14,6 +16,8 @@ int main (int argc, char **argv)
       cout<<"ERROR: unvalid number of input parameters\n";
       exit(EXIT_FAILURE);
    }
+   //every pass reads the chain on its own thread while this one writes the outputs
+   ROOT::EnableThreadSafety();
    ConfigFile config(argv[1]);
    
    bool interactive;
@@ -22,38 +26,22 @@ int main (int argc, char **argv)
    else
       interactive = false;
 
-   EvAnalyz data(config);
-   EvAnalyz data_amw = data.AmpCorrection();
-
-   TGraphErrors *gr_rms = data_amw.ThrScan("rms");
-   TGraphErrors *gr_fit = data_amw.ThrScan("fit");
-   TGraphErrors *gr_smallint = data_amw.ThrScan("smallestinterval");
-
-   gr_rms->SetMarkerStyle(20);
-   gr_fit->SetMarkerStyle(20);
-   gr_smallint->SetMarkerStyle(20);
-
-   gr_rms->SetMarkerColor(1);
-   gr_fit->SetMarkerColor(2);
-   gr_smallint->SetMarkerColor(3);
-
-
    TApplication *myapp;
    if(interactive)
       myapp=new TApplication("myapp",0,0);
 
-   TMultiGraph* mg = new TMultiGraph();
-   mg->Add(gr_rms);
-   mg->Add(gr_fit);
-   mg->Add(gr_smallint);
-   TCanvas *cc = new TCanvas(); 
-   mg->Draw("APL");
-   cc->Print("RMS.pdf");
+   AnalysisManager analysis(argv[1]);
+   analysis.Run();
+   if(config.keyExists("server"))
+      analysis.Serve(config.read<string>("server"));
 
-   data_amw.DrawHistos();
-   data_amw.DrawProfiles();
    if(interactive)
+   {
+      //recompute what depends on the modified keys whenever the configuration file changes
+      ConfigWatcher watcher(&analysis);
+      watcher.TurnOn();
       myapp->Run();
+   }
    //EvAnalyz data_rtcorr = data.RiseTimeCorrection();
    //EvAnalyz data_amw = data.MitigatedAmpCorrection(2000,5000);
    //data_amw.SetRiseTimeRange(-0.2,0.2);